@@ -12,11 +12,17 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h> /* open, write */
+#include <errno.h>
 
 #include "statistics.h"
 #include "cpu.h"
 #include "irq.h"
 #include "balance.h"
+#include "cpuidle.h"
+#include "verify.h"
+#include "engine.h"
+#include "source.h"
+#include "probes.h"
 
 /* Drop the dont_move flag on all IRQs for specified CPU */
 static int dec_weight(cpu_t *cpu, int value)
@@ -72,15 +78,48 @@ int move_irq_to_cpu(irq_t *irq, cpu_t *cpu)
 	}
 	dec_weight(cpu, 1);
 	irq->cpu = cpu;
+	cpus_clear(irq->group);
 	lub_list_add(cpu->irqs, irq);
 
 	return 0;
 }
 
+/* Load of target CPU for IRQ. The IRQ moved by forecast must not land
+   on CPU that is predicted to overload too. So the predicted CPU load
+   plus predicted IRQ load is used for such IRQ. */
+static float target_load(const cpu_t *cpu, const irq_t *irq)
+{
+	float load = cpu->load;
+
+	if (!irq || !irq->predictive)
+		return load;
+	if (cpu->predicted_load > load)
+		load = cpu->predicted_load;
+	if ((irq->cpu != cpu) && (irq->forecast.rate > 0))
+		load += irq->load * irq->forecast.predicted /
+			irq->forecast.rate;
+
+	return load;
+}
+
+/* The IRQ is heavy if its load is surely not less than heavy_load.
+   The load within measurement error from heavy_load is not heavy. So
+   the IRQs are not evacuated and the heavy class is not chosen due to
+   the noise. The heavy_load=0 means there are no heavy IRQs. */
+static int irq_heavy(const irq_t *irq, float heavy_load)
+{
+	if (heavy_load <= 0)
+		return 0;
+	return ((irq->load - irq->load_error) >= heavy_load);
+}
+
 /* Search for the best CPU. Best CPU is a CPU with minimal load.
+   The load is normalized by CPU capacity. The CPU is not used if its
+   load within measurement error can reach load_limit.
    If several CPUs have the same load then the best CPU is a CPU
    with minimal number of assigned IRQs */
-static cpu_t *choose_cpu(lub_list_t *cpus, cpumask_t *cpumask, float load_limit)
+static cpu_t *choose_cpu(lub_list_t *cpus, cpumask_t *cpumask, float load_limit,
+	const irq_t *irq)
 {
 	lub_list_node_t *iter;
 	lub_list_t * min_cpus = NULL;
@@ -90,13 +129,16 @@ static cpu_t *choose_cpu(lub_list_t *cpus, cpumask_t *cpumask, float load_limit)
 
 	for (iter = lub_list_iterator_init(cpus); iter;
 		iter = lub_list_iterator_next(iter)) {
+		float load;
 		cpu = (cpu_t *)lub_list_node__get_data(iter);
 		if (!cpu_isset(cpu->id, *cpumask))
 			continue;
-		if (cpu->load >= load_limit)
+		load = target_load(cpu, irq);
+		if ((load + cpu->load_error) >= load_limit)
 			continue;
-		if ((!min_cpus) || (cpu->load < min_load)) {
-			min_load = cpu->load;
+		load = cpu_load_norm_value(cpu, load);
+		if ((!min_cpus) || (load < min_load)) {
+			min_load = load;
 			if (!min_cpus)
 				min_cpus = lub_list_new(cpu_list_compare_len);
 			while ((node = lub_list__get_tail(min_cpus))) {
@@ -105,7 +147,7 @@ static cpu_t *choose_cpu(lub_list_t *cpus, cpumask_t *cpumask, float load_limit)
 			}
 			lub_list_add(min_cpus, cpu);
 		}
-		if (cpu->load == min_load)
+		if (load == min_load)
 			lub_list_add(min_cpus, cpu);
 	}
 	if (!min_cpus)
@@ -121,11 +163,75 @@ static cpu_t *choose_cpu(lub_list_t *cpus, cpumask_t *cpumask, float load_limit)
 	return cpu;
 }
 
-static int irq_set_affinity(irq_t *irq, cpumask_t *cpumask)
+/* Number of random probes to find one allowed CPU for "p2c" strategy.
+   The CPU IDs are probed uniformly so sparse masks can miss. */
+#define P2C_PROBES 8
+
+/* Power of d choices. Sample "choices" random CPUs from the allowed
+   CPU mask and get the least loaded one. It doesn't scan all CPUs and
+   the different IRQs don't gather on the same "best" CPU. Fall back
+   to full scan if random probes can't find allowed CPU. The sampled ID
+   is resolved by the dense CPU table so the probe is O(1). */
+static cpu_t *choose_cpu_p2c(birq_t *birq, lub_list_t *cpus,
+	cpumask_t *cpumask, float load_limit, unsigned int choices, const irq_t *irq)
+{
+	lub_list_node_t *node;
+	cpu_t *best = NULL;
+	float best_load = 0;
+	unsigned int max_id;
+	unsigned int i;
+
+	if (cpus_empty(*cpumask))
+		return NULL;
+	if (!(node = lub_list__get_tail(cpus)))
+		return NULL;
+	max_id = ((cpu_t *)lub_list_node__get_data(node))->id;
+
+	for (i = 0; i < choices; i++) {
+		unsigned int probe;
+		for (probe = 0; probe < P2C_PROBES; probe++) {
+			cpu_t *cpu;
+			float load;
+			unsigned int id = rand() % (max_id + 1);
+			if (!cpu_isset(id, *cpumask))
+				continue;
+			if (!(cpu = cpu_list_search(birq, cpus, id)))
+				continue;
+			load = target_load(cpu, irq);
+			if ((load + cpu->load_error) >= load_limit)
+				continue;
+			load = cpu_load_norm_value(cpu, load);
+			if (!best || (load < best_load) ||
+				((load == best_load) &&
+				(lub_list_len(cpu->irqs) < lub_list_len(best->irqs)))) {
+				best = cpu;
+				best_load = load;
+			}
+			break;
+		}
+	}
+	if (!best)
+		return choose_cpu(cpus, cpumask, load_limit, irq);
+
+	return best;
+}
+
+/* Choose target CPU due to specified strategy */
+static cpu_t *select_cpu(birq_t *birq, lub_list_t *cpus,
+	cpumask_t *cpumask, float load_limit, birq_cpu_strategy_e strategy,
+	unsigned int choices, const irq_t *irq)
+{
+	if ((strategy == BIRQ_CPU_P2C) && (choices > 0))
+		return choose_cpu_p2c(birq, cpus, cpumask, load_limit, choices,
+			irq);
+	return choose_cpu(cpus, cpumask, load_limit, irq);
+}
+
+static int irq_set_affinity(birq_t *birq, irq_t *irq, cpumask_t *cpumask)
 {
 	char path[PATH_MAX];
 	char buf[NR_CPUS + 1];
-	int f;
+	int err;
 
 	if (!irq)
 		return -1;
@@ -133,92 +239,678 @@ static int irq_set_affinity(irq_t *irq, cpumask_t *cpumask)
 	snprintf(path, sizeof(path),
 		"%s/%u/smp_affinity", PROC_IRQ, irq->irq);
 	path[sizeof(path) - 1] = '\0';
-	if ((f = open(path, O_WRONLY | O_SYNC)) < 0)
-		return -1;
 	cpumask_scnprintf(buf, sizeof(buf), *cpumask);
 	buf[sizeof(buf) - 1] = '\0';
-	if (write(f, buf, strlen(buf)) < 0) {
+	err = sink_write(birq, path, buf);
+	BIRQ_PROBE3(affinity, irq->irq, irq->cpu ? (int)irq->cpu->id : -1, err);
+	if (!err) {
+		irq->fails = 0;
+		cpus_copy(irq->written, *cpumask);
+		/* The CPU has more vectors than estimated */
+		if (irq->cpu && irq->cpu->vectors &&
+			(lub_list_len(irq->cpu->irqs) > irq->cpu->vectors))
+			irq->cpu->vectors = lub_list_len(irq->cpu->irqs);
+		return 0;
+	}
+	/* IRQ has disappeared */
+	if (err == ENOENT)
+		return -1;
+
+	if (err == EIO) {
 		/* The affinity for some IRQ can't be changed. So don't
-		   consider such IRQs. The example is IRQ 0 - timer.
-		   Blacklist this IRQ. Note fprintf() without fflush()
-		   will not return I/O error due to buffers. */
+		   consider such IRQs. The examples are IRQ 0 - timer and
+		   kernel managed IRQs. Blacklist this IRQ. */
 		irq->blacklisted = 1;
 		remove_irq_from_cpu(irq, irq->cpu);
-		printf("Blacklist IRQ %u\n", irq->irq);
+		birq_log(birq, LOG_INFO, "Blacklist IRQ %u", irq->irq);
+		return -1;
 	}
-	close(f);
 
-	return 0;
+	if ((err == ENOSPC) && irq->cpu) {
+		/* The target CPU has run out of vectors. It's not a
+		   problem of IRQ. The CPU can't get more IRQs than it has
+		   now. Retry with another CPU on next iteration. */
+		irq->cpu->vectors = lub_list_len(irq->cpu->irqs) - 1;
+		birq_log(birq, LOG_INFO, "CPU%u is out of vectors, budget %u IRQs",
+			irq->cpu->id, irq->cpu->vectors);
+		irq->retry = 1;
+	} else {
+		/* Transient failure. Retry with exponential backoff. */
+		if (irq->fails < AFFINITY_BACKOFF_SHIFT)
+			irq->fails++;
+		irq->retry = 1 << irq->fails;
+		birq_log(birq, LOG_INFO,
+			"Can't set IRQ %u affinity: %s, retry in %u iterations",
+			irq->irq, strerror(err), irq->retry);
+	}
+	remove_irq_from_cpu(irq, irq->cpu);
+
+	return -1;
+}
+
+/* Get CPUs suitable for latency-sensitive IRQs. These are CPUs from the
+   "awake" set and the CPUs that mostly use shallow idle states. */
+static void latency_cpus(lub_list_t *cpus, cpumask_t *awake_cpus,
+	cpumask_t *cpumask)
+{
+	lub_list_node_t *iter;
+
+	cpus_copy(*cpumask, *awake_cpus);
+	for (iter = lub_list_iterator_init(cpus); iter;
+		iter = lub_list_iterator_next(iter)) {
+		cpu_t *cpu = (cpu_t *)lub_list_node__get_data(iter);
+		/* No idle statistics */
+		if (!cpu->old_idle_stamp)
+			continue;
+		if (cpu->idle_latency <= CPUIDLE_SHALLOW_LATENCY)
+			cpu_set(cpu->id, *cpumask);
+	}
+}
+
+/* Get the most powerful CPUs. Heavy IRQs prefer them. The CPUs within
+   CPU_CAPACITY_TOLERANCE from the most powerful one are powerful too. */
+static void big_cpus(lub_list_t *cpus, cpumask_t *cpumask)
+{
+	lub_list_node_t *iter;
+	unsigned int max_capacity = 0;
+
+	cpus_clear(*cpumask);
+	for (iter = lub_list_iterator_init(cpus); iter;
+		iter = lub_list_iterator_next(iter)) {
+		cpu_t *cpu = (cpu_t *)lub_list_node__get_data(iter);
+		if (cpu->capacity > max_capacity)
+			max_capacity = cpu->capacity;
+	}
+	for (iter = lub_list_iterator_init(cpus); iter;
+		iter = lub_list_iterator_next(iter)) {
+		cpu_t *cpu = (cpu_t *)lub_list_node__get_data(iter);
+		if (cpu->capacity * 100 >=
+			max_capacity * (100 - CPU_CAPACITY_TOLERANCE))
+			cpu_set(cpu->id, *cpumask);
+	}
+}
+
+/* Target CPU search parameters */
+struct target_s {
+	birq_t *birq;
+	lub_list_t *cpus;
+	float load_limit;
+	birq_cpu_strategy_e strategy;
+	unsigned int choices;
+	float heavy_load;
+	cpumask_t shallow_cpus; /* CPUs for latency-sensitive IRQs */
+	cpumask_t powerful_cpus; /* CPUs for heavy IRQs */
+	cpumask_t avoid_cpus; /* Use these CPUs only if there is no other */
+};
+
+/* Get CPUs to avoid as targets. See CPU_AVOID_* reasons. */
+static void avoid_cpus(lub_list_t *cpus, cpumask_t *cpumask)
+{
+	lub_list_node_t *iter;
+
+	cpus_clear(*cpumask);
+	for (iter = lub_list_iterator_init(cpus); iter;
+		iter = lub_list_iterator_next(iter)) {
+		cpu_t *cpu = (cpu_t *)lub_list_node__get_data(iter);
+		if (cpu->avoid)
+			cpu_set(cpu->id, *cpumask);
+	}
+}
+
+/* Choose CPU for IRQ within specified CPUs due to IRQ class */
+static cpu_t *choose_irq_cpu_within(struct target_s *t, irq_t *irq,
+	cpumask_t *possible_cpus)
+{
+	cpu_t *cpu = NULL;
+	cpumask_t class_cpus;
+
+	cpus_init(class_cpus);
+	/* The latency-sensitive IRQs prefer CPUs with shallow
+	   idle states. The exit from deep state is slow. */
+	if (irq->latency) {
+		cpus_and(class_cpus, *possible_cpus, t->shallow_cpus);
+		cpu = select_cpu(t->birq, t->cpus, &class_cpus, t->load_limit,
+			t->strategy, t->choices, irq);
+	}
+	/* Heavy IRQs prefer the most powerful CPUs on
+	   heterogeneous platforms */
+	if (!cpu && irq_heavy(irq, t->heavy_load)) {
+		cpus_and(class_cpus, *possible_cpus, t->powerful_cpus);
+		cpu = select_cpu(t->birq, t->cpus, &class_cpus, t->load_limit,
+			t->strategy, t->choices, irq);
+	}
+	cpus_free(class_cpus);
+	if (!cpu)
+		cpu = select_cpu(t->birq, t->cpus, possible_cpus, t->load_limit,
+			t->strategy, t->choices, irq);
+
+	return cpu;
+}
+
+/* Choose CPU for IRQ. Try CPUs near the IRQ consumer and CPUs that
+   are not avoided first. */
+static cpu_t *choose_irq_cpu(struct target_s *t, irq_t *irq,
+	cpumask_t *possible_cpus)
+{
+	cpu_t *cpu = NULL;
+	cpumask_t preferred_cpus;
+
+	cpus_init(preferred_cpus);
+	if (!cpus_empty(irq->consumer_cpus)) {
+		cpus_complement(preferred_cpus, t->avoid_cpus);
+		cpus_and(preferred_cpus, preferred_cpus, *possible_cpus);
+		cpus_and(preferred_cpus, preferred_cpus, irq->consumer_cpus);
+		cpu = choose_irq_cpu_within(t, irq, &preferred_cpus);
+		if (!cpu) {
+			cpus_and(preferred_cpus, *possible_cpus,
+				irq->consumer_cpus);
+			cpu = choose_irq_cpu_within(t, irq, &preferred_cpus);
+		}
+		if (cpu) {
+			cpus_free(preferred_cpus);
+			return cpu;
+		}
+	}
+
+	cpus_complement(preferred_cpus, t->avoid_cpus);
+	cpus_and(preferred_cpus, preferred_cpus, *possible_cpus);
+	cpu = choose_irq_cpu_within(t, irq, &preferred_cpus);
+	cpus_free(preferred_cpus);
+	if (!cpu)
+		cpu = choose_irq_cpu_within(t, irq, possible_cpus);
+
+	return cpu;
+}
+
+/* Get the group of CPU due to placement unit. The groups are found
+   once per topology scan. */
+static void cpu_group(cpu_t *cpu, irq_gran_e gran, cpumask_t *cpumask)
+{
+	if (gran == IRQ_GRAN_LLC)
+		cpus_copy(*cpumask, cpu->llc_cpus);
+	else if (gran == IRQ_GRAN_CORE)
+		cpus_copy(*cpumask, cpu->core_cpus);
+	else
+		cpus_copy(*cpumask, cpu->cpumask);
+}
+
+/* Find the least loaded group of CPUs for IRQ with group placement
+   unit. The group is limited to possible CPUs. The load of group is
+   average load of its CPUs. The group mask is returned within "group".
+   The returned CPU is the home CPU of group. It holds IRQ for load
+   accounting like on the next iterations. Each group is considered
+   once. The groups with the same load are compared by number of
+   IRQs. */
+static cpu_t *choose_irq_group(struct target_s *t, irq_t *irq,
+	cpumask_t *possible, cpumask_t *group)
+{
+	lub_list_node_t *iter;
+	cpu_t *best = NULL;
+	float best_load = 0;
+	unsigned int best_irqs = 0;
+	cpumask_t cpumask;
+	cpumask_t seen;
+
+	cpus_init(cpumask);
+	cpus_init(seen);
+	cpus_clear(*group);
+	cpus_clear(seen);
+	/* Prefer consumer CPUs */
+	if (!cpus_empty(irq->consumer_cpus)) {
+		cpus_and(cpumask, *possible, irq->consumer_cpus);
+		if (!cpus_empty(cpumask))
+			possible = &cpumask;
+	}
+	for (iter = lub_list_iterator_init(t->cpus); iter;
+		iter = lub_list_iterator_next(iter)) {
+		cpu_t *cpu = (cpu_t *)lub_list_node__get_data(iter);
+		lub_list_node_t *iter2;
+		cpumask_t members;
+		float sum = 0;
+		float error = 0;
+		unsigned int num = 0;
+		unsigned int irqs = 0;
+
+		if (!cpu_isset(cpu->id, *possible))
+			continue;
+		if (cpu_isset(cpu->id, seen))
+			continue;
+		cpus_init(members);
+		cpu_group(cpu, irq->granularity, &members);
+		cpus_and(members, members, *possible);
+		cpus_or(seen, seen, members);
+		for (iter2 = lub_list_iterator_init(t->cpus); iter2;
+			iter2 = lub_list_iterator_next(iter2)) {
+			cpu_t *member = (cpu_t *)lub_list_node__get_data(iter2);
+			if (!cpu_isset(member->id, members))
+				continue;
+			sum += cpu_load_norm_value(member,
+				target_load(member, irq));
+			error += member->load_error;
+			irqs += lub_list_len(member->irqs);
+			num++;
+		}
+		if (num && ((sum + error) / num < t->load_limit) &&
+			(!best || (sum / num < best_load) ||
+			((sum / num == best_load) && (irqs < best_irqs)))) {
+			best = cpu_list_group_home(t->birq, t->cpus, &members);
+			best_load = sum / num;
+			best_irqs = irqs;
+			cpus_copy(*group, members);
+		}
+		cpus_free(members);
+	}
+	cpus_free(seen);
+	cpus_free(cpumask);
+
+	return best;
+}
+
+/* Choose target CPU due to placement unit of IRQ. The group doesn't
+   include avoided CPUs if possible. */
+static cpu_t *choose_target(struct target_s *t, irq_t *irq,
+	cpumask_t *possible, cpumask_t *group)
+{
+	cpu_t *cpu;
+	cpumask_t preferred_cpus;
+
+	cpus_clear(*group);
+	if (irq->granularity == IRQ_GRAN_CPU)
+		return choose_irq_cpu(t, irq, possible);
+	cpus_init(preferred_cpus);
+	cpus_complement(preferred_cpus, t->avoid_cpus);
+	cpus_and(preferred_cpus, preferred_cpus, *possible);
+	cpu = choose_irq_group(t, irq, &preferred_cpus, group);
+	cpus_free(preferred_cpus);
+	if (!cpu)
+		cpu = choose_irq_group(t, irq, possible, group);
+
+	return cpu;
+}
+
+/* Get CPUs the IRQ belongs to. These are local CPUs (native NUMA
+   node). The vfio IRQ is serviced by guest so it prefers the CPUs of
+   guest vCPU threads within local CPUs. If the guest runs on other
+   NUMA node only then the IRQ follows the guest anyway. */
+static void irq_home_cpus(const irq_t *irq, cpumask_t *cpumask)
+{
+	cpus_copy(*cpumask, irq->local_cpus);
+	if (cpus_empty(irq->vcpu_cpus))
+		return;
+	cpus_and(*cpumask, *cpumask, irq->vcpu_cpus);
+	if (cpus_empty(*cpumask))
+		cpus_copy(*cpumask, irq->vcpu_cpus);
+}
+
+/* Get CPUs with exhausted vector budget. Such CPUs can't get
+   more IRQs. */
+static void full_cpus(lub_list_t *cpus, cpumask_t *cpumask)
+{
+	lub_list_node_t *iter;
+
+	cpus_clear(*cpumask);
+	for (iter = lub_list_iterator_init(cpus); iter;
+		iter = lub_list_iterator_next(iter)) {
+		cpu_t *cpu = (cpu_t *)lub_list_node__get_data(iter);
+		if (cpu->vectors && (lub_list_len(cpu->irqs) >= cpu->vectors))
+			cpu_set(cpu->id, *cpumask);
+	}
+}
+
+/* Prepare target CPU search parameters */
+static void target_init(struct target_s *t, birq_t *birq, lub_list_t *cpus,
+	float load_limit, birq_cpu_strategy_e cpu_strategy,
+	unsigned int cpu_choices, cpumask_t *awake_cpus, float heavy_load)
+{
+	t->birq = birq;
+	t->cpus = cpus;
+	t->load_limit = load_limit;
+	t->strategy = cpu_strategy;
+	t->choices = cpu_choices;
+	t->heavy_load = heavy_load;
+	cpus_init(t->shallow_cpus);
+	latency_cpus(cpus, awake_cpus, &t->shallow_cpus);
+	cpus_init(t->powerful_cpus);
+	big_cpus(cpus, &t->powerful_cpus);
+	cpus_init(t->avoid_cpus);
+	avoid_cpus(cpus, &t->avoid_cpus);
+}
+
+static void target_free(struct target_s *t)
+{
+	cpus_free(t->shallow_cpus);
+	cpus_free(t->powerful_cpus);
+	cpus_free(t->avoid_cpus);
+}
+
+/* Find best CPU for IRQ. The group mask is returned within "group"
+   for group placement unit. */
+static cpu_t *choose_irq_target(struct target_s *t, irq_t *irq,
+	cpumask_t *exclude_cpus, int non_local_cpus, cpumask_t *group)
+{
+	cpu_t *cpu;
+	cpumask_t possible_cpus;
+	cpumask_t deny_cpus;
+	cpumask_t home_cpus;
+
+	/* Don't use excluded CPUs and CPUs without free vectors */
+	cpus_init(deny_cpus);
+	full_cpus(t->cpus, &deny_cpus);
+	if (irq->cpu) /* IRQ has its vector on current CPU already */
+		cpu_clear(irq->cpu->id, deny_cpus);
+	cpus_or(deny_cpus, deny_cpus, *exclude_cpus);
+	/* Try to find local CPU to move IRQ to.
+	   The local CPU is CPU with native NUMA node. */
+	/* Possible CPUs is local CPUs minus denied CPUs.
+	   possible_cpus = local_cpus & ~deny_cpus */
+	cpus_init(possible_cpus);
+	cpus_init(home_cpus);
+	irq_home_cpus(irq, &home_cpus);
+	cpus_copy(possible_cpus, deny_cpus);
+	cpus_complement(possible_cpus, possible_cpus);
+	cpus_and(possible_cpus, possible_cpus, home_cpus);
+	cpus_free(home_cpus);
+	cpu = choose_target(t, irq, &possible_cpus, group);
+	cpus_free(possible_cpus);
+	/* If local CPU is not found then try to use
+	   CPU from another NUMA node. It's better then
+	   overloaded CPUs. */
+	/* Non-local CPUs were disabled. It seems there is
+	   no advantages to use them. The all interactions will
+	   be held by QPI-like interfaces through local CPUs. */
+	/* May be the previous note is wrong. Using of non local
+	   cpus depends on config option "non_local_cpus" now. */
+	/* The vfio IRQ stays within vCPU threads CPUs anyway. */
+	if (!cpu && non_local_cpus) {
+		cpus_init(possible_cpus);
+		cpus_copy(possible_cpus, deny_cpus);
+		cpus_or(possible_cpus, possible_cpus, irq->local_cpus);
+		cpus_complement(possible_cpus, possible_cpus);
+		if (!cpus_empty(irq->vcpu_cpus))
+			cpus_and(possible_cpus, possible_cpus,
+				irq->vcpu_cpus);
+		cpu = choose_target(t, irq, &possible_cpus, group);
+		cpus_free(possible_cpus);
+	}
+	cpus_free(deny_cpus);
+
+	return cpu;
 }
 
 /* Find best CPUs for IRQs need to be balanced. */
-int balance(lub_list_t *cpus, lub_list_t *balance_irqs,
-	float load_limit, cpumask_t *exclude_cpus, int non_local_cpus)
+int balance(birq_t *birq, lub_list_t *cpus, lub_list_t *balance_irqs,
+	float load_limit, cpumask_t *exclude_cpus, int non_local_cpus,
+	birq_cpu_strategy_e cpu_strategy, unsigned int cpu_choices,
+	cpumask_t *awake_cpus, float heavy_load)
 {
 	lub_list_node_t *iter;
+	struct target_s t;
 
+	target_init(&t, birq, cpus, load_limit, cpu_strategy, cpu_choices,
+		awake_cpus, heavy_load);
 	for (iter = lub_list_iterator_init(balance_irqs); iter;
 		iter = lub_list_iterator_next(iter)) {
 		irq_t *irq;
 		cpu_t *cpu;
-		cpumask_t possible_cpus;
+		cpumask_t group;
 
 		irq = (irq_t *)lub_list_node__get_data(iter);
-		/* Try to find local CPU to move IRQ to.
-		   The local CPU is CPU with native NUMA node. */
-		/* Possible CPUs is local CPUs minus exclude-CPUs.
-		   possible_cpus = local_cpus & ~exclude_cpus */
-		cpus_init(possible_cpus);
-		cpus_copy(possible_cpus, *exclude_cpus);
-		cpus_complement(possible_cpus, possible_cpus);
-		cpus_and(possible_cpus, possible_cpus, irq->local_cpus);
-		cpu = choose_cpu(cpus, &possible_cpus, load_limit);
-		cpus_free(possible_cpus);
-		/* If local CPU is not found then try to use
-		   CPU from another NUMA node. It's better then
-		   overloaded CPUs. */
-		/* Non-local CPUs were disabled. It seems there is
-		   no advantages to use them. The all interactions will
-		   be held by QPI-like interfaces through local CPUs. */
-		/* May be the previous note is wrong. Using of non local
-		   cpus depends on config option "non_local_cpus" now. */
-		if (!cpu && non_local_cpus) {
-			cpus_init(possible_cpus);
-			cpus_copy(possible_cpus, *exclude_cpus);
-			cpus_or(possible_cpus, possible_cpus, irq->local_cpus);
-			cpus_complement(possible_cpus, possible_cpus);
-			cpu = choose_cpu(cpus, &possible_cpus, load_limit);
-			cpus_free(possible_cpus);
-		}
-
-		if (cpu) {
+		cpus_init(group);
+		cpu = choose_irq_target(&t, irq, exclude_cpus, non_local_cpus,
+			&group);
+		if (cpu && !birq->quiet) {
+			BIRQ_PROBE3(move, irq->irq,
+				irq->cpu ? (int)irq->cpu->id : -1, cpu->id);
 			if (irq->cpu)
-				printf("Move IRQ %u from CPU%u to CPU%u\n",
+				birq_log(birq, LOG_INFO,
+					"Move IRQ %u from CPU%u to CPU%u",
 					irq->irq, irq->cpu->id, cpu->id);
 			else
-				printf("Move IRQ %u to CPU%u\n", irq->irq, cpu->id);
+				birq_log(birq, LOG_INFO, "Move IRQ %u to CPU%u",
+					irq->irq, cpu->id);
+		}
+		if (cpu) {
 			move_irq_to_cpu(irq, cpu);
+			if (cpus_weight(group) > 1)
+				cpus_copy(irq->group, group);
 		}
+		irq->predictive = 0;
+		cpus_free(group);
 	}
+	target_free(&t);
 
 	return 0;
 }
 
-int apply_affinity(lub_list_t *balance_irqs)
+/* Return IRQs with failed affinity write to balancer when their
+   backoff is expired. Hold them till this moment. */
+void retry_affinity(birq_t *birq, lub_list_t *irqs, lub_list_t *balance_irqs)
 {
 	lub_list_node_t *iter;
 
+	for (iter = lub_list_iterator_init(irqs); iter;
+		iter = lub_list_iterator_next(iter)) {
+		irq_t *irq = (irq_t *)lub_list_node__get_data(iter);
+
+		if (!irq->retry || irq->blacklisted || irq->frozen)
+			continue;
+		/* Don't move this IRQ while next iteration. */
+		irq->weight = 1;
+		irq->retry--;
+		if (irq->retry)
+			continue;
+		birq_log(birq, LOG_INFO, "Retry IRQ %u affinity", irq->irq);
+		lub_list_add(balance_irqs, irq);
+	}
+}
+
+/* Apply new affinities as a transaction. Write all masks, then
+   check the moves take effect. The unconfirmed moves stay pending
+   and are checked on next iterations by check_affinity(). */
+int apply_affinity(birq_t *birq, lub_list_t *balance_irqs)
+{
+	lub_list_node_t *iter;
+
+	verify_prepare(birq, balance_irqs);
 	for (iter = lub_list_iterator_init(balance_irqs); iter;
 		iter = lub_list_iterator_next(iter)) {
 		irq_t *irq;
 		irq = (irq_t *)lub_list_node__get_data(iter);
 		if (!irq->cpu)
 			continue;
-		irq_set_affinity(irq, &(irq->cpu->cpumask));
+		irq->pending_stamp = birq_clock(birq);
+		/* The previous affinity was read on this iteration */
+		cpus_copy(irq->rollback, irq->affinity);
+		/* Write the group mask for group placement unit */
+		if (!irq_set_affinity(birq, irq, cpus_empty(irq->group) ?
+			&(irq->cpu->cpumask) : &irq->group))
+			irq->pending = 1;
+	}
+
+	verify_affinity(birq, balance_irqs);
+
+	return 0;
+}
+
+/* Check the moves pending since previous iterations. Roll back the
+   failed moves. The IRQ will be relinked to its CPU on next iteration.
+   The failed move is retried with exponential backoff like failed
+   write. The IRQ is blacklisted after AFFINITY_ROLLBACK_LIMIT
+   successive failed moves. Don't move the still pending IRQs while
+   they are pending. */
+void check_affinity(birq_t *birq, lub_list_t *irqs)
+{
+	lub_list_node_t *iter;
+
+	verify_pending(birq, irqs);
+	for (iter = lub_list_iterator_init(irqs); iter;
+		iter = lub_list_iterator_next(iter)) {
+		irq_t *irq = (irq_t *)lub_list_node__get_data(iter);
+
+		if (irq->pending > 0) {
+			irq->weight = 1;
+			continue;
+		}
+		if (irq->pending != VERIFY_FAILED)
+			continue;
+		irq->pending = 0;
+		if (!irq->cpu)
+			continue;
+		birq_log(birq, LOG_INFO,
+			"IRQ %u affinity didn't take effect on CPU%u, roll back",
+			irq->irq, irq->cpu->id);
+		remove_irq_from_cpu(irq, irq->cpu);
+		if (!cpus_empty(irq->rollback))
+			irq_set_affinity(birq, irq, &irq->rollback);
+		irq->rollbacks++;
+		if (irq->rollbacks >= AFFINITY_ROLLBACK_LIMIT) {
+			irq->blacklisted = 1;
+			irq->retry = 0;
+			birq_log(birq, LOG_INFO, "Blacklist IRQ %u", irq->irq);
+			continue;
+		}
+		/* The successful rollback write resets the write failures */
+		irq->fails = irq->rollbacks;
+		irq->retry = 1 << irq->fails;
+		birq_log(birq, LOG_INFO, "Retry IRQ %u affinity in %u iterations",
+			irq->irq, irq->retry);
+	}
+}
+
+/* Order IRQs by load, the heaviest first. Then by number of
+   interrupts. */
+static int irq_list_compare_load(const void *first, const void *second)
+{
+	const irq_t *f = (const irq_t *)first;
+	const irq_t *s = (const irq_t *)second;
+
+	if (f->load != s->load)
+		return (f->load < s->load) ? 1 : -1;
+	if (f->intr != s->intr)
+		return (f->intr < s->intr) ? 1 : -1;
+	return (f->irq - s->irq);
+}
+
+/* Cost of IRQ within global placement. The IRQ without measured load
+   is estimated by its rate and the average load of one interrupt. The
+   cost is not less than PLACE_MIN_COST. So the IRQs without load are
+   spread over CPUs instead of landing on the same "least loaded" one. */
+static float place_cost(const irq_t *irq, float intr_load)
+{
+	float cost = irq->load;
+
+	if (cost <= 0)
+		cost = irq->intr * intr_load;
+	if (cost < PLACE_MIN_COST)
+		cost = PLACE_MIN_COST;
+
+	return cost;
+}
+
+/* Global placement of all IRQs at once. The estimated IRQ loads are
+   removed from CPU loads. Then IRQs are placed one by one, the heaviest
+   first, to the least loaded CPU (greedy LPT scheduling). The target is
+   chosen like balance() does, so the load limit, CPUs without free
+   vectors, avoided CPUs and placement units are respected. The CPU
+   load grows with the cost of each placed IRQ. See place_cost(). The
+   CPUs with equal load are compared by number of IRQs. The stormy IRQs
+   and IRQs waiting for affinity write retry stay. The placed IRQs are
+   added to balance_irqs list. */
+int place_irqs(birq_t *birq, lub_list_t *cpus, lub_list_t *irqs,
+	lub_list_t *balance_irqs, float load_limit, cpumask_t *exclude_cpus,
+	int non_local_cpus, cpumask_t *awake_cpus, float heavy_load)
+{
+	lub_list_node_t *iter;
+	lub_list_t *order;
+	lub_list_node_t *node;
+	struct target_s t;
+	float load_sum = 0;
+	unsigned long long intr_sum = 0;
+	float intr_load = 0;
+
+	/* Leave the load that doesn't belong to known IRQs */
+	order = lub_list_new(irq_list_compare_load);
+	for (iter = lub_list_iterator_init(irqs); iter;
+		iter = lub_list_iterator_next(iter)) {
+		irq_t *irq = (irq_t *)lub_list_node__get_data(iter);
+		if (irq->blacklisted || irq->frozen)
+			continue;
+		if (irq->storm || irq->retry)
+			continue;
+		/* Average load of one interrupt */
+		if ((irq->load > 0) && irq->intr) {
+			load_sum += irq->load;
+			intr_sum += irq->intr;
+		}
+		if (irq->cpu) {
+			irq->cpu->load -= irq->load;
+			if (irq->cpu->load < 0)
+				irq->cpu->load = 0;
+			remove_irq_from_cpu(irq, irq->cpu);
+		}
+		lub_list_add(order, irq);
+	}
+	if (intr_sum)
+		intr_load = load_sum / intr_sum;
+
+	target_init(&t, birq, cpus, load_limit, BIRQ_CPU_MIN, 0,
+		awake_cpus, heavy_load);
+	for (iter = lub_list_iterator_init(order); iter;
+		iter = lub_list_iterator_next(iter)) {
+		irq_t *irq = (irq_t *)lub_list_node__get_data(iter);
+		cpumask_t group;
+		cpu_t *cpu;
+
+		cpus_init(group);
+		cpu = choose_irq_target(&t, irq, exclude_cpus, non_local_cpus,
+			&group);
+		if (cpu) {
+			move_irq_to_cpu(irq, cpu);
+			if (cpus_weight(group) > 1)
+				cpus_copy(irq->group, group);
+			cpu->load += place_cost(irq, intr_load);
+			lub_list_add(balance_irqs, irq);
+		}
+		cpus_free(group);
+	}
+	target_free(&t);
+
+	while ((node = lub_list__get_tail(order))) {
+		lub_list_del(order, node);
+		lub_list_node_free(node);
 	}
+	lub_list_free(order);
+
 	return 0;
 }
 
+/* Print the placement as shell script instead of applying it */
+int print_plan(FILE *out, lub_list_t *balance_irqs)
+{
+	lub_list_node_t *iter;
+
+	fprintf(out, "#!/bin/sh\n");
+	fprintf(out, "# IRQ placement generated by birq\n");
+	for (iter = lub_list_iterator_init(balance_irqs); iter;
+		iter = lub_list_iterator_next(iter)) {
+		irq_t *irq = (irq_t *)lub_list_node__get_data(iter);
+		char buf[NR_CPUS + 1];
+
+		if (!irq->cpu)
+			continue;
+		/* The group mask for group placement unit */
+		cpumask_scnprintf(buf, sizeof(buf), cpus_empty(irq->group) ?
+			irq->cpu->cpumask : irq->group);
+		buf[sizeof(buf) - 1] = '\0';
+		fprintf(out, "# IRQ %u, load %.2f%%, %s\n", irq->irq, irq->load,
+			irq->desc ? irq->desc : "");
+		fprintf(out, "echo %s > %s/%u/smp_affinity\n",
+			buf, PROC_IRQ, irq->irq);
+	}
+	fflush(out);
+
+	return 0;
+}
 
 /* Count the number of intr-not-null IRQs and minimal IRQ weight */
 static int irq_list_info(lub_list_t *irqs, int *min_weight,
@@ -248,6 +940,9 @@ static int irq_list_info(lub_list_t *irqs, int *min_weight,
 			*irq_num += 1;
 		if (irq->weight)
 			continue;
+		/* Stormy and frozen IRQs are not candidates */
+		if (irq->storm || irq->frozen)
+			continue;
 		if (candidates_num)
 			*candidates_num += 1;
 	}
@@ -263,14 +958,15 @@ static cpu_t * most_overloaded_cpu(lub_list_t *cpus, float threshold)
 	float max_load = 0.0;
 
 	/* Search for the most overloaded CPU.
-	   The load must be greater than threshold. */
+	   The load must be greater than threshold. The load within
+	   measurement error from threshold is not overload. */
 	for (iter = lub_list_iterator_init(cpus); iter;
 		iter = lub_list_iterator_next(iter)) {
 		cpu_t *cpu = (cpu_t *)lub_list_node__get_data(iter);
 		int min_weight = -1;
 		unsigned int irq_num = 0;
 
-		if (cpu->load < threshold)
+		if ((cpu->load - cpu->load_error) < threshold)
 			continue;
 		if (cpu->load <= max_load)
 			continue;
@@ -294,13 +990,76 @@ static cpu_t * most_overloaded_cpu(lub_list_t *cpus, float threshold)
 	return overloaded_cpu;
 }
 
+/* Stage 3: There is no overloaded CPU now. It's a quiet period, so
+   it's good time to move IRQ from the CPU which is predicted to be
+   overloaded. Choose the IRQ with the greatest predicted growth. */
+static int choose_irqs_predicted(birq_t *birq, lub_list_t *cpus,
+	lub_list_t *balance_irqs, float threshold)
+{
+	lub_list_node_t *iter;
+	cpu_t *predicted_cpu = NULL;
+	irq_t *irq_to_move = NULL;
+	float max_load = 0.0;
+	float max_growth = 0.0;
+
+	for (iter = lub_list_iterator_init(cpus); iter;
+		iter = lub_list_iterator_next(iter)) {
+		cpu_t *cpu = (cpu_t *)lub_list_node__get_data(iter);
+		if (cpu->predicted_load < threshold)
+			continue;
+		if (cpu->predicted_load <= max_load)
+			continue;
+		/* Don't move last IRQ */
+		if (lub_list_len(cpu->irqs) <= 1)
+			continue;
+		max_load = cpu->predicted_load;
+		predicted_cpu = cpu;
+	}
+	if (!predicted_cpu)
+		return 0;
+
+	for (iter = lub_list_iterator_init(predicted_cpu->irqs); iter;
+		iter = lub_list_iterator_next(iter)) {
+		irq_t *irq = (irq_t *)lub_list_node__get_data(iter);
+		float growth;
+		if (irq->intr == 0)
+			continue;
+		if (irq->weight)
+			continue;
+		if (irq->storm || irq->frozen)
+			continue;
+		if (!irq->forecast.valid)
+			continue;
+		growth = irq->forecast.predicted - irq->forecast.rate;
+		if (growth <= max_growth)
+			continue;
+		max_growth = growth;
+		irq_to_move = irq;
+	}
+
+	if (irq_to_move) {
+		birq_log(birq, LOG_INFO,
+			"CPU%u predicted load %.2f%%, IRQ %u is growing",
+			predicted_cpu->id, predicted_cpu->predicted_load,
+			irq_to_move->irq);
+		/* Don't move this IRQ while next iteration. */
+		irq_to_move->weight = 1;
+		/* Choose target by predicted load */
+		irq_to_move->predictive = 1;
+		lub_list_add(balance_irqs, irq_to_move);
+	}
+
+	return 0;
+}
+
 /* Search for the overloaded CPUs and then choose best IRQ for moving to
    another CPU. The best IRQ is IRQ with maximum number of interrupts.
    The IRQs with small number of interrupts have very low load or very
    high load (in a case of NAPI). */
-int choose_irqs_to_move(lub_list_t *cpus, lub_list_t *balance_irqs,
-	float threshold, birq_choose_strategy_e strategy,
-	cpumask_t *exclude_cpus)
+int choose_irqs_to_move(birq_t *birq, lub_list_t *cpus,
+	lub_list_t *balance_irqs, float threshold,
+	birq_choose_strategy_e strategy, cpumask_t *exclude_cpus,
+	float heavy_load)
 {
 	lub_list_node_t *iter;
 	cpu_t *overloaded_cpu = NULL;
@@ -326,15 +1085,83 @@ int choose_irqs_to_move(lub_list_t *cpus, lub_list_t *balance_irqs,
 				irq_t *irq = (irq_t *)lub_list_node__get_data(iter2);
 				if (irq->intr == 0)
 					continue;
+				/* Stormy IRQ stays on quarantine CPU. Frozen
+				   IRQ belongs to external writer. */
+				if (irq->storm || irq->frozen)
+					continue;
+				if (!birq->quiet)
+					BIRQ_PROBE4(candidate, irq->irq, cpu->id,
+						irq->intr, PROBE_CANDIDATE_EXCLUDED);
 				lub_list_add(balance_irqs, irq);
 			}
 		}
 	}
 
+	/* Stage 1.5: Move heavy IRQs from CPUs to evacuate. See CPU_AVOID_*
+	   reasons. Don't move last IRQ. The heavy_load=0 means there are
+	   no heavy IRQs so nothing is evacuated. The stolen time is lost
+	   for any IRQ on the CPU. So the heaviest IRQ is evacuated from
+	   CPU with high steal time on each iteration whatever its load
+	   is. */
+	for (iter = lub_list_iterator_init(cpus); iter;
+		iter = lub_list_iterator_next(iter)) {
+		lub_list_node_t *iter2;
+		cpu_t *cpu = (cpu_t *)lub_list_node__get_data(iter);
+		irq_t *heaviest = NULL;
+		int evacuated = 0;
+		int steal;
+		if (!cpu->evacuate)
+			continue;
+		steal = cpu->evacuate & CPU_AVOID_STEAL;
+		if (!steal && (heavy_load <= 0))
+			continue;
+		if (cpu_isset(cpu->id, *exclude_cpus))
+			continue;
+		if (lub_list_len(cpu->irqs) <= 1)
+			continue;
+		for (iter2 = lub_list_iterator_init(cpu->irqs); iter2;
+			iter2 = lub_list_iterator_next(iter2)) {
+			irq_t *irq = (irq_t *)lub_list_node__get_data(iter2);
+			if (irq->intr == 0)
+				continue;
+			if (irq->weight)
+				continue;
+			if (irq->storm || irq->frozen)
+				continue;
+			if (!birq->quiet)
+				BIRQ_PROBE4(candidate, irq->irq, cpu->id,
+					irq->intr, PROBE_CANDIDATE_EVACUATE);
+			if (irq_heavy(irq, heavy_load)) {
+				birq_log(birq, LOG_INFO,
+					"Evacuate IRQ %u from CPU%u",
+					irq->irq, cpu->id);
+				/* Don't move this IRQ while next iteration. */
+				irq->weight = 1;
+				lub_list_add(balance_irqs, irq);
+				evacuated++;
+				continue;
+			}
+			if (steal && (!heaviest ||
+				(irq_list_compare_load(irq, heaviest) < 0)))
+				heaviest = irq;
+		}
+		if (evacuated || !heaviest)
+			continue;
+		birq_log(birq, LOG_INFO, "Evacuate IRQ %u from stolen CPU%u",
+			heaviest->irq, cpu->id);
+		/* Don't move this IRQ while next iteration. */
+		heaviest->weight = 1;
+		lub_list_add(balance_irqs, heaviest);
+	}
+
 	/* Stage 2: Move IRQs from overloaded CPUs */
 
 	/* Search for overloaded CPUs */
 	if (!(overloaded_cpu = most_overloaded_cpu(cpus, threshold)))
+		return choose_irqs_predicted(birq, cpus, balance_irqs,
+			threshold);
+	/* The strategy module chooses IRQs on overloaded CPUs itself */
+	if (strategy == BIRQ_CHOOSE_NONE)
 		return 0;
 
 	if (strategy == BIRQ_CHOOSE_RND) {
@@ -357,6 +1184,14 @@ int choose_irqs_to_move(lub_list_t *cpus, lub_list_t *balance_irqs,
 			continue;
 		if (irq->weight)
 			continue;
+		/* Stormy IRQ stays on quarantine CPU. Frozen IRQ is
+		   owned by external tool. Don't rely on weight. It can be
+		   decreased by dec_weight(). */
+		if (irq->storm || irq->frozen)
+			continue;
+		if (!birq->quiet)
+			BIRQ_PROBE4(candidate, irq->irq, overloaded_cpu->id,
+				irq->intr, PROBE_CANDIDATE_OVERLOADED);
 		if (strategy == BIRQ_CHOOSE_MAX) {
 			/* Get IRQ with max intr */
 			if (irq->intr > max_intr) {
@@ -1,23 +1,36 @@
 #ifndef _balance_h
 #define _balance_h
 
+#include <stdio.h>
 #include "lub/list.h"
 #include "irq.h"
 #include "cpu.h"
-
-typedef enum {
-	BIRQ_CHOOSE_MAX,
-	BIRQ_CHOOSE_MIN,
-	BIRQ_CHOOSE_RND
-} birq_choose_strategy_e;
+#include "libbirq.h"
 
 int remove_irq_from_cpu(irq_t *irq, cpu_t *cpu);
 int move_irq_to_cpu(irq_t *irq, cpu_t *cpu);
-int balance(lub_list_t *cpus, lub_list_t *balance_irqs,
-	float load_limit, cpumask_t *exclude_cpus, int non_local_cpus);
-int apply_affinity(lub_list_t *balance_irqs);
-int choose_irqs_to_move(lub_list_t *cpus, lub_list_t *balance_irqs,
-	float threshold, birq_choose_strategy_e strategy,
-	cpumask_t *exclude_cpus);
+int balance(birq_t *birq, lub_list_t *cpus, lub_list_t *balance_irqs,
+	float load_limit, cpumask_t *exclude_cpus, int non_local_cpus,
+	birq_cpu_strategy_e cpu_strategy, unsigned int cpu_choices,
+	cpumask_t *awake_cpus, float heavy_load);
+/* Max backoff of affinity write retry is 2^shift iterations */
+#define AFFINITY_BACKOFF_SHIFT 6
+/* The IRQ is blacklisted after so many successive rolled back moves */
+#define AFFINITY_ROLLBACK_LIMIT 3
+/* Min cost of IRQ within global placement, in load percents. The IRQ
+   without measured load still takes a share of CPU. */
+#define PLACE_MIN_COST 0.01
+
+int apply_affinity(birq_t *birq, lub_list_t *balance_irqs);
+void check_affinity(birq_t *birq, lub_list_t *irqs);
+void retry_affinity(birq_t *birq, lub_list_t *irqs, lub_list_t *balance_irqs);
+int place_irqs(birq_t *birq, lub_list_t *cpus, lub_list_t *irqs,
+	lub_list_t *balance_irqs, float load_limit, cpumask_t *exclude_cpus,
+	int non_local_cpus, cpumask_t *awake_cpus, float heavy_load);
+int print_plan(FILE *out, lub_list_t *balance_irqs);
+int choose_irqs_to_move(birq_t *birq, lub_list_t *cpus,
+	lub_list_t *balance_irqs, float threshold,
+	birq_choose_strategy_e strategy, cpumask_t *exclude_cpus,
+	float heavy_load);
 
 #endif
@@ -20,20 +20,15 @@
 #include <syslog.h>
 #include <fcntl.h>
 #include <time.h>
+#include <limits.h>
 #ifdef HAVE_GETOPT_H
 #include <getopt.h>
 #endif
 
 #include "birq.h"
+#include "libbirq.h"
 #include "lub/log.h"
-#include "lub/list.h"
 #include "lub/ini.h"
-#include "irq.h"
-#include "numa.h"
-#include "cpu.h"
-#include "statistics.h"
-#include "balance.h"
-#include "pxm.h"
 
 #ifndef VERSION
 #define VERSION "1.2.0"
@@ -51,6 +46,8 @@ static struct options *opts_init(void);
 static void opts_free(struct options *opts);
 static int opts_parse(int argc, char *argv[], struct options *opts);
 static int parse_config(const char *fname, struct options *opts);
+static int place_once(struct options *opts, birq_t *birq);
+static void daemon_log(int priority, const char *msg, void *udata);
 
 /* Command line options */
 struct options {
@@ -59,16 +56,13 @@ struct options {
 	int cfgfile_userdefined;
 	char *pxm; /* Proximity config file */
 	int debug; /* Don't daemonize in debug mode */
+	int once; /* Place all IRQs once and exit */
+	int plan; /* Print placement script instead of applying it */
 	int log_facility;
-	float threshold;
-	float load_limit;
-	int verbose;
 	int ht;
-	int non_local_cpus;
 	unsigned int long_interval;
 	unsigned int short_interval;
-	birq_choose_strategy_e strategy;
-	cpumask_t exclude_cpus;
+	birq_config_t cfg; /* Engine configuration */
 };
 
 /*--------------------------------------------------------- */
@@ -83,16 +77,9 @@ int main(int argc, char **argv)
 	struct sigaction sig_act;
 	sigset_t sig_set;
 
-	/* IRQ list. It contain all found IRQs. */
-	lub_list_t *irqs;
-	/* IRQs need to be balanced */
-	lub_list_t *balance_irqs;
-	/* CPU list. It contain all found CPUs. */
-	lub_list_t *cpus;
-	/* NUMA list. It contain all found NUMA nodes. */
-	lub_list_t *numas;
-	/* Proximity list. */
-	lub_list_t *pxms;
+	/* Engine state */
+	birq_t *birq = NULL;
+	birq_env_t env;
 
 	/* Parse command line options */
 	opts = opts_init();
@@ -114,7 +101,7 @@ int main(int argc, char **argv)
 	syslog(LOG_INFO, "Start daemon\n");
 
 	/* Fork the daemon */
-	if (!opts->debug) {
+	if (!opts->debug && !opts->once) {
 		/* Daemonize */
 		if (daemon(0, 0) < 0) {
 			syslog(LOG_ERR, "Can't daemonize\n");
@@ -163,32 +150,26 @@ int main(int argc, char **argv)
 	/* Randomize */
 	srand(time(NULL));
 
-	/* Scan NUMA nodes */
-	numas = lub_list_new(numa_list_compare);
-	scan_numas(numas);
-	if (opts->verbose)
-		show_numas(numas);
-
-	/* Scan CPUs */
-	cpus = lub_list_new(cpu_list_compare);
-	scan_cpus(cpus, opts->ht);
-	if (opts->verbose)
-		show_cpus(cpus);
-
-	/* Prepare data structures */
-	irqs = lub_list_new(irq_list_compare);
-	balance_irqs = lub_list_new(irq_list_compare);
+	/* Scan topology and prepare engine. The engine uses real procfs
+	   and sysfs. The log goes to syslog too. */
+	memset(&env, 0, sizeof(env));
+	env.log = daemon_log;
+	env.udata = opts;
+	if (!(birq = birq_new(&env, opts->ht, opts->pxm)))
+		goto err;
+	if (opts->cfg.verbose)
+		birq_show(birq);
+	if (birq_configure(birq, &opts->cfg) < 0)
+		goto err;
 
-	/* Parse proximity file */
-	pxms = lub_list_new(NULL);
-	if (opts->pxm)
-		parse_pxm_config(opts->pxm, pxms, numas);
-	if (opts->verbose)
-		show_pxms(pxms);
+	/* Place all IRQs at once and exit */
+	if (opts->once) {
+		place_once(opts, birq);
+		sigterm = 1;
+	}
 
 	/* Main loop */
 	while (!sigterm) {
-		lub_list_node_t *node;
 		char outstr[10];
 		time_t t;
 		struct tm *tmp;
@@ -204,59 +185,31 @@ int main(int argc, char **argv)
 		if (sighup) {
 			if (!access(opts->cfgfile, R_OK)) {
 				syslog(LOG_INFO, "Re-reading config file\n");
-				if (parse_config(opts->cfgfile, opts))
-					syslog(LOG_ERR, "Error while config file parsing\n");
+				if (parse_config(opts->cfgfile, opts) ||
+					(birq_configure(birq, &opts->cfg) < 0))
+					syslog(LOG_ERR, "Error while config file parsing, "
+						"keep previous configuration\n");
 			} else if (opts->cfgfile_userdefined)
 				syslog(LOG_ERR, "Can't find config file\n");
 			sighup = 0;
 		}
 
-		/* Rescan PCI devices for new IRQs. */
-		scan_irqs(irqs, balance_irqs, pxms);
-		if (opts->verbose)
-			irq_list_show(irqs);
-		/* Link IRQs to CPUs due to real current smp affinity. */
-		link_irqs_to_cpus(cpus, irqs);
-
-		/* Gather statistics on CPU load and number of interrupts. */
-		gather_statistics(cpus, irqs);
-		show_statistics(cpus, opts->verbose);
-		/* Choose IRQ to move to another CPU. */
-		choose_irqs_to_move(cpus, balance_irqs,
-			opts->threshold, opts->strategy, &opts->exclude_cpus);
-
-		/* Balance IRQs */
-		if (lub_list_len(balance_irqs) != 0) {
-			/* Set short interval to make balancing faster. */
+		/* Balance IRQs. Set short interval to make balancing
+		   faster while IRQs are being moved. */
+		if (birq_tick(birq))
 			interval = opts->short_interval;
-			/* Choose new CPU for IRQs need to be balanced. */
-			balance(cpus, balance_irqs, opts->load_limit,
-				&opts->exclude_cpus, opts->non_local_cpus);
-			/* Write new values to /proc/irq/<IRQ>/smp_affinity */
-			apply_affinity(balance_irqs);
-			/* Free list of balanced IRQs */
-			while ((node = lub_list__get_tail(balance_irqs))) {
-				lub_list_del(balance_irqs, node);
-				lub_list_node_free(node);
-			}
-		} else {
-			/* If nothing to balance */
+		else
 			interval = opts->long_interval;
-		}
-		
+
 		/* Wait before next iteration */
 		sleep(interval);
 	}
 
-	/* Free data structures */
-	irq_list_free(irqs);
-	lub_list_free(balance_irqs);
-	cpu_list_free(cpus);
-	numa_list_free(numas);
-	pxm_list_free(pxms);
-
 	retval = 0;
 err:
+	/* Restore CPU settings and free data structures */
+	birq_free(birq);
+
 	/* Remove pidfile */
 	if (pidfd >= 0) {
 		if (unlink(opts->pidfile) < 0) {
@@ -288,21 +241,41 @@ static void sighup_handler(int signo)
 	signo = signo; /* Happy compiler */
 }
 
+/*--------------------------------------------------------- */
+/* Free strings of engine configuration */
+static void opts_free_config(struct options *opts)
+{
+	free(opts->cfg.latency_irqs);
+	free(opts->cfg.granularity);
+	free(opts->cfg.awake_cpus);
+	free(opts->cfg.freq_floor_epp);
+	free(opts->cfg.rt_cgroups);
+	free(opts->cfg.consumers);
+	free(opts->cfg.shadow);
+	free(opts->cfg.strategy_module);
+	free(opts->cfg.strategy_dir);
+	free(opts->cfg.exclude_cpus);
+	free(opts->cfg.use_cpus);
+}
+
 /*--------------------------------------------------------- */
 /* Set defaults for options from config file (not command line) */
 static void opts_default_config(struct options *opts)
 {
+	int verbose;
+
 	assert(opts);
 
-	opts->threshold = BIRQ_DEFAULT_THRESHOLD;
-	opts->load_limit = BIRQ_DEFAULT_LOAD_LIMIT;
 	opts->ht = 1; /* It's 1 since 1.5.0 */
-	opts->non_local_cpus = 0;
 	opts->long_interval = BIRQ_LONG_INTERVAL;
 	opts->short_interval = BIRQ_SHORT_INTERVAL;
-	opts->strategy = BIRQ_CHOOSE_RND;
-	cpus_clear(opts->exclude_cpus);
+	/* The verbose is command line option */
+	verbose = opts->cfg.verbose;
+	opts_free_config(opts);
+	birq_config_init(&opts->cfg);
+	opts->cfg.verbose = verbose;
 }
+
 /*--------------------------------------------------------- */
 /* Initialize option structure by defaults */
 static struct options *opts_init(void)
@@ -312,16 +285,18 @@ static struct options *opts_init(void)
 	// Allocate structures
 	opts = malloc(sizeof(*opts));
 	assert(opts);
-	cpus_init(opts->exclude_cpus);
+	birq_config_init(&opts->cfg);
 
 	// Set command line options defaults.
 	opts->debug = 0; /* daemonize by default */
+	opts->once = 0;
+	opts->plan = 0;
 	opts->pidfile = strdup(BIRQ_PIDFILE);
 	opts->cfgfile = strdup(BIRQ_CFGFILE);
 	opts->cfgfile_userdefined = 0;
 	opts->pxm = NULL;
 	opts->log_facility = LOG_DAEMON;
-	opts->verbose = 0;
+	opts->cfg.verbose = 0;
 
 	// The daemon can be used without config file. So set defaults for
 	// options from config file.
@@ -340,7 +315,7 @@ static void opts_free(struct options *opts)
 		free(opts->cfgfile);
 	if (opts->pxm)
 		free(opts->pxm);
-	cpus_free(opts->exclude_cpus);
+	opts_free_config(opts);
 	free(opts);
 }
 
@@ -384,6 +359,65 @@ static int opt_parse_strategy(const char *optarg, birq_choose_strategy_e *strate
 	return 0;
 }
 
+/* Check the strategy module <dir>/<name>.so exists. The unknown
+   strategy is a typo more likely than a module. */
+static int opt_check_module(const char *dir, const char *name)
+{
+	char path[PATH_MAX];
+
+	assert(name);
+
+	if (strchr(name, '/')) {
+		fprintf(stderr, "Error: Illegal strategy value %s.\n", name);
+		return -1;
+	}
+	snprintf(path, sizeof(path), "%s/%s.so", dir, name);
+	path[sizeof(path) - 1] = '\0';
+	if (access(path, R_OK)) {
+		fprintf(stderr, "Error: Illegal strategy value %s. "
+			"There is no module %s.\n", name, path);
+		return -1;
+	}
+	return 0;
+}
+
+/* Parse 'cpu-strategy' option */
+static int opt_parse_cpu_strategy(const char *optarg,
+	birq_cpu_strategy_e *strategy)
+{
+	assert(optarg);
+	assert(strategy);
+
+	if (!strcmp(optarg, "min"))
+		*strategy = BIRQ_CPU_MIN;
+	else if (!strcmp(optarg, "p2c"))
+		*strategy = BIRQ_CPU_P2C;
+	else {
+		fprintf(stderr, "Error: Illegal cpu-strategy value %s.\n", optarg);
+		return -1;
+	}
+	return 0;
+}
+
+/* Parse 'external' option */
+static int opt_parse_external(const char *optarg, birq_external_e *policy)
+{
+	assert(optarg);
+	assert(policy);
+
+	if (!strcmp(optarg, "respect"))
+		*policy = BIRQ_EXTERNAL_RESPECT;
+	else if (!strcmp(optarg, "reclaim"))
+		*policy = BIRQ_EXTERNAL_RECLAIM;
+	else if (!strcmp(optarg, "alert"))
+		*policy = BIRQ_EXTERNAL_ALERT;
+	else {
+		fprintf(stderr, "Error: Illegal external value %s.\n", optarg);
+		return -1;
+	}
+	return 0;
+}
+
 /* Parse 'threshold' and 'load-limit' options */
 static int opt_parse_threshold(const char *optarg, float *threshold)
 {
@@ -428,7 +462,7 @@ static int opt_parse_interval(const char *optarg, unsigned int *interval)
 /* Parse command line options */
 static int opts_parse(int argc, char *argv[], struct options *opts)
 {
-	static const char *shortopts = "hp:c:dO:vx:";
+	static const char *shortopts = "hp:c:dO:vx:1P";
 #ifdef HAVE_GETOPT_H
 	static const struct option longopts[] = {
 		{"help",		0, NULL, 'h'},
@@ -438,6 +472,8 @@ static int opts_parse(int argc, char *argv[], struct options *opts)
 		{"facility",		1, NULL, 'O'},
 		{"verbose",		0, NULL, 'v'},
 		{"pxm",			1, NULL, 'x'},
+		{"once",		0, NULL, '1'},
+		{"plan",		0, NULL, 'P'},
 		{NULL,			0, NULL, 0}
 	};
 #endif
@@ -472,7 +508,14 @@ static int opts_parse(int argc, char *argv[], struct options *opts)
 			opts->debug = 1;
 			break;
 		case 'v':
-			opts->verbose = 1;
+			opts->cfg.verbose = 1;
+			break;
+		case '1':
+			opts->once = 1;
+			break;
+		case 'P':
+			opts->once = 1;
+			opts->plan = 1;
 			break;
 		case 'O':
 			if (lub_log_facility(optarg, &(opts->log_facility))) {
@@ -527,6 +570,8 @@ static void help(int status, const char *argv0)
 		printf("\t-c <path>, --conf=<path> Config file (" BIRQ_CFGFILE ").\n");
 		printf("\t-x <path>, --pxm=<path> Proximity config file.\n");
 		printf("\t-O, --facility Syslog facility (DAEMON).\n");
+		printf("\t-1, --once Place all IRQs at once and exit.\n");
+		printf("\t-P, --plan Print placement of all IRQs as shell script and exit.\n");
 		printf("\t-t <float>, --threshold=<float> Threshold to consider CPU is overloaded, in percents. Default threhold is %.2f.\n",
 			BIRQ_DEFAULT_THRESHOLD);
 		printf("\t-l <float>, --load-limit=<float> Don't move IRQs to CPUs loaded more than this limit, in percents. Default limit is %.2f.\n",
@@ -544,7 +589,6 @@ static int parse_config(const char *fname, struct options *opts)
 	int ret = -1; /* Pessimistic retval */
 	lub_ini_t *ini = NULL;
 	const char *tmp = NULL;
-	cpumask_t use_cpus;
 
 	// Set options defaults. It's necessary because the config file can be
 	// re-read by SIGHUP. So we need to drop old values to default state.
@@ -556,16 +600,40 @@ static int parse_config(const char *fname, struct options *opts)
 		return -1;
 	}
 
-	if ((tmp = lub_ini_find(ini, "strategy")))
-		if (opt_parse_strategy(tmp, &opts->strategy) < 0)
+	if ((tmp = lub_ini_find(ini, "strategy-dir")))
+		opts->cfg.strategy_dir = strdup(tmp);
+
+	if ((tmp = lub_ini_find(ini, "strategy"))) {
+		/* Unknown strategy is a name of loadable module */
+		if (strcmp(tmp, "max") && strcmp(tmp, "min") &&
+			strcmp(tmp, "rnd")) {
+			if (opt_check_module(opts->cfg.strategy_dir ?
+				opts->cfg.strategy_dir : BIRQ_STRATEGY_DIR, tmp) < 0)
+				goto err;
+			opts->cfg.strategy_module = strdup(tmp);
+		} else if (opt_parse_strategy(tmp, &opts->cfg.strategy) < 0)
+			goto err;
+	}
+
+	if ((tmp = lub_ini_find(ini, "cpu-strategy")))
+		if (opt_parse_cpu_strategy(tmp, &opts->cfg.cpu_strategy) < 0)
 			goto err;
 
+	if ((tmp = lub_ini_find(ini, "cpu-choices"))) {
+		if (opt_parse_interval(tmp, &opts->cfg.cpu_choices))
+			goto err;
+		if (opts->cfg.cpu_choices < 1) {
+			fprintf(stderr, "Error: The cpu-choices value must be >= 1.\n");
+			goto err;
+		}
+	}
+
 	if ((tmp = lub_ini_find(ini, "threshold")))
-		if (opt_parse_threshold(tmp, &opts->threshold))
+		if (opt_parse_threshold(tmp, &opts->cfg.threshold))
 			goto err;
 
 	if ((tmp = lub_ini_find(ini, "load-limit")))
-		if (opt_parse_threshold(tmp, &opts->load_limit))
+		if (opt_parse_threshold(tmp, &opts->cfg.load_limit))
 			goto err;
 
 	if ((tmp = lub_ini_find(ini, "short-interval")))
@@ -576,41 +644,112 @@ static int parse_config(const char *fname, struct options *opts)
 		if (opt_parse_interval(tmp, &opts->long_interval))
 			goto err;
 
-	if ((tmp = lub_ini_find(ini, "exclude-cpus"))) {
-		if (cpumask_parse_user(tmp, strlen(tmp), opts->exclude_cpus)) {
-			fprintf(stderr, "Error: Can't parse exclude-cpus option \"%s\".\n", tmp);
+	if ((tmp = lub_ini_find(ini, "forecast-season")))
+		if (opt_parse_interval(tmp, &opts->cfg.forecast_season))
 			goto err;
-		}
+
+	if ((tmp = lub_ini_find(ini, "forecast-horizon")))
+		if (opt_parse_interval(tmp, &opts->cfg.forecast_horizon))
+			goto err;
+
+	if ((tmp = lub_ini_find(ini, "pack-watermark")))
+		if (opt_parse_threshold(tmp, &opts->cfg.pack_watermark))
+			goto err;
+
+	if ((tmp = lub_ini_find(ini, "latency-irqs")))
+		opts->cfg.latency_irqs = strdup(tmp);
+
+	/* The engine parses CPU masks */
+	if ((tmp = lub_ini_find(ini, "awake-cpus")))
+		opts->cfg.awake_cpus = strdup(tmp);
+
+	if ((tmp = lub_ini_find(ini, "heavy-irq-load")))
+		if (opt_parse_threshold(tmp, &opts->cfg.heavy_load))
+			goto err;
+
+	if ((tmp = lub_ini_find(ini, "freq-floor-load")))
+		if (opt_parse_threshold(tmp, &opts->cfg.freq_floor_load))
+			goto err;
+
+	if ((tmp = lub_ini_find(ini, "freq-floor"))) {
+		unsigned int floor;
+		if (opt_parse_interval(tmp, &floor))
+			goto err;
+		opts->cfg.freq_floor = floor;
 	}
 
-	cpus_init(use_cpus);
-	if ((tmp = lub_ini_find(ini, "use-cpus"))) {
-		if (cpumask_parse_user(tmp, strlen(tmp), use_cpus)) {
-			fprintf(stderr, "Error: Can't parse use-cpus option \"%s\".\n", tmp);
+	if ((tmp = lub_ini_find(ini, "freq-floor-epp")))
+		opts->cfg.freq_floor_epp = strdup(tmp);
+
+	if ((tmp = lub_ini_find(ini, "steal-limit")))
+		if (opt_parse_threshold(tmp, &opts->cfg.steal_limit))
 			goto err;
-		}
-	} else {
-		cpus_setall(use_cpus);
+
+	if ((tmp = lub_ini_find(ini, "rt-cgroups")))
+		opts->cfg.rt_cgroups = strdup(tmp);
+
+	if ((tmp = lub_ini_find(ini, "consumers")))
+		opts->cfg.consumers = strdup(tmp);
+
+	if ((tmp = lub_ini_find(ini, "tasks-interval")))
+		if (opt_parse_interval(tmp, &opts->cfg.tasks_interval))
+			goto err;
+
+	if ((tmp = lub_ini_find(ini, "external")))
+		if (opt_parse_external(tmp, &opts->cfg.external) < 0)
+			goto err;
+
+	if ((tmp = lub_ini_find(ini, "external-timeout")))
+		if (opt_parse_interval(tmp, &opts->cfg.external_timeout))
+			goto err;
+
+	/* The engine parses placement unit rules */
+	if ((tmp = lub_ini_find(ini, "granularity")))
+		opts->cfg.granularity = strdup(tmp);
+
+	if ((tmp = lub_ini_find(ini, "shadow")))
+		opts->cfg.shadow = strdup(tmp);
+
+	if ((tmp = lub_ini_find(ini, "storm-rate")))
+		if (opt_parse_interval(tmp, &opts->cfg.storm_rate))
+			goto err;
+
+	if ((tmp = lub_ini_find(ini, "storm-cpu"))) {
+		unsigned int storm_cpu;
+		if (opt_parse_interval(tmp, &storm_cpu))
+			goto err;
+		opts->cfg.storm_cpu = storm_cpu;
 	}
 
-	/* The exclude-cpus option was implemented first. So the
-	 * programm is based on it. The use-cpus options really
-	 * says to exclude all the cpus that is not within bitmask.
-	 * So invert use-cpus and we'll get exclude-cpus mask.
-	 */
-	cpus_complement(use_cpus, use_cpus);
-	/* Calculate real exclude-cpu mask (consider use-cpus option).
-	 * real-exclude-cpus = exclude-cpus | ~use-cpus
-	 */
-	cpus_or(opts->exclude_cpus, opts->exclude_cpus, use_cpus);
-	cpus_free(use_cpus);
+	/* The engine combines exclude-cpus and use-cpus */
+	if ((tmp = lub_ini_find(ini, "exclude-cpus")))
+		opts->cfg.exclude_cpus = strdup(tmp);
+
+	if ((tmp = lub_ini_find(ini, "use-cpus")))
+		opts->cfg.use_cpus = strdup(tmp);
 
 	if ((tmp = lub_ini_find(ini, "ht")))
 		if (opt_parse_y_n(tmp, &opts->ht))
 			goto err;
 
+	if ((tmp = lub_ini_find(ini, "thermal")))
+		if (opt_parse_y_n(tmp, &opts->cfg.thermal))
+			goto err;
+
+	if ((tmp = lub_ini_find(ini, "rt-tasks")))
+		if (opt_parse_y_n(tmp, &opts->cfg.rt_tasks))
+			goto err;
+
+	if ((tmp = lub_ini_find(ini, "shadow-promote")))
+		if (opt_parse_y_n(tmp, &opts->cfg.shadow_promote))
+			goto err;
+
+	if ((tmp = lub_ini_find(ini, "vfio")))
+		if (opt_parse_y_n(tmp, &opts->cfg.vfio))
+			goto err;
+
 	if ((tmp = lub_ini_find(ini, "non-local-cpus")))
-		if (opt_parse_y_n(tmp, &opts->non_local_cpus))
+		if (opt_parse_y_n(tmp, &opts->cfg.non_local_cpus))
 			goto err;
 
 	ret = 0;
@@ -618,3 +757,34 @@ err:
 	lub_ini_free(ini);
 	return ret;
 }
+
+/* Take a short calibration sample, place all IRQs globally and apply
+   the placement in one batch. The "plan" mode prints the placement as
+   shell script. The diagnostic messages go to stderr in this case. */
+static int place_once(struct options *opts, birq_t *birq)
+{
+	/* The first sample initializes counters. The second one gets
+	   loads and number of interrupts for calibration period. */
+	birq_calibrate(birq);
+	sleep(BIRQ_ONCE_SAMPLE);
+	birq_calibrate(birq);
+	birq_place(birq, opts->plan ? stdout : NULL);
+	fflush(stdout);
+
+	return 0;
+}
+
+/* Log engine messages. The errors and notices go to syslog too. The
+   "plan" mode prints all messages to stderr because stdout is the
+   placement script. */
+static void daemon_log(int priority, const char *msg, void *udata)
+{
+	struct options *opts = (struct options *)udata;
+
+	if (priority <= LOG_NOTICE)
+		syslog(priority, "%s\n", msg);
+	if (opts->plan || (priority <= LOG_WARNING))
+		fprintf(stderr, "%s\n", msg);
+	else
+		printf("%s\n", msg);
+}
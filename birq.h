@@ -10,11 +10,7 @@
 #define BIRQ_LONG_INTERVAL 5
 #define BIRQ_SHORT_INTERVAL 2
 
-/* Threshold to consider CPU as overloaded.
-   In percents, float value. Can't be greater than 100.0 */
-#define BIRQ_DEFAULT_THRESHOLD 99.0
-
-/* Load limit. Don't move IRQs to CPUs loaded more than this limit. */
-#define BIRQ_DEFAULT_LOAD_LIMIT 95.0
+/* Calibration sample for one-shot placement, in seconds. */
+#define BIRQ_ONCE_SAMPLE 1
 
 #endif
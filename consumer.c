@@ -0,0 +1,216 @@
+/* consumer.c
+ * Place IRQs next to the threads consuming its data.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <limits.h>
+#include <ctype.h>
+
+#include "lub/list.h"
+#include "cpumask.h"
+#include "cpu.h"
+#include "irq.h"
+#include "tasks.h"
+#include "consumer.h"
+#include "source.h"
+
+/* Check if process is a consumer. The consumer is specified by the
+   process name (see /proc/<pid>/comm) or by the cgroup if it starts
+   with "/". */
+static int consumer_match(birq_t *birq, const char *pid,
+	const char *consumer)
+{
+	char path[PATH_MAX];
+	char comm[32];
+	FILE *fd;
+	char *end;
+
+	if (consumer[0] == '/')
+		return task_in_cgroups(birq, pid, consumer);
+
+	snprintf(path, sizeof(path), "%s/%s/comm", PROC_PATH, pid);
+	path[sizeof(path) - 1] = '\0';
+	if (!(fd = source_open(birq, path)))
+		return 0;
+	if (!fgets(comm, sizeof(comm), fd)) {
+		fclose(fd);
+		return 0;
+	}
+	fclose(fd);
+	if ((end = strchr(comm, '\n')))
+		*end = '\0';
+
+	return !strcmp(comm, consumer);
+}
+
+/* Get CPUs the consumer threads last ran on */
+static void consumer_cpus(birq_t *birq, const char *consumer,
+	cpumask_t *cpumask)
+{
+	DIR *dir;
+	struct dirent *dent;
+
+	cpus_clear(*cpumask);
+	if (!(dir = source_opendir(birq, PROC_PATH)))
+		return;
+	while ((dent = readdir(dir))) {
+		char path[PATH_MAX];
+		DIR *task_dir;
+		struct dirent *tent;
+
+		if (!isdigit(dent->d_name[0]))
+			continue;
+		if (!consumer_match(birq, dent->d_name, consumer))
+			continue;
+		snprintf(path, sizeof(path), "%s/%s/task",
+			PROC_PATH, dent->d_name);
+		path[sizeof(path) - 1] = '\0';
+		if (!(task_dir = source_opendir(birq, path)))
+			continue;
+		while ((tent = readdir(task_dir))) {
+			unsigned int processor;
+			unsigned int policy;
+			if (!isdigit(tent->d_name[0]))
+				continue;
+			if (task_stat(birq, dent->d_name, tent->d_name,
+				&processor, &policy))
+				continue;
+			if (processor < NR_CPUS)
+				cpu_set(processor, *cpumask);
+		}
+		closedir(task_dir);
+	}
+	closedir(dir);
+}
+
+/* Extend CPU mask to the last level cache groups of its CPUs */
+static void consumer_llc(lub_list_t *cpus, cpumask_t *cpumask)
+{
+	lub_list_node_t *iter;
+	cpumask_t llc;
+
+	cpus_init(llc);
+	cpus_clear(llc);
+	for (iter = lub_list_iterator_init(cpus); iter;
+		iter = lub_list_iterator_next(iter)) {
+		cpu_t *cpu = (cpu_t *)lub_list_node__get_data(iter);
+		if (cpu_isset(cpu->id, *cpumask))
+			cpus_or(llc, llc, cpu->llc_cpus);
+	}
+	cpus_copy(*cpumask, llc);
+	cpus_free(llc);
+}
+
+/* Get CPUs the IRQ can't be drawn to. These are excluded CPUs
+   (including quarantined ones), avoided CPUs and CPUs without free
+   vectors. */
+static void consumer_deny(lub_list_t *cpus, cpumask_t *exclude_cpus,
+	cpumask_t *cpumask)
+{
+	lub_list_node_t *iter;
+
+	cpus_copy(*cpumask, *exclude_cpus);
+	for (iter = lub_list_iterator_init(cpus); iter;
+		iter = lub_list_iterator_next(iter)) {
+		cpu_t *cpu = (cpu_t *)lub_list_node__get_data(iter);
+		if (cpu->avoid || (cpu->vectors &&
+			(lub_list_len(cpu->irqs) >= cpu->vectors)))
+			cpu_set(cpu->id, *cpumask);
+	}
+}
+
+/* The consumers are comma separated list of "<consumer>:<irq-pattern>".
+   Find CPUs the consumer threads ran on and draw the matched IRQs to
+   the last level cache groups of these CPUs (within local CPUs). The
+   IRQ is drawn only if some of these CPUs can take it. */
+void scan_consumers(birq_t *birq, lub_list_t *cpus, lub_list_t *irqs,
+	lub_list_t *balance_irqs, const char *consumers,
+	cpumask_t *exclude_cpus)
+{
+	lub_list_node_t *iter;
+	const char *spec;
+	cpumask_t deny;
+
+	for (iter = lub_list_iterator_init(irqs); iter;
+		iter = lub_list_iterator_next(iter)) {
+		irq_t *irq = (irq_t *)lub_list_node__get_data(iter);
+		cpus_clear(irq->consumer_cpus);
+	}
+	if (!consumers)
+		return;
+
+	for (spec = consumers; *spec; ) {
+		size_t len = strcspn(spec, ",");
+		char *consumer = strndup(spec, len);
+		char *pattern = strchr(consumer, ':');
+		cpumask_t cpumask;
+
+		spec += len;
+		if (*spec == ',')
+			spec++;
+		if (!pattern || (pattern == consumer) || !*(pattern + 1)) {
+			if (len)
+				birq_log(birq, LOG_WARNING,
+					"Warning: Illegal consumer \"%s\"", consumer);
+			free(consumer);
+			continue;
+		}
+		*pattern++ = '\0';
+
+		cpus_init(cpumask);
+		consumer_cpus(birq, consumer, &cpumask);
+		consumer_llc(cpus, &cpumask);
+		if (cpus_empty(cpumask)) {
+			cpus_free(cpumask);
+			free(consumer);
+			continue;
+		}
+
+		for (iter = lub_list_iterator_init(irqs); iter;
+			iter = lub_list_iterator_next(iter)) {
+			irq_t *irq = (irq_t *)lub_list_node__get_data(iter);
+			if (irq->blacklisted)
+				continue;
+			if (!irq_match(irq, pattern))
+				continue;
+			cpus_or(irq->consumer_cpus, irq->consumer_cpus, cpumask);
+		}
+		cpus_free(cpumask);
+		free(consumer);
+	}
+
+	/* Draw active IRQs to consumer CPUs */
+	cpus_init(deny);
+	consumer_deny(cpus, exclude_cpus, &deny);
+	cpus_complement(deny, deny);
+	for (iter = lub_list_iterator_init(irqs); iter;
+		iter = lub_list_iterator_next(iter)) {
+		irq_t *irq = (irq_t *)lub_list_node__get_data(iter);
+		cpumask_t cpumask;
+		int allowed;
+
+		if (cpus_empty(irq->consumer_cpus))
+			continue;
+		if (!irq->cpu || (irq->intr == 0) || irq->weight)
+			continue;
+		if (cpu_isset(irq->cpu->id, irq->consumer_cpus))
+			continue;
+		/* The consumer CPUs must be local and allowed */
+		cpus_init(cpumask);
+		cpus_and(cpumask, irq->consumer_cpus, irq->local_cpus);
+		cpus_and(cpumask, cpumask, deny);
+		allowed = !cpus_empty(cpumask);
+		cpus_free(cpumask);
+		if (!allowed)
+			continue;
+		birq_log(birq, LOG_INFO, "Draw IRQ %u to consumer CPUs", irq->irq);
+		/* Don't move this IRQ while next iteration. */
+		irq->weight = 1;
+		lub_list_add(balance_irqs, irq);
+	}
+	cpus_free(deny);
+}
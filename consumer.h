@@ -0,0 +1,12 @@
+#ifndef _consumer_h
+#define _consumer_h
+
+#include "lub/list.h"
+#include "cpumask.h"
+#include "libbirq.h"
+
+void scan_consumers(birq_t *birq, lub_list_t *cpus, lub_list_t *irqs,
+	lub_list_t *balance_irqs, const char *consumers,
+	cpumask_t *exclude_cpus);
+
+#endif
@@ -15,6 +15,8 @@
 #include "cpumask.h"
 #include "cpu.h"
 #include "irq.h"
+#include "engine.h"
+#include "source.h"
 
 int cpu_list_compare(const void *first, const void *second)
 {
@@ -34,17 +36,44 @@ static cpu_t * cpu_new(unsigned int id)
 {
 	cpu_t *new;
 
-	if (!(new = malloc(sizeof(*new))))
+	if (posix_memalign((void **)&new, CACHE_LINE_SIZE, sizeof(*new)))
 		return NULL;
 	new->id = id;
+	new->capacity = CPU_CAPACITY_SCALE;
+	new->max_freq = 0;
+	new->cur_freq = 0;
+	new->old_throttle = (unsigned long long)(-1);
+	new->throttle_ticks = 0;
+	new->saved_min_freq = 0;
+	new->noop_floor = 0;
+	new->saved_epp = NULL;
+	new->avoid = 0;
+	new->evacuate = 0;
+	new->vectors = 0;
+	new->intr = 0;
 	new->old_load_all = 0;
 	new->old_load_irq = 0;
+	new->old_load_steal = 0;
+	new->old_load_stamp = 0;
 	new->old_load = 0;
 	new->load = 0;
+	new->steal = 0;
+	new->load_error = 0;
+	new->predicted_load = 0;
+	new->old_idle_deep = 0;
+	new->old_idle_stamp = 0;
+	new->deep_idle = 0;
+	new->old_idle_total = 0;
+	new->old_idle_weighted = 0;
+	new->idle_latency = 0;
 	new->irqs = lub_list_new(irq_list_compare);
 	cpus_init(new->cpumask);
 	cpus_clear(new->cpumask);
 	cpu_set(new->id, new->cpumask);
+	cpus_init(new->llc_cpus);
+	cpus_copy(new->llc_cpus, new->cpumask);
+	cpus_init(new->core_cpus);
+	cpus_copy(new->core_cpus, new->cpumask);
 
 	return new;
 }
@@ -59,9 +88,42 @@ static void cpu_free(cpu_t *cpu)
 	}
 	lub_list_free(cpu->irqs);
 	cpus_free(cpu->cpumask);
+	cpus_free(cpu->llc_cpus);
+	cpus_free(cpu->core_cpus);
+	free(cpu->saved_epp);
 	free(cpu);
 }
 
+/* Make virtual copy of CPU list for planning without side effects.
+   The copied CPUs have no IRQs. Free the copy by cpu_list_free(). */
+lub_list_t *cpu_list_clone(lub_list_t *cpus)
+{
+	lub_list_node_t *iter;
+	lub_list_t *copy;
+
+	copy = lub_list_new(cpu_list_compare);
+	for (iter = lub_list_iterator_init(cpus); iter;
+		iter = lub_list_iterator_next(iter)) {
+		cpu_t *cpu = (cpu_t *)lub_list_node__get_data(iter);
+		cpu_t *new;
+
+		if (!(new = malloc(sizeof(*new))))
+			break;
+		*new = *cpu;
+		new->saved_epp = NULL;
+		new->irqs = lub_list_new(irq_list_compare);
+		cpus_init(new->cpumask);
+		cpus_copy(new->cpumask, cpu->cpumask);
+		cpus_init(new->llc_cpus);
+		cpus_copy(new->llc_cpus, cpu->llc_cpus);
+		cpus_init(new->core_cpus);
+		cpus_copy(new->core_cpus, cpu->core_cpus);
+		lub_list_add(copy, new);
+	}
+
+	return copy;
+}
+
 /* Search for CPU with specified package and core IDs.
    The second CPU with the same IDs is a thread of Hyper Threading.
    We don't want to use HT for IRQ balancing. */
@@ -94,11 +156,39 @@ static cpu_t * cpu_list_search_ht(lub_list_t *cpus,
 	return NULL;
 }
 
-cpu_t * cpu_list_search(lub_list_t *cpus, unsigned int id)
+/* Build dense table of CPUs indexed by CPU ID. The CPU list doesn't
+   change after scan_cpus() so the table is built once. */
+static void cpu_list_reindex(birq_t *birq)
+{
+	lub_list_node_t *iter;
+
+	free(birq->cpu_index);
+	birq->cpu_index = NULL;
+	birq->cpu_index_num = 0;
+	if (!(iter = lub_list__get_tail(birq->cpus)))
+		return;
+	birq->cpu_index_num = ((cpu_t *)lub_list_node__get_data(iter))->id + 1;
+	if (!(birq->cpu_index = calloc(birq->cpu_index_num,
+		sizeof(*birq->cpu_index)))) {
+		birq->cpu_index_num = 0;
+		return;
+	}
+	for (iter = lub_list_iterator_init(birq->cpus); iter;
+		iter = lub_list_iterator_next(iter)) {
+		cpu_t *cpu = (cpu_t *)lub_list_node__get_data(iter);
+		birq->cpu_index[cpu->id] = cpu;
+	}
+}
+
+/* The search within the engine's CPU list uses the table and it's
+   O(1). The search within other lists (virtual copies) is linear. */
+cpu_t * cpu_list_search(birq_t *birq, lub_list_t *cpus, unsigned int id)
 {
 	lub_list_node_t *node;
 	cpu_t search;
 
+	if ((cpus == birq->cpus) && birq->cpu_index)
+		return (id < birq->cpu_index_num) ? birq->cpu_index[id] : NULL;
 	search.id = id;
 	node = lub_list_search(cpus, &search);
 	if (!node)
@@ -106,9 +196,9 @@ cpu_t * cpu_list_search(lub_list_t *cpus, unsigned int id)
 	return (cpu_t *)lub_list_node__get_data(node);
 }
 
-static cpu_t * cpu_list_add(lub_list_t *cpus, cpu_t *cpu)
+static cpu_t * cpu_list_add(birq_t *birq, lub_list_t *cpus, cpu_t *cpu)
 {
-	cpu_t *old = cpu_list_search(cpus, cpu->id);
+	cpu_t *old = cpu_list_search(birq, cpus, cpu->id);
 
 	if (old) /* CPU already exists. May be renew some fields later */
 		return old;
@@ -117,9 +207,33 @@ static cpu_t * cpu_list_add(lub_list_t *cpus, cpu_t *cpu)
 	return cpu;
 }
 
+/* Get the home CPU of CPU group. It's the first known CPU of group.
+   The IRQ with group affinity is accounted on this CPU. The planner
+   and the linking of IRQs to CPUs use the same rule. */
+cpu_t * cpu_list_group_home(birq_t *birq, lub_list_t *cpus,
+	cpumask_t *group)
+{
+	lub_list_node_t *iter;
+	cpu_t *cpu;
+	int id;
+
+	id = first_cpu(*group);
+	if ((id < NR_CPUS) && (cpu = cpu_list_search(birq, cpus, id)))
+		return cpu;
+	for (iter = lub_list_iterator_init(cpus); iter;
+		iter = lub_list_iterator_next(iter)) {
+		cpu = (cpu_t *)lub_list_node__get_data(iter);
+		if (cpu_isset(cpu->id, *group))
+			return cpu;
+	}
+
+	return NULL;
+}
+
 int cpu_list_free(lub_list_t *cpus)
 {
 	lub_list_node_t *iter;
+
 	while ((iter = lub_list__get_head(cpus))) {
 		cpu_t *cpu;
 		cpu = (cpu_t *)lub_list_node__get_data(iter);
@@ -132,30 +246,235 @@ int cpu_list_free(lub_list_t *cpus)
 }
 
 /* Show CPU information */
-static void show_cpu_info(cpu_t *cpu)
+static void show_cpu_info(birq_t *birq, cpu_t *cpu)
 {
 	char buf[NR_CPUS + 1];
 	cpumask_scnprintf(buf, sizeof(buf), cpu->cpumask);
 	buf[sizeof(buf) - 1] = '\0';
-	printf("CPU %d package %d core %d mask %s\n", cpu->id, cpu->package_id, cpu->core_id, buf);
+	birq_log(birq, LOG_INFO, "CPU %d package %d core %d capacity %u mask %s",
+		cpu->id, cpu->package_id, cpu->core_id, cpu->capacity, buf);
 }
 
 /* Show CPU list */
-int show_cpus(lub_list_t *cpus)
+int show_cpus(birq_t *birq, lub_list_t *cpus)
 {
 	lub_list_node_t *iter;
 	for (iter = lub_list_iterator_init(cpus); iter;
 		iter = lub_list_iterator_next(iter)) {
 		cpu_t *cpu;
 		cpu = (cpu_t *)lub_list_node__get_data(iter);
-		show_cpu_info(cpu);
+		show_cpu_info(birq, cpu);
+	}
+	return 0;
+}
+
+/* Load normalized by CPU capacity. The load of the less powerful CPU
+   means less free capacity. So normalized load is 100% minus free
+   capacity relative to the most powerful CPU. The capacity of thermally
+   throttled CPU is scaled by its current frequency. The time stolen by
+   hypervisor from virtual CPU is not available too. */
+float cpu_load_norm(const cpu_t *cpu)
+{
+	return cpu_load_norm_value(cpu, cpu->load);
+}
+
+/* Normalize specified load (for example predicted one) of CPU */
+float cpu_load_norm_value(const cpu_t *cpu, float load)
+{
+	float capacity = cpu->capacity;
+
+	if ((cpu->avoid & CPU_AVOID_THERMAL) &&
+		cpu->max_freq && cpu->cur_freq)
+		capacity = capacity * cpu->cur_freq / cpu->max_freq;
+	capacity = capacity * (100.0 - cpu->steal) / 100.0;
+
+	return 100.0 - (100.0 - load) * capacity / CPU_CAPACITY_SCALE;
+}
+
+/* Read one unsigned value from CPU's sysfs file */
+int cpu_read_ulong(birq_t *birq, unsigned int id, const char *name,
+	unsigned long *val)
+{
+	char path[PATH_MAX];
+	FILE *fd;
+	int rc;
+
+	snprintf(path, sizeof(path), "%s/cpu%u/%s", SYSFS_CPU_PATH, id, name);
+	path[sizeof(path) - 1] = '\0';
+	if (!(fd = source_open(birq, path)))
+		return -1;
+	rc = fscanf(fd, "%lu", val);
+	fclose(fd);
+	if (rc != 1)
+		return -1;
+
+	return 0;
+}
+
+/* Parse CPU list like "0-3,8,10-11" */
+static int cpulist_parse(const char *str, cpumask_t *cpumask)
+{
+	const char *p = str;
+
+	cpus_clear(*cpumask);
+	while (*p && !iscntrl(*p)) {
+		char *endptr;
+		unsigned long first, last;
+
+		first = strtoul(p, &endptr, 10);
+		if (endptr == p)
+			return -1;
+		last = first;
+		p = endptr;
+		if (*p == '-') {
+			p++;
+			last = strtoul(p, &endptr, 10);
+			if (endptr == p)
+				return -1;
+			p = endptr;
+		}
+		for (; (first <= last) && (first < NR_CPUS); first++)
+			cpu_set(first, *cpumask);
+		if (*p == ',')
+			p++;
 	}
+
 	return 0;
 }
 
+/* Read CPU list of hybrid CPU PMU */
+static int cpulist_read(birq_t *birq, const char *pmu_path,
+	cpumask_t *cpumask)
+{
+	char path[PATH_MAX];
+	FILE *fd;
+	char *str = NULL;
+	size_t sz;
+	int ret = -1;
+
+	snprintf(path, sizeof(path), "%s/cpus", pmu_path);
+	path[sizeof(path) - 1] = '\0';
+	if (!(fd = source_open(birq, path)))
+		return -1;
+	if (getline(&str, &sz, fd) >= 0)
+		ret = cpulist_parse(str, cpumask);
+	fclose(fd);
+	free(str);
+
+	return ret;
+}
+
+/* Get CPU capacities. The kernel shows cpu_capacity on asymmetric
+   platforms like ARM big.LITTLE. Else estimate the capacity from
+   hybrid CPU PMUs (Intel P/E cores) and max CPU frequencies. */
+static void scan_cpu_capacity(birq_t *birq, lub_list_t *cpus)
+{
+	lub_list_node_t *iter;
+	unsigned long max_freq = 0;
+	unsigned long val;
+	cpumask_t atom_cpus;
+	int hybrid;
+
+	for (iter = lub_list_iterator_init(cpus); iter;
+		iter = lub_list_iterator_next(iter)) {
+		cpu_t *cpu = (cpu_t *)lub_list_node__get_data(iter);
+		if (cpu_read_ulong(birq, cpu->id, "cpufreq/cpuinfo_max_freq", &val))
+			continue;
+		cpu->max_freq = val;
+		if (val > max_freq)
+			max_freq = val;
+	}
+
+	/* The kernel knows better */
+	for (iter = lub_list_iterator_init(cpus); iter;
+		iter = lub_list_iterator_next(iter)) {
+		cpu_t *cpu = (cpu_t *)lub_list_node__get_data(iter);
+		if (cpu_read_ulong(birq, cpu->id, "cpu_capacity", &val))
+			break;
+		cpu->capacity = val;
+	}
+	if (!iter)
+		return;
+
+	cpus_init(atom_cpus);
+	hybrid = (source_exists(birq, SYSFS_CPU_CORE_PATH) &&
+		!cpulist_read(birq, SYSFS_CPU_ATOM_PATH, &atom_cpus));
+	for (iter = lub_list_iterator_init(cpus); iter;
+		iter = lub_list_iterator_next(iter)) {
+		cpu_t *cpu = (cpu_t *)lub_list_node__get_data(iter);
+		unsigned long capacity = CPU_CAPACITY_SCALE;
+		if (max_freq && cpu->max_freq && (cpu->max_freq * 100 <
+			max_freq * (100 - CPU_CAPACITY_TOLERANCE)))
+			capacity = capacity * cpu->max_freq / max_freq;
+		if (hybrid && cpu_isset(cpu->id, atom_cpus))
+			capacity = capacity * CPU_ATOM_CAPACITY / 100;
+		if (!capacity)
+			capacity = 1;
+		cpu->capacity = capacity;
+	}
+	cpus_free(atom_cpus);
+}
+
+/* Get CPUs sharing the last level cache with specified CPU. The last
+   level cache is the cache with the max level. */
+static void scan_cpu_llc(birq_t *birq, cpu_t *cpu)
+{
+	char path[PATH_MAX];
+	unsigned int index;
+	unsigned long level;
+	unsigned long max_level = 0;
+	char *str = NULL;
+	size_t sz;
+	FILE *fd;
+
+	for (index = 0; ; index++) {
+		snprintf(path, sizeof(path), "cache/index%u/level", index);
+		path[sizeof(path) - 1] = '\0';
+		if (cpu_read_ulong(birq, cpu->id, path, &level))
+			break;
+		if (level <= max_level)
+			continue;
+		snprintf(path, sizeof(path), "%s/cpu%u/cache/index%u/shared_cpu_map",
+			SYSFS_CPU_PATH, cpu->id, index);
+		path[sizeof(path) - 1] = '\0';
+		if (!(fd = source_open(birq, path)))
+			continue;
+		if (getline(&str, &sz, fd) >= 0) {
+			cpumask_parse_user(str, strlen(str), cpu->llc_cpus);
+			max_level = level;
+		}
+		fclose(fd);
+	}
+	free(str);
+}
+
+/* Get SMT siblings of each CPU. These are the known CPUs with the same
+   package and core IDs. It's done once per topology scan so the
+   placement unit "core" doesn't search for siblings each time. */
+static void scan_cpu_cores(lub_list_t *cpus)
+{
+	lub_list_node_t *iter;
+
+	for (iter = lub_list_iterator_init(cpus); iter;
+		iter = lub_list_iterator_next(iter)) {
+		cpu_t *cpu = (cpu_t *)lub_list_node__get_data(iter);
+		lub_list_node_t *iter2;
+
+		cpus_copy(cpu->core_cpus, cpu->cpumask);
+		for (iter2 = lub_list_iterator_init(cpus); iter2;
+			iter2 = lub_list_iterator_next(iter2)) {
+			cpu_t *sibling = (cpu_t *)lub_list_node__get_data(iter2);
+			if ((sibling->package_id == cpu->package_id) &&
+				(sibling->core_id == cpu->core_id))
+				cpu_set(sibling->id, cpu->core_cpus);
+		}
+	}
+}
+
 /* Search for CPUs */
-int scan_cpus(lub_list_t *cpus, int ht)
+int scan_cpus(birq_t *birq, int ht)
 {
+	lub_list_t *cpus = birq->cpus;
 	FILE *fd;
 	char path[PATH_MAX];
 	unsigned int id;
@@ -170,7 +489,7 @@ int scan_cpus(lub_list_t *cpus, int ht)
 	for (id = 0; id < NR_CPUS; id++) {
 		snprintf(path, sizeof(path), "%s/cpu%d", SYSFS_CPU_PATH, id);
 		path[sizeof(path) - 1] = '\0';
-		if (access(path, F_OK))
+		if (!source_exists(birq, path))
 			break;
 
 		/* Try to get package_id */
@@ -178,7 +497,7 @@ int scan_cpus(lub_list_t *cpus, int ht)
 			"%s/cpu%d/topology/physical_package_id",
 			SYSFS_CPU_PATH, id);
 		path[sizeof(path) - 1] = '\0';
-		if (!(fd = fopen(path, "r")))
+		if (!(fd = source_open(birq, path)))
 			continue;
 		if (fscanf(fd, "%u", &package_id) < 0) {
 			fclose(fd);
@@ -190,7 +509,7 @@ int scan_cpus(lub_list_t *cpus, int ht)
 		snprintf(path, sizeof(path), "%s/cpu%d/topology/core_id",
 			SYSFS_CPU_PATH, id);
 		path[sizeof(path) - 1] = '\0';
-		if (!(fd = fopen(path, "r")))
+		if (!(fd = source_open(birq, path)))
 			continue;
 		if (fscanf(fd, "%u", &core_id) < 0) {
 			fclose(fd);
@@ -204,7 +523,7 @@ int scan_cpus(lub_list_t *cpus, int ht)
 		snprintf(path, sizeof(path), "%s/cpu%d/topology/thread_siblings",
 			SYSFS_CPU_PATH, id);
 		path[sizeof(path) - 1] = '\0';
-		if ((fd = fopen(path, "r"))) {
+		if ((fd = source_open(birq, path))) {
 			if (getline(&str, &sz, fd) >= 0)
 				cpumask_parse_user(str, strlen(str), thread_siblings);
 			fclose(fd);
@@ -218,10 +537,15 @@ int scan_cpus(lub_list_t *cpus, int ht)
 		new = cpu_new(id);
 		new->package_id = package_id;
 		new->core_id = core_id;
-		cpu_list_add(cpus, new);
+		scan_cpu_llc(birq, new);
+		cpu_list_add(birq, cpus, new);
 	}
 	cpus_free(thread_siblings);
 	free(str);
 
+	scan_cpu_capacity(birq, cpus);
+	scan_cpu_cores(cpus);
+	cpu_list_reindex(birq);
+
 	return 0;
 }
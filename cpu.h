@@ -3,22 +3,76 @@
 
 #include "lub/list.h"
 #include "cpumask.h"
+#include "libbirq.h"
 
 struct cpu_s {
+	/* Hot fields. They are touched by the scans on each iteration.
+	   The block is 64 bytes on LP64 and the cpu_new() aligns the
+	   structure to CACHE_LINE_SIZE so the block is one cache line.
+	   Check the size when a field is added here. */
+	unsigned long long old_load_all; /* Previous whole load from /proc/stat */
+	unsigned long long old_load_irq; /* Previous IRQ, softIRQ load */
+	unsigned long long old_load_steal; /* Previous steal time */
+	unsigned long long old_load_stamp; /* Time of previous load sample, usec */
+	lub_list_t *irqs; /* List of IRQs belong to this CPU. */
 	unsigned int id; /* Logical processor ID */
+	float load; /* Current CPU load in percents. */
+	float steal; /* Time stolen by hypervisor in percents. */
+	float load_error; /* Half-width of load confidence interval, percents */
+	int avoid; /* Don't move IRQs to this CPU if possible. CPU_AVOID_* */
+	int evacuate; /* Move heavy IRQs away from this CPU. CPU_AVOID_* */
+	/* Cold fields */
+	float old_load; /* Previous CPU load in percents. Shown only */
 	unsigned int package_id;
 	unsigned int core_id;
+	unsigned int capacity; /* Relative capacity. Max is CPU_CAPACITY_SCALE */
+	unsigned long max_freq; /* Max frequency, kHz. 0 if unknown */
+	unsigned long cur_freq; /* Current frequency, kHz. 0 if unknown */
 	cpumask_t cpumask; /* Mask with one bit set - current CPU. */
-	unsigned long long old_load_all; /* Previous whole load from /proc/stat */
-	unsigned long long old_load_irq; /* Previous IRQ, softIRQ load */
-	float old_load; /* Previous CPU load in percents. */
-	float load; /* Current CPU load in percents. */
-	lub_list_t *irqs; /* List of IRQs belong to this CPU. */
+	cpumask_t llc_cpus; /* CPUs sharing the last level cache */
+	cpumask_t core_cpus; /* Known SMT siblings of CPU including itself */
+	float predicted_load; /* Predicted CPU load in percents. */
+	unsigned long long old_idle_deep; /* Previous time in deep idle states, usec */
+	unsigned long long old_idle_stamp; /* Time of previous idle sample, usec */
+	float deep_idle; /* Time in deep idle states, in percents. */
+	unsigned long long old_idle_total; /* Previous time in idle states, usec */
+	unsigned long long old_idle_weighted; /* Previous idle time * exit latency */
+	float idle_latency; /* Average exit latency of idle states, usec */
+	unsigned long long old_throttle; /* Previous thermal throttle count. -1 if unknown */
+	unsigned int throttle_ticks; /* Iterations the throttle count rises */
+	unsigned long saved_min_freq; /* Original min frequency. 0 if not raised */
+	unsigned long noop_floor; /* Floor found not above min frequency. 0 - none */
+	char *saved_epp; /* Original energy performance preference */
+	unsigned int vectors; /* Estimated budget of IRQ vectors. 0 - unknown */
+	float intr; /* Interrupts of last sample. Group IRQs are split */
 };
 typedef struct cpu_s cpu_t;
 
+/* Reasons to avoid CPU as a target for IRQs */
+#define CPU_AVOID_THERMAL 0x01 /* CPU is thermally throttled */
+#define CPU_AVOID_STEAL 0x02 /* Virtual CPU has high steal time */
+#define CPU_AVOID_RT 0x04 /* CPU runs real-time or latency-critical tasks */
+
+/* Size of CPU cache line. The hot fields of cpu_t and irq_t fit it */
+#define CACHE_LINE_SIZE 64
+
 /* System CPU info */
 #define SYSFS_CPU_PATH "/sys/devices/system/cpu"
+/* Hybrid CPU PMUs. Each one has "cpus" list file */
+#define SYSFS_CPU_CORE_PATH "/sys/devices/cpu_core"
+#define SYSFS_CPU_ATOM_PATH "/sys/devices/cpu_atom"
+
+/* The capacity of the most powerful CPU like in the Linux kernel */
+#define CPU_CAPACITY_SCALE 1024
+/* The CPUs with capacities (or max frequencies) within this tolerance,
+   in percents, are equal. The "favored" cores of Turbo Boost Max 3.0
+   report slightly higher max frequency but the CPUs are the same. */
+#define CPU_CAPACITY_TOLERANCE 5
+
+/* Capacity of hybrid "atom" CPU relative to "core" CPU with the same
+   frequency, in percents. It's used when kernel doesn't show
+   cpu_capacity. */
+#define CPU_ATOM_CAPACITY 60
 
 /* CPU IDs compare function */
 int cpu_list_compare(const void *first, const void *second);
@@ -26,8 +80,15 @@ int cpu_list_compare_len(const void *first, const void *second);
 
 /* CPU list functions */
 int cpu_list_free(lub_list_t *cpus);
-int scan_cpus(lub_list_t *cpus, int ht);
-int show_cpus(lub_list_t *cpus);
-cpu_t * cpu_list_search(lub_list_t *cpus, unsigned int id);
+int scan_cpus(birq_t *birq, int ht);
+lub_list_t *cpu_list_clone(lub_list_t *cpus);
+int show_cpus(birq_t *birq, lub_list_t *cpus);
+cpu_t * cpu_list_search(birq_t *birq, lub_list_t *cpus, unsigned int id);
+cpu_t * cpu_list_group_home(birq_t *birq, lub_list_t *cpus,
+	cpumask_t *group);
+float cpu_load_norm(const cpu_t *cpu);
+float cpu_load_norm_value(const cpu_t *cpu, float load);
+int cpu_read_ulong(birq_t *birq, unsigned int id, const char *name,
+	unsigned long *val);
 
 #endif
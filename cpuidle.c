@@ -0,0 +1,85 @@
+/* cpuidle.c
+ * Gather CPU idle states residency.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include "lub/list.h"
+#include "cpu.h"
+#include "cpuidle.h"
+#include "source.h"
+
+/* Read one unsigned value from cpuidle state file */
+static int cpuidle_read(birq_t *birq, unsigned int cpu, unsigned int state,
+	const char *name, unsigned long long *val)
+{
+	char path[PATH_MAX];
+	FILE *fd;
+	int rc;
+
+	snprintf(path, sizeof(path), "%s/cpu%u/cpuidle/state%u/%s",
+		SYSFS_CPU_PATH, cpu, state, name);
+	path[sizeof(path) - 1] = '\0';
+	if (!(fd = source_open(birq, path)))
+		return -1;
+	rc = fscanf(fd, "%llu", val);
+	fclose(fd);
+	if (rc != 1)
+		return -1;
+
+	return 0;
+}
+
+/* Get the part of time CPUs spent in deep idle states since previous
+   iteration and the average exit latency of idle states CPU was in.
+   The cpuidle "time" and "latency" files are in usec. */
+void gather_cpuidle(birq_t *birq, lub_list_t *cpus)
+{
+	lub_list_node_t *iter;
+
+	for (iter = lub_list_iterator_init(cpus); iter;
+		iter = lub_list_iterator_next(iter)) {
+		cpu_t *cpu = (cpu_t *)lub_list_node__get_data(iter);
+		unsigned long long deep = 0;
+		unsigned long long total = 0;
+		unsigned long long weighted = 0;
+		unsigned long long stamp;
+		unsigned int state;
+
+		for (state = 0; ; state++) {
+			unsigned long long latency;
+			unsigned long long time;
+			if (cpuidle_read(birq, cpu->id, state, "latency", &latency))
+				break;
+			if (cpuidle_read(birq, cpu->id, state, "time", &time))
+				break;
+			if (latency > CPUIDLE_SHALLOW_LATENCY)
+				deep += time;
+			total += time;
+			weighted += time * latency;
+		}
+		/* No cpuidle info for this CPU */
+		if (state == 0)
+			continue;
+
+		stamp = birq_clock(birq);
+		if (cpu->old_idle_stamp && (stamp > cpu->old_idle_stamp)) {
+			cpu->deep_idle = (float)(deep - cpu->old_idle_deep) *
+				100 / (stamp - cpu->old_idle_stamp);
+			if (cpu->deep_idle > 100.0)
+				cpu->deep_idle = 100.0;
+		}
+		if (cpu->old_idle_stamp && (total > cpu->old_idle_total))
+			cpu->idle_latency = (float)(weighted - cpu->old_idle_weighted) /
+				(total - cpu->old_idle_total);
+		cpu->old_idle_total = total;
+		cpu->old_idle_weighted = weighted;
+		cpu->old_idle_deep = deep;
+		cpu->old_idle_stamp = stamp;
+	}
+}
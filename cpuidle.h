@@ -0,0 +1,13 @@
+#ifndef _cpuidle_h
+#define _cpuidle_h
+
+#include "lub/list.h"
+#include "libbirq.h"
+
+/* The idle states with exit latency greater than this value (usec)
+   are considered as deep idle states. */
+#define CPUIDLE_SHALLOW_LATENCY 20
+
+void gather_cpuidle(birq_t *birq, lub_list_t *cpus);
+
+#endif
@@ -0,0 +1,444 @@
+/* engine.c
+ * Engine of balancer. The iteration of main loop.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "lub/list.h"
+#include "cpumask.h"
+#include "irq.h"
+#include "numa.h"
+#include "cpu.h"
+#include "statistics.h"
+#include "balance.h"
+#include "pxm.h"
+#include "forecast.h"
+#include "cpuidle.h"
+#include "pack.h"
+#include "thermal.h"
+#include "freq.h"
+#include "tasks.h"
+#include "consumer.h"
+#include "vfio.h"
+#include "storm.h"
+#include "external.h"
+#include "shadow.h"
+#include "module.h"
+#include "probes.h"
+#include "source.h"
+#include "engine.h"
+
+/* Set defaults. The strings are not set. */
+void birq_config_init(birq_config_t *cfg)
+{
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->threshold = BIRQ_DEFAULT_THRESHOLD;
+	cfg->load_limit = BIRQ_DEFAULT_LOAD_LIMIT;
+	cfg->strategy = BIRQ_CHOOSE_RND;
+	cfg->cpu_strategy = BIRQ_CPU_MIN;
+	cfg->cpu_choices = BIRQ_DEFAULT_CPU_CHOICES;
+	cfg->forecast_horizon = BIRQ_DEFAULT_FORECAST_HORIZON;
+	cfg->heavy_load = BIRQ_DEFAULT_HEAVY_LOAD;
+	cfg->tasks_interval = BIRQ_TASKS_INTERVAL;
+	cfg->storm_cpu = -1;
+	cfg->external = BIRQ_EXTERNAL_RECLAIM;
+	cfg->external_timeout = BIRQ_DEFAULT_EXTERNAL_TIMEOUT;
+}
+
+static char *config_strdup(const char *str)
+{
+	return str ? strdup(str) : NULL;
+}
+
+/* Copy configuration with its strings */
+static void config_copy(birq_config_t *dst, const birq_config_t *src)
+{
+	*dst = *src;
+	dst->latency_irqs = config_strdup(src->latency_irqs);
+	dst->granularity = config_strdup(src->granularity);
+	dst->awake_cpus = config_strdup(src->awake_cpus);
+	dst->freq_floor_epp = config_strdup(src->freq_floor_epp);
+	dst->rt_cgroups = config_strdup(src->rt_cgroups);
+	dst->consumers = config_strdup(src->consumers);
+	dst->shadow = config_strdup(src->shadow);
+	dst->strategy_module = config_strdup(src->strategy_module);
+	dst->strategy_dir = config_strdup(src->strategy_dir);
+	dst->exclude_cpus = config_strdup(src->exclude_cpus);
+	dst->use_cpus = config_strdup(src->use_cpus);
+}
+
+/* Free strings of configuration copy */
+static void config_free(birq_config_t *cfg)
+{
+	free(cfg->latency_irqs);
+	free(cfg->granularity);
+	free(cfg->awake_cpus);
+	free(cfg->freq_floor_epp);
+	free(cfg->rt_cgroups);
+	free(cfg->consumers);
+	free(cfg->shadow);
+	free(cfg->strategy_module);
+	free(cfg->strategy_dir);
+	free(cfg->exclude_cpus);
+	free(cfg->use_cpus);
+	birq_config_init(cfg);
+}
+
+/* Parse CPU mask option. Returns 0 on success. */
+static int config_parse_mask(birq_t *birq, const char *name,
+	const char *str, cpumask_t *cpumask)
+{
+	if (cpumask_parse_user(str, strlen(str), *cpumask)) {
+		birq_log(birq, LOG_ERR,
+			"Error: Can't parse %s option \"%s\".", name, str);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Free list of IRQs queued to balance. The IRQs are not freed. */
+static void balance_list_flush(lub_list_t *balance_irqs)
+{
+	lub_list_node_t *node;
+
+	while ((node = lub_list__get_tail(balance_irqs))) {
+		lub_list_del(balance_irqs, node);
+		lub_list_node_free(node);
+	}
+}
+
+/* Scan topology and prepare engine state. The env is environment of
+   engine. It can be NULL to use the real one. The pxm is proximity
+   config file. It can be NULL. */
+birq_t *birq_new(const birq_env_t *env, int ht, const char *pxm)
+{
+	birq_t *new;
+
+	if (!(new = malloc(sizeof(*new))))
+		return NULL;
+	source_init(&new->env, env);
+	birq_config_init(&new->cfg);
+	new->granularity = NULL;
+	cpus_init(new->awake_cpus);
+	cpus_clear(new->awake_cpus);
+	cpus_init(new->cfg_exclude_cpus);
+	cpus_clear(new->cfg_exclude_cpus);
+	new->quiet = 0;
+	new->cpu_index = NULL;
+	new->cpu_index_num = 0;
+	new->irq_index = NULL;
+	new->irq_index_num = 0;
+
+	/* Scan NUMA nodes */
+	new->numas = lub_list_new(numa_list_compare);
+	scan_numas(new, new->numas);
+
+	/* Scan CPUs */
+	new->cpus = lub_list_new(cpu_list_compare);
+	scan_cpus(new, ht);
+
+	/* Prepare data structures */
+	new->irqs = lub_list_new(irq_list_compare);
+	new->balance_irqs = lub_list_new(irq_list_compare);
+
+	/* Parse proximity file */
+	new->pxms = lub_list_new(NULL);
+	if (pxm)
+		parse_pxm_config(new, pxm, new->pxms, new->numas);
+
+	new->pack = pack_new();
+	new->storm = storm_new();
+	new->vfio = vfio_new();
+	new->shadow = NULL;
+	new->module = NULL;
+	new->tasks_time = 0;
+	cpus_init(new->exclude_cpus);
+	cpus_clear(new->exclude_cpus);
+
+	return new;
+}
+
+/* Restore CPU settings and free engine state */
+void birq_free(birq_t *birq)
+{
+	if (!birq)
+		return;
+
+	/* Restore CPU frequency settings */
+	freq_floor_restore(birq, birq->cpus);
+
+	irq_list_free(birq->irqs);
+	lub_list_free(birq->balance_irqs);
+	cpu_list_free(birq->cpus);
+	numa_list_free(birq->numas);
+	pxm_list_free(birq->pxms);
+	pack_free(birq->pack);
+	storm_free(birq->storm);
+	vfio_free(birq->vfio);
+	shadow_free(birq->shadow);
+	module_free(birq->module);
+	if (birq->granularity)
+		irq_gran_rules_free(birq->granularity);
+	config_free(&birq->cfg);
+	cpus_free(birq->awake_cpus);
+	cpus_free(birq->cfg_exclude_cpus);
+	cpus_free(birq->exclude_cpus);
+	free(birq->cpu_index);
+	free(birq->irq_index);
+	free(birq);
+}
+
+/* Apply new configuration. The engine keeps its own copy. The shadow
+   policies and strategy module are set up again. Returns -1 if the
+   configuration is illegal or the strategy module can't be loaded.
+   The previous configuration stays in this case. */
+int birq_configure(birq_t *birq, const birq_config_t *cfg)
+{
+	lub_list_t *granularity = NULL;
+	module_t *module = NULL;
+	cpumask_t awake_cpus;
+	cpumask_t exclude_cpus;
+	cpumask_t use_cpus;
+	int ret = -1;
+
+	cpus_init(awake_cpus);
+	cpus_clear(awake_cpus);
+	cpus_init(exclude_cpus);
+	cpus_clear(exclude_cpus);
+	cpus_init(use_cpus);
+	cpus_setall(use_cpus);
+
+	if (cfg->awake_cpus && config_parse_mask(birq, "awake-cpus",
+		cfg->awake_cpus, &awake_cpus))
+		goto err;
+	if (cfg->exclude_cpus && config_parse_mask(birq, "exclude-cpus",
+		cfg->exclude_cpus, &exclude_cpus))
+		goto err;
+	if (cfg->use_cpus && config_parse_mask(birq, "use-cpus",
+		cfg->use_cpus, &use_cpus))
+		goto err;
+	if (cfg->storm_cpu >= NR_CPUS) {
+		birq_log(birq, LOG_ERR, "Error: Illegal storm-cpu value %d.",
+			cfg->storm_cpu);
+		goto err;
+	}
+	if (cfg->cpu_choices < 1) {
+		birq_log(birq, LOG_ERR,
+			"Error: The cpu-choices value must be >= 1.");
+		goto err;
+	}
+	if (cfg->granularity &&
+		!(granularity = irq_gran_rules_parse(birq, cfg->granularity)))
+		goto err;
+	if (cfg->strategy_module && !(module = module_load(birq,
+		cfg->strategy_dir ? cfg->strategy_dir : BIRQ_STRATEGY_DIR,
+		cfg->strategy_module))) {
+		if (granularity)
+			irq_gran_rules_free(granularity);
+		goto err;
+	}
+
+	/* The exclude-cpus option was implemented first. So the
+	 * programm is based on it. The use-cpus options really
+	 * says to exclude all the cpus that is not within bitmask.
+	 * So invert use-cpus and we'll get exclude-cpus mask.
+	 * real-exclude-cpus = exclude-cpus | ~use-cpus
+	 */
+	cpus_complement(use_cpus, use_cpus);
+	cpus_or(birq->cfg_exclude_cpus, exclude_cpus, use_cpus);
+	cpus_copy(birq->awake_cpus, awake_cpus);
+	if (birq->granularity)
+		irq_gran_rules_free(birq->granularity);
+	birq->granularity = granularity;
+	module_free(birq->module);
+	birq->module = module;
+	config_free(&birq->cfg);
+	config_copy(&birq->cfg, cfg);
+	/* Scores of old shadow policies are not comparable anymore */
+	shadow_free(birq->shadow);
+	birq->shadow = shadow_new(birq, cfg->shadow);
+	ret = 0;
+
+err:
+	cpus_free(awake_cpus);
+	cpus_free(exclude_cpus);
+	cpus_free(use_cpus);
+
+	return ret;
+}
+
+/* Show found topology */
+void birq_show(birq_t *birq)
+{
+	show_numas(birq, birq->numas);
+	show_cpus(birq, birq->cpus);
+	show_pxms(birq, birq->pxms);
+}
+
+/* One iteration of balancer. Scan IRQs, gather statistics, plan and
+   apply the moves. It doesn't sleep. Returns number of IRQs that got
+   new affinity. The caller can iterate more often while IRQs are
+   being moved. */
+unsigned int birq_tick(birq_t *birq)
+{
+	birq_config_t *cfg = &birq->cfg;
+	lub_list_t *cpus = birq->cpus;
+	lub_list_t *irqs = birq->irqs;
+	lub_list_t *balance_irqs = birq->balance_irqs;
+	unsigned int moved;
+	int packed;
+
+	/* Rescan PCI devices for new IRQs. */
+	BIRQ_STAGE_START("scan");
+	scan_irqs(birq);
+	/* Find IRQs changed by somebody else. */
+	external_detect(birq, irqs, balance_irqs, cfg->external,
+		cfg->external_timeout, birq_time(birq));
+	/* Mark latency-sensitive IRQs. */
+	irq_list_mark_latency(irqs, cfg->latency_irqs);
+	/* Set placement unit of IRQs. */
+	irq_list_mark_granularity(irqs, birq->granularity);
+	if (cfg->verbose)
+		irq_list_show(birq, irqs);
+	/* Link IRQs to CPUs due to real current smp affinity. */
+	link_irqs_to_cpus(birq, cpus, irqs);
+	BIRQ_STAGE_END("scan");
+
+	/* Gather statistics on CPU load and number of interrupts. */
+	BIRQ_STAGE_START("statistics");
+	gather_statistics(birq, cpus, irqs, cfg->steal_limit);
+	show_statistics(birq, cpus, cfg->verbose);
+	/* Find interrupt storms and quarantine stormy IRQs. */
+	storm_detect(birq, birq->storm, cpus, irqs, balance_irqs,
+		cfg->storm_rate, cfg->storm_cpu, birq_time(birq));
+	cpus_copy(birq->exclude_cpus, birq->cfg_exclude_cpus);
+	if (birq->storm)
+		cpus_or(birq->exclude_cpus, birq->exclude_cpus,
+			birq->storm->cpus);
+	/* Check pending moves and retry failed affinity writes. */
+	check_affinity(birq, irqs);
+	retry_affinity(birq, irqs, balance_irqs);
+	BIRQ_STAGE_END("statistics");
+	/* Find CPUs running latency-critical tasks and CPUs
+	   running IRQ consumers. The scan is expensive so use
+	   its own interval. */
+	if ((birq_time(birq) - birq->tasks_time) >= cfg->tasks_interval) {
+		BIRQ_STAGE_START("tasks");
+		scan_tasks(birq, cpus, cfg->rt_tasks, cfg->rt_cgroups);
+		scan_consumers(birq, cpus, irqs, balance_irqs, cfg->consumers,
+			&birq->exclude_cpus);
+		scan_vfio(birq, birq->vfio, irqs, balance_irqs, cfg->vfio);
+		birq->tasks_time = birq_time(birq);
+		BIRQ_STAGE_END("tasks");
+	}
+	/* Find thermally throttled CPUs. */
+	BIRQ_STAGE_START("sensors");
+	gather_thermal(birq, cpus, cfg->thermal);
+	/* Gather idle states residency to check power savings
+	   and to find CPUs for latency-sensitive IRQs. */
+	if ((cfg->pack_watermark > 0) || cfg->latency_irqs)
+		gather_cpuidle(birq, cpus);
+	BIRQ_STAGE_END("sensors");
+	/* Predict IRQ rates and CPU load. */
+	BIRQ_STAGE_START("forecast");
+	forecast_update(cpus, irqs, birq_time(birq),
+		cfg->forecast_season, cfg->forecast_horizon);
+	BIRQ_STAGE_END("forecast");
+	/* Evaluate alternative policies on the same snapshot. */
+	BIRQ_STAGE_START("shadow");
+	shadow_update(birq, birq->shadow, cpus, cfg->load_limit,
+		&birq->exclude_cpus, cfg->non_local_cpus, cfg->cpu_strategy,
+		cfg->cpu_choices, &birq->awake_cpus, cfg->heavy_load,
+		&cfg->strategy, &cfg->threshold, cfg->shadow_promote);
+	BIRQ_STAGE_END("shadow");
+	/* Pack IRQs to the fewest CPUs while low load. */
+	BIRQ_STAGE_START("plan");
+	packed = pack_irqs(birq, birq->pack, cpus, birq->numas, balance_irqs,
+		cfg->pack_watermark, &birq->exclude_cpus);
+	/* Choose IRQ to move to another CPU. The loadable strategy
+	   module replaces the choice on overloaded CPUs only. The IRQs
+	   on excluded, evacuated and predicted CPUs are still chosen
+	   by built-in code. */
+	if (!packed)
+		choose_irqs_to_move(birq, cpus, balance_irqs, cfg->threshold,
+			birq->module ? BIRQ_CHOOSE_NONE : cfg->strategy,
+			&birq->exclude_cpus, cfg->heavy_load);
+	/* Choose new CPU for IRQs need to be balanced.
+	   The packed IRQs have new CPU already. */
+	if (!packed && (lub_list_len(balance_irqs) != 0))
+		balance(birq, cpus, balance_irqs, cfg->load_limit,
+			&birq->exclude_cpus, cfg->non_local_cpus,
+			cfg->cpu_strategy, cfg->cpu_choices,
+			&birq->awake_cpus, cfg->heavy_load);
+	/* The module proposes moves with target CPUs. It sees the
+	   moves chosen above. */
+	if (!packed && birq->module)
+		module_plan(birq, birq->module, cpus, irqs, balance_irqs,
+			cfg->threshold, cfg->load_limit,
+			&birq->exclude_cpus, cfg->non_local_cpus);
+	BIRQ_STAGE_END("plan");
+
+	/* Balance IRQs */
+	moved = lub_list_len(balance_irqs);
+	if (moved != 0) {
+		/* Write new values to /proc/irq/<IRQ>/smp_affinity */
+		BIRQ_STAGE_START("apply");
+		apply_affinity(birq, balance_irqs);
+		BIRQ_STAGE_END("apply");
+		/* Free list of balanced IRQs */
+		balance_list_flush(balance_irqs);
+	}
+	/* Keep frequency floor on CPUs with heavy IRQs */
+	freq_floor_apply(birq, cpus, cfg->freq_floor_load,
+		cfg->freq_floor, cfg->freq_floor_epp);
+
+	return moved;
+}
+
+/* Take calibration sample for birq_place(). The first call initializes
+   counters. The next one gets loads and number of interrupts since the
+   previous call. */
+void birq_calibrate(birq_t *birq)
+{
+	scan_irqs(birq);
+	/* The new IRQs are placed by birq_place() */
+	balance_list_flush(birq->balance_irqs);
+	irq_list_mark_granularity(birq->irqs, birq->granularity);
+	link_irqs_to_cpus(birq, birq->cpus, birq->irqs);
+	gather_statistics(birq, birq->cpus, birq->irqs,
+		birq->cfg.steal_limit);
+}
+
+/* Place all IRQs globally by calibration sample and apply the placement
+   in one batch. The plan is a stream to print the placement as shell
+   script instead of applying it. It can be NULL. Returns number of
+   placed IRQs. */
+int birq_place(birq_t *birq, FILE *plan)
+{
+	birq_config_t *cfg = &birq->cfg;
+	int placed;
+
+	if (cfg->verbose)
+		show_statistics(birq, birq->cpus, cfg->verbose);
+	if (cfg->vfio) {
+		scan_vfio(birq, birq->vfio, birq->irqs, birq->balance_irqs,
+			cfg->vfio);
+		balance_list_flush(birq->balance_irqs);
+	}
+
+	place_irqs(birq, birq->cpus, birq->irqs, birq->balance_irqs,
+		cfg->load_limit, &birq->cfg_exclude_cpus, cfg->non_local_cpus,
+		&birq->awake_cpus, cfg->heavy_load);
+	placed = lub_list_len(birq->balance_irqs);
+	if (plan)
+		print_plan(plan, birq->balance_irqs);
+	else
+		apply_affinity(birq, birq->balance_irqs);
+	balance_list_flush(birq->balance_irqs);
+
+	return placed;
+}
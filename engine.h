@@ -0,0 +1,45 @@
+#ifndef _engine_h
+#define _engine_h
+
+#include <time.h>
+#include "libbirq.h"
+#include "lub/list.h"
+#include "cpumask.h"
+#include "cpu.h"
+#include "irq.h"
+#include "pack.h"
+#include "storm.h"
+#include "vfio.h"
+#include "shadow.h"
+#include "module.h"
+
+/* Engine state */
+struct birq_s {
+	birq_env_t env; /* Data source and sink, clocks and log */
+	birq_config_t cfg; /* Own copy of configuration */
+	lub_list_t *granularity; /* Parsed placement unit rules */
+	cpumask_t awake_cpus; /* Parsed awake-cpus */
+	cpumask_t cfg_exclude_cpus; /* Parsed exclude-cpus and use-cpus */
+	lub_list_t *irqs; /* All found IRQs */
+	lub_list_t *balance_irqs; /* IRQs need to be balanced */
+	lub_list_t *cpus; /* All found CPUs */
+	lub_list_t *numas; /* All found NUMA nodes */
+	lub_list_t *pxms; /* Proximity list */
+	pack_t *pack; /* IRQ packing state */
+	storm_t *storm; /* Interrupt storm state */
+	vfio_t *vfio; /* Owners of vfio devices */
+	shadow_t *shadow; /* Shadow policies. NULL - none */
+	module_t *module; /* Loadable strategy module. NULL - built-in */
+	time_t tasks_time; /* Time of last task scan */
+	cpumask_t exclude_cpus; /* Excluded CPUs including quarantine CPU */
+	int quiet; /* Don't log. The planning is virtual */
+	/* Dense tables of CPUs and IRQs indexed by ID. They make the
+	   search within the cpus and irqs lists O(1). See
+	   cpu_list_search() and irq_list_search(). */
+	cpu_t **cpu_index;
+	unsigned int cpu_index_num;
+	irq_t **irq_index;
+	unsigned int irq_index_num;
+};
+
+#endif
@@ -0,0 +1,64 @@
+/* strategy-max.c
+ * Example of loadable strategy module. It moves the heaviest IRQ from
+ * each overloaded CPU to the least loaded allowed CPU.
+ *
+ * cc -shared -fPIC -I<birq sources> -o max.so strategy-max.c
+ */
+
+#include "strategy.h"
+
+static unsigned int plan(const birq_snapshot_t *snapshot,
+	birq_move_t *moves, unsigned int max_moves)
+{
+	unsigned int num = 0;
+	unsigned int c;
+
+	for (c = 0; (c < snapshot->cpu_num) && (num < max_moves); c++) {
+		const birq_irq_info_t *irq;
+		int heaviest = -1;
+		int target = -1;
+		unsigned int i;
+
+		if (snapshot->cpus[c].load < snapshot->threshold)
+			continue;
+		for (i = 0; i < snapshot->irq_num; i++) {
+			irq = &snapshot->irqs[i];
+			if ((irq->cpu != (int)c) || !irq->movable)
+				continue;
+			if ((heaviest < 0) ||
+				(irq->intr > snapshot->irqs[heaviest].intr))
+				heaviest = i;
+		}
+		if (heaviest < 0)
+			continue;
+		irq = &snapshot->irqs[heaviest];
+		for (i = 0; i < snapshot->cpu_num; i++) {
+			if ((i == c) || snapshot->cpus[i].excluded ||
+				snapshot->cpus[i].full || !irq->local[i])
+				continue;
+			if (snapshot->cpus[i].load_norm >= snapshot->load_limit)
+				continue;
+			/* The CPU to avoid is used if there is no other */
+			if ((target < 0) || (snapshot->cpus[i].avoid <
+				snapshot->cpus[target].avoid) ||
+				((snapshot->cpus[i].avoid ==
+				snapshot->cpus[target].avoid) &&
+				(snapshot->cpus[i].load_norm <
+				snapshot->cpus[target].load_norm)))
+				target = i;
+		}
+		if (target < 0)
+			continue;
+		moves[num].irq = heaviest;
+		moves[num].cpu = target;
+		num++;
+	}
+
+	return num;
+}
+
+const birq_strategy_t birq_strategy = {
+	BIRQ_STRATEGY_ABI,
+	"max",
+	plan
+};
@@ -0,0 +1,73 @@
+/* external.c
+ * Detect external writers of IRQ affinity.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "lub/list.h"
+#include "cpumask.h"
+#include "irq.h"
+#include "external.h"
+#include "source.h"
+
+/* Compare current affinity of IRQs to the mask birq wrote last time.
+   The difference is a change made by somebody else (irqbalance, tuned,
+   operator). Freeze such IRQ due to policy and raise an alert when
+   external writer changes the IRQ birq has reclaimed again and again. */
+void external_detect(birq_t *birq, lub_list_t *irqs, lub_list_t *balance_irqs,
+	birq_external_e policy, unsigned int timeout, time_t now)
+{
+	lub_list_node_t *iter;
+
+	for (iter = lub_list_iterator_init(irqs); iter;
+		iter = lub_list_iterator_next(iter)) {
+		irq_t *irq = (irq_t *)lub_list_node__get_data(iter);
+		lub_list_node_t *node;
+
+		if (irq->blacklisted)
+			continue;
+
+		if (!cpus_empty(irq->written) &&
+			!cpus_equal(irq->written, irq->affinity)) {
+			char buf[NR_CPUS + 1];
+
+			cpumask_scnprintf(buf, sizeof(buf), irq->affinity);
+			buf[sizeof(buf) - 1] = '\0';
+			birq_log(birq, LOG_INFO,
+				"IRQ %u affinity was changed externally to %s",
+				irq->irq, buf);
+			/* Adopt external mask. Only next birq write can
+			   be overridden again. */
+			cpus_clear(irq->written);
+			if (irq->external &&
+				((now - irq->external) <= EXTERNAL_FIGHT_WINDOW))
+				irq->fights++;
+			else
+				irq->fights = 1;
+			irq->external = now;
+			if (irq->fights == EXTERNAL_FIGHT_CHANGES)
+				birq_log(birq, LOG_WARNING, "Fight with external writer over IRQ %u affinity, %u changes",
+					irq->irq, irq->fights);
+			if (policy != BIRQ_EXTERNAL_ALERT)
+				irq->frozen = now;
+		}
+
+		if (!irq->frozen)
+			continue;
+		if ((policy == BIRQ_EXTERNAL_ALERT) ||
+			((policy == BIRQ_EXTERNAL_RECLAIM) &&
+			((now - irq->frozen) >= timeout))) {
+			birq_log(birq, LOG_INFO, "Reclaim IRQ %u", irq->irq);
+			irq->frozen = 0;
+			continue;
+		}
+		/* Don't move frozen IRQ */
+		irq->weight = 1;
+		if ((node = lub_list_search(balance_irqs, irq))) {
+			lub_list_del(balance_irqs, node);
+			lub_list_node_free(node);
+		}
+	}
+}
@@ -0,0 +1,16 @@
+#ifndef _external_h
+#define _external_h
+
+#include <time.h>
+#include "lub/list.h"
+#include "libbirq.h"
+
+/* The external changes within this period are the fight, sec */
+#define EXTERNAL_FIGHT_WINDOW 3600
+/* Number of external changes to consider them as a fight */
+#define EXTERNAL_FIGHT_CHANGES 3
+
+void external_detect(birq_t *birq, lub_list_t *irqs, lub_list_t *balance_irqs,
+	birq_external_e policy, unsigned int timeout, time_t now);
+
+#endif
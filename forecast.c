@@ -0,0 +1,157 @@
+/* forecast.c
+ * Predict IRQ rates using Holt-Winters seasonal smoothing.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "lub/list.h"
+#include "cpu.h"
+#include "irq.h"
+#include "forecast.h"
+
+void forecast_init(forecast_t *fc)
+{
+	if (!fc)
+		return;
+	memset(fc, 0, sizeof(*fc));
+}
+
+/* Seasonal slot for specified time */
+static unsigned int forecast_slot(time_t t, unsigned int season)
+{
+	return (unsigned long long)(t % season) * FORECAST_SLOTS / season;
+}
+
+/* Absolute number of slot for specified time */
+static unsigned long long forecast_abs_slot(time_t t, unsigned int season)
+{
+	return (unsigned long long)t * FORECAST_SLOTS / season;
+}
+
+/* Update Holt-Winters model by the average rate of finished slot. The
+   "steps" is number of slots since the previous update. The skipped
+   slots (daemon was stopped) are bridged by the trend. */
+static void forecast_slot_update(forecast_t *fc, time_t now,
+	unsigned int season, unsigned long long steps)
+{
+	unsigned int slot = fc->slot % FORECAST_SLOTS;
+	float rate = fc->slot_intr / fc->slot_time;
+	float level;
+	float s;
+
+	if (!fc->start) {
+		/* First finished slot */
+		fc->start = now;
+		fc->level = rate;
+		fc->trend = 0;
+		return;
+	}
+
+	s = fc->season[slot];
+	level = FORECAST_ALPHA * (rate - s) +
+		(1 - FORECAST_ALPHA) * (fc->level + fc->trend * steps);
+	fc->trend = FORECAST_BETA * (level - fc->level) / steps +
+		(1 - FORECAST_BETA) * fc->trend;
+	fc->level = level;
+	fc->season[slot] = FORECAST_GAMMA * (rate - level) +
+		(1 - FORECAST_GAMMA) * s;
+
+	/* Seasonal components are not trusted until the whole season
+	   was seen. */
+	if ((now - fc->start) >= (time_t)season)
+		fc->valid = 1;
+}
+
+/* Feed new sample (interrupts for dt seconds) to IRQ's forecast state
+   and calculate prediction for "horizon" seconds ahead. The samples
+   are accumulated within slot. The model is updated once the slot is
+   finished. So the trend is per slot and doesn't depend on the
+   iteration interval. */
+static void forecast_sample(forecast_t *fc, unsigned long long intr,
+	float dt, time_t now, unsigned int season, unsigned int horizon)
+{
+	unsigned long long slot = forecast_abs_slot(now, season);
+
+	if (dt <= 0)
+		return;
+	fc->rate = intr / dt;
+	fc->last = now;
+	if ((fc->slot_time > 0) && (slot != fc->slot)) {
+		forecast_slot_update(fc, now, season,
+			(slot > fc->slot) ? (slot - fc->slot) : 1);
+		fc->slot_intr = 0;
+		fc->slot_time = 0;
+	}
+	fc->slot = slot;
+	fc->slot_intr += intr;
+	fc->slot_time += dt;
+
+	if (!fc->start) {
+		fc->predicted = fc->rate;
+		return;
+	}
+	fc->predicted = fc->level +
+		fc->trend * horizon * FORECAST_SLOTS / season +
+		fc->season[forecast_slot(now + horizon, season)];
+	if (fc->predicted < 0)
+		fc->predicted = 0;
+}
+
+/* Update IRQ forecasts and calculate predicted CPU load. The CPU load
+   is scaled by ratio of predicted and current rates of its IRQs. The
+   season=0 disables forecasting so predicted load is current load. */
+void forecast_update(lub_list_t *cpus, lub_list_t *irqs, time_t now,
+	unsigned int season, unsigned int horizon)
+{
+	lub_list_node_t *iter;
+
+	for (iter = lub_list_iterator_init(cpus); iter;
+		iter = lub_list_iterator_next(iter)) {
+		cpu_t *cpu = (cpu_t *)lub_list_node__get_data(iter);
+		cpu->predicted_load = cpu->load;
+	}
+	if (!season)
+		return;
+
+	for (iter = lub_list_iterator_init(irqs); iter;
+		iter = lub_list_iterator_next(iter)) {
+		irq_t *irq = (irq_t *)lub_list_node__get_data(iter);
+		float dt;
+
+		if (irq->blacklisted)
+			continue;
+		/* The first iteration has no interrupt delta. Remember
+		   the time only. */
+		if (!irq->forecast.last) {
+			irq->forecast.last = now;
+			continue;
+		}
+		dt = (float)(now - irq->forecast.last);
+		if (dt <= 0)
+			continue;
+		forecast_sample(&irq->forecast, irq->intr, dt,
+			now, season, horizon);
+	}
+
+	for (iter = lub_list_iterator_init(cpus); iter;
+		iter = lub_list_iterator_next(iter)) {
+		cpu_t *cpu = (cpu_t *)lub_list_node__get_data(iter);
+		lub_list_node_t *irq_iter;
+		float rate = 0;
+		float predicted = 0;
+
+		for (irq_iter = lub_list_iterator_init(cpu->irqs); irq_iter;
+			irq_iter = lub_list_iterator_next(irq_iter)) {
+			irq_t *irq = (irq_t *)lub_list_node__get_data(irq_iter);
+			if (!irq->forecast.valid)
+				continue;
+			rate += irq->forecast.rate;
+			predicted += irq->forecast.predicted;
+		}
+		if (rate > 0)
+			cpu->predicted_load = cpu->load * predicted / rate;
+	}
+}
@@ -0,0 +1,39 @@
+#ifndef _forecast_h
+#define _forecast_h
+
+#include <time.h>
+#include "lub/list.h"
+
+/* Number of seasonal slots. The season length is configurable but
+   the state size is fixed. So one slot covers season/FORECAST_SLOTS
+   seconds. The day season gives one hour slots. */
+#define FORECAST_SLOTS 24
+
+/* Holt-Winters smoothing factors (level, trend, season) */
+#define FORECAST_ALPHA 0.3
+#define FORECAST_BETA 0.05
+#define FORECAST_GAMMA 0.2
+
+/* Holt-Winters (additive) state for IRQ rate. The samples are
+   accumulated within slot. The model is updated once per slot by the
+   average rate of slot. */
+struct forecast_s {
+	time_t start; /* Time of the first model update. 0 if not started */
+	time_t last; /* Time of the last sample */
+	float rate; /* Last observed rate, interrupts per second */
+	unsigned long long slot; /* Absolute number of accumulated slot */
+	float slot_intr; /* Interrupts accumulated within slot */
+	float slot_time; /* Seconds accumulated within slot */
+	float level; /* Smoothed level of rate */
+	float trend; /* Smoothed trend of rate, per slot */
+	float season[FORECAST_SLOTS]; /* Seasonal components */
+	float predicted; /* Predicted rate at horizon */
+	int valid; /* Prediction is valid. The whole season was seen */
+};
+typedef struct forecast_s forecast_t;
+
+void forecast_init(forecast_t *fc);
+void forecast_update(lub_list_t *cpus, lub_list_t *irqs, time_t now,
+	unsigned int season, unsigned int horizon);
+
+#endif
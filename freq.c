@@ -0,0 +1,182 @@
+/* freq.c
+ * Keep frequency floor on CPUs with heavy IRQs.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <limits.h>
+#include <ctype.h>
+
+#include "lub/list.h"
+#include "cpu.h"
+#include "irq.h"
+#include "freq.h"
+#include "source.h"
+
+/* Write string to CPU's sysfs file */
+static int cpu_write_str(birq_t *birq, unsigned int id, const char *name,
+	const char *str)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/cpu%u/%s", SYSFS_CPU_PATH, id, name);
+	path[sizeof(path) - 1] = '\0';
+	if (sink_write(birq, path, str))
+		return -1;
+
+	return 0;
+}
+
+/* Read first word from CPU's sysfs file. The result must be freed. */
+static char *cpu_read_str(birq_t *birq, unsigned int id, const char *name)
+{
+	char path[PATH_MAX];
+	FILE *fd;
+	char *str = NULL;
+	size_t sz;
+	char *end;
+
+	snprintf(path, sizeof(path), "%s/cpu%u/%s", SYSFS_CPU_PATH, id, name);
+	path[sizeof(path) - 1] = '\0';
+	if (!(fd = source_open(birq, path)))
+		return NULL;
+	if (getline(&str, &sz, fd) < 0) {
+		free(str);
+		fclose(fd);
+		return NULL;
+	}
+	fclose(fd);
+	for (end = str; *end && !isspace(*end); end++);
+	*end = '\0';
+
+	return str;
+}
+
+/* Raise min frequency (and set energy performance preference) of CPU.
+   The floor not above current min frequency is a no-op. It's
+   remembered so the sysfs is not read on each iteration while the CPU
+   has heavy IRQs. */
+static void freq_floor_raise(birq_t *birq, cpu_t *cpu, unsigned long floor,
+	const char *epp)
+{
+	unsigned long min_freq;
+	char buf[32];
+
+	if (!floor)
+		floor = cpu->max_freq;
+	if (!floor || (floor == cpu->noop_floor))
+		return;
+	if (cpu_read_ulong(birq, cpu->id, "cpufreq/scaling_min_freq", &min_freq))
+		return;
+	if (floor <= min_freq) {
+		cpu->noop_floor = floor;
+		return;
+	}
+	cpu->noop_floor = 0;
+	snprintf(buf, sizeof(buf), "%lu", floor);
+	buf[sizeof(buf) - 1] = '\0';
+	if (cpu_write_str(birq, cpu->id, "cpufreq/scaling_min_freq", buf)) {
+		birq_log(birq, LOG_WARNING,
+			"Warning: Can't set min frequency for CPU%u", cpu->id);
+		return;
+	}
+	cpu->saved_min_freq = min_freq;
+	birq_log(birq, LOG_INFO,
+		"Raise CPU%u min frequency from %lu MHz to %lu MHz",
+		cpu->id, min_freq / 1000, floor / 1000);
+
+	if (!epp)
+		return;
+	cpu->saved_epp = cpu_read_str(birq, cpu->id,
+		"cpufreq/energy_performance_preference");
+	if (!cpu->saved_epp)
+		return;
+	if (cpu_write_str(birq, cpu->id, "cpufreq/energy_performance_preference",
+		epp)) {
+		free(cpu->saved_epp);
+		cpu->saved_epp = NULL;
+	}
+}
+
+/* Restore original min frequency and energy performance preference */
+static void freq_floor_drop(birq_t *birq, cpu_t *cpu)
+{
+	char buf[32];
+
+	if (!cpu->saved_min_freq)
+		return;
+	snprintf(buf, sizeof(buf), "%lu", cpu->saved_min_freq);
+	buf[sizeof(buf) - 1] = '\0';
+	if (cpu_write_str(birq, cpu->id, "cpufreq/scaling_min_freq", buf))
+		birq_log(birq, LOG_WARNING,
+			"Warning: Can't restore min frequency for CPU%u",
+			cpu->id);
+	else
+		birq_log(birq, LOG_INFO, "Restore CPU%u min frequency %lu MHz",
+			cpu->id, cpu->saved_min_freq / 1000);
+	cpu->saved_min_freq = 0;
+
+	if (!cpu->saved_epp)
+		return;
+	cpu_write_str(birq, cpu->id, "cpufreq/energy_performance_preference",
+		cpu->saved_epp);
+	free(cpu->saved_epp);
+	cpu->saved_epp = NULL;
+}
+
+/* Don't allow governor to clock down the CPUs with IRQs which cost
+   is greater than specified value. The floor=0 means max frequency.
+   Restore original settings when IRQs leave CPU. The raised CPU keeps
+   the floor while its IRQs cost more than half of specified value to
+   don't flap. The IRQ cost must surely reach the value within its
+   measurement error to raise the floor and must surely fall below the
+   half to drop it. The cost=0 disables the feature. */
+void freq_floor_apply(birq_t *birq, lub_list_t *cpus, float cost,
+	unsigned long floor, const char *epp)
+{
+	lub_list_node_t *iter;
+
+	for (iter = lub_list_iterator_init(cpus); iter;
+		iter = lub_list_iterator_next(iter)) {
+		cpu_t *cpu = (cpu_t *)lub_list_node__get_data(iter);
+		lub_list_node_t *irq_iter;
+		float limit = cpu->saved_min_freq ? cost / 2 : cost;
+		int heavy = 0;
+
+		if (cost > 0) {
+			for (irq_iter = lub_list_iterator_init(cpu->irqs);
+				irq_iter; irq_iter = lub_list_iterator_next(irq_iter)) {
+				irq_t *irq = (irq_t *)lub_list_node__get_data(irq_iter);
+				float load = cpu->saved_min_freq ?
+					(irq->load + irq->load_error) :
+					(irq->load - irq->load_error);
+				if (load >= limit) {
+					heavy = 1;
+					break;
+				}
+			}
+		}
+		if (heavy && !cpu->saved_min_freq)
+			freq_floor_raise(birq, cpu, floor, epp);
+		else if (!heavy && cpu->saved_min_freq)
+			freq_floor_drop(birq, cpu);
+		/* The min frequency can be changed while CPU has no heavy
+		   IRQs. Check it again next time. */
+		if (!heavy)
+			cpu->noop_floor = 0;
+	}
+}
+
+/* Restore original frequency settings for all CPUs */
+void freq_floor_restore(birq_t *birq, lub_list_t *cpus)
+{
+	lub_list_node_t *iter;
+
+	for (iter = lub_list_iterator_init(cpus); iter;
+		iter = lub_list_iterator_next(iter)) {
+		cpu_t *cpu = (cpu_t *)lub_list_node__get_data(iter);
+		freq_floor_drop(birq, cpu);
+	}
+}
@@ -0,0 +1,11 @@
+#ifndef _freq_h
+#define _freq_h
+
+#include "lub/list.h"
+#include "libbirq.h"
+
+void freq_floor_apply(birq_t *birq, lub_list_t *cpus, float cost,
+	unsigned long floor, const char *epp);
+void freq_floor_restore(birq_t *birq, lub_list_t *cpus);
+
+#endif
@@ -13,6 +13,8 @@
 #include "lub/list.h"
 #include "irq.h"
 #include "pxm.h"
+#include "engine.h"
+#include "source.h"
 
 #define STR(str) ( str ? str : "" )
 
@@ -27,7 +29,7 @@ static irq_t * irq_new(int num)
 {
 	irq_t *new;
 
-	if (!(new = malloc(sizeof(*new))))
+	if (posix_memalign((void **)&new, CACHE_LINE_SIZE, sizeof(*new)))
 		return NULL;
 	new->irq = num;
 	new->type = NULL;
@@ -35,6 +37,7 @@ static irq_t * irq_new(int num)
 	new->refresh = 1;
 	new->old_intr = 0;
 	new->intr = 0;
+	new->load = 0;
 	new->cpu = NULL;
 	new->weight = 0;
 	cpus_init(new->local_cpus);
@@ -42,6 +45,37 @@ static irq_t * irq_new(int num)
 	cpus_setall(new->local_cpus);
 	cpus_clear(new->affinity);
 	new->blacklisted = 0;
+	forecast_init(&new->forecast);
+	new->load_error = 0;
+	new->latency = 0;
+	new->predictive = 0;
+	cpus_init(new->consumer_cpus);
+	cpus_clear(new->consumer_cpus);
+	cpus_init(new->vcpu_cpus);
+	cpus_clear(new->vcpu_cpus);
+	new->usual_rate = 0;
+	new->storm_samples = 0;
+	new->old_unhandled = 0;
+	new->storm = 0;
+	new->retry = 0;
+	new->fails = 0;
+	new->rollbacks = 0;
+	new->pending = 0;
+	new->pending_intr = 0;
+	new->pending_total = 0;
+	new->pending_ticks = 0;
+	cpus_init(new->rollback);
+	cpus_clear(new->rollback);
+	new->pending_stamp = 0;
+	new->effect_time = -1;
+	cpus_init(new->written);
+	cpus_clear(new->written);
+	new->external = 0;
+	new->fights = 0;
+	new->frozen = 0;
+	new->granularity = IRQ_GRAN_CPU;
+	cpus_init(new->group);
+	cpus_clear(new->group);
 
 	return new;
 }
@@ -52,14 +86,81 @@ static void irq_free(irq_t *irq)
 	free(irq->desc);
 	cpus_free(irq->local_cpus);
 	cpus_free(irq->affinity);
+	cpus_free(irq->consumer_cpus);
+	cpus_free(irq->vcpu_cpus);
+	cpus_free(irq->written);
+	cpus_free(irq->rollback);
+	cpus_free(irq->group);
 	free(irq);
 }
 
-irq_t * irq_list_search(lub_list_t *irqs, unsigned int num)
+/* Make virtual copy of IRQ for planning without side effects. The
+   copy has no CPU and no descriptions. Free it by irq_list_free()
+   of the list it's added to. */
+irq_t *irq_clone(const irq_t *irq)
+{
+	irq_t *new;
+
+	if (!(new = malloc(sizeof(*new))))
+		return NULL;
+	*new = *irq;
+	new->type = NULL;
+	new->desc = NULL;
+	new->cpu = NULL;
+	cpus_init(new->local_cpus);
+	cpus_copy(new->local_cpus, irq->local_cpus);
+	cpus_init(new->affinity);
+	cpus_copy(new->affinity, irq->affinity);
+	cpus_init(new->consumer_cpus);
+	cpus_copy(new->consumer_cpus, irq->consumer_cpus);
+	cpus_init(new->vcpu_cpus);
+	cpus_copy(new->vcpu_cpus, irq->vcpu_cpus);
+	cpus_init(new->written);
+	cpus_copy(new->written, irq->written);
+	cpus_init(new->rollback);
+	cpus_copy(new->rollback, irq->rollback);
+	cpus_init(new->group);
+	cpus_copy(new->group, irq->group);
+
+	return new;
+}
+
+/* Build dense table of IRQs indexed by IRQ number. The search within
+   the list is linear so it's too expensive for per-iteration scans of
+   all IRQs. The table is kept across iterations. The scan_irqs()
+   rebuilds it only when IRQs appear or disappear. */
+static void irq_list_reindex(birq_t *birq)
+{
+	lub_list_node_t *iter;
+
+	free(birq->irq_index);
+	birq->irq_index = NULL;
+	birq->irq_index_num = 0;
+	/* The list is sorted so the tail has the greatest number */
+	if (!(iter = lub_list__get_tail(birq->irqs)))
+		return;
+	birq->irq_index_num = ((irq_t *)lub_list_node__get_data(iter))->irq + 1;
+	if (!(birq->irq_index = calloc(birq->irq_index_num,
+		sizeof(*birq->irq_index)))) {
+		birq->irq_index_num = 0;
+		return;
+	}
+	for (iter = lub_list_iterator_init(birq->irqs); iter;
+		iter = lub_list_iterator_next(iter)) {
+		irq_t *irq = (irq_t *)lub_list_node__get_data(iter);
+		birq->irq_index[irq->irq] = irq;
+	}
+}
+
+/* The search within the engine's IRQ list uses the table. The search
+   within other lists is linear. */
+irq_t * irq_list_search(birq_t *birq, lub_list_t *irqs, unsigned int num)
 {
 	lub_list_node_t *node;
 	irq_t search;
 
+	if ((irqs == birq->irqs) && birq->irq_index)
+		return (num < birq->irq_index_num) ? birq->irq_index[num] : NULL;
 	search.irq = num;
 	node = lub_list_search(irqs, &search);
 	if (!node)
@@ -99,7 +200,7 @@ int irq_list_free(lub_list_t *irqs)
 }
 
 /* Show IRQ information */
-static void irq_show(irq_t *irq)
+static void irq_show(birq_t *birq, irq_t *irq)
 {
 	char buf[NR_CPUS + 1];
 	char buf2[NR_CPUS + 1];
@@ -111,23 +212,25 @@ static void irq_show(irq_t *irq)
 	buf[sizeof(buf) - 1] = '\0';
 	cpumask_scnprintf(buf2, sizeof(buf2), irq->affinity);
 	buf2[sizeof(buf2) - 1] = '\0';
-	printf("IRQ %3d [%s] [%s] [%s] %s %llu %llu\n", irq->irq, buf, buf2, STR(irq->type), STR(irq->desc), irq->old_intr, irq->intr);
+	birq_log(birq, LOG_INFO, "IRQ %3d [%s] [%s] [%s] %s %llu %llu",
+		irq->irq, buf, buf2, STR(irq->type), STR(irq->desc),
+		irq->old_intr, irq->intr);
 }
 
 /* Show IRQ list */
-int irq_list_show(lub_list_t *irqs)
+int irq_list_show(birq_t *birq, lub_list_t *irqs)
 {
 	lub_list_node_t *iter;
 	for (iter = lub_list_iterator_init(irqs); iter;
 		iter = lub_list_iterator_next(iter)) {
 		irq_t *irq;
 		irq = (irq_t *)lub_list_node__get_data(iter);
-		irq_show(irq);
+		irq_show(birq, irq);
 	}
 	return 0;
 }
 
-static int parse_local_cpus(lub_list_t *irqs, const char *sysfs_path,
+static int parse_local_cpus(birq_t *birq, lub_list_t *irqs, const char *sysfs_path,
 	unsigned int num, lub_list_t *pxms)
 {
 	char path[PATH_MAX];
@@ -139,7 +242,7 @@ static int parse_local_cpus(lub_list_t *irqs, const char *sysfs_path,
 	cpumask_t cpumask;
 	int ret = -1;
 
-	irq = irq_list_search(irqs, num);
+	irq = irq_list_search(birq, irqs, num);
 	if (!irq)
 		return ret;
 
@@ -156,7 +259,7 @@ static int parse_local_cpus(lub_list_t *irqs, const char *sysfs_path,
 	snprintf(path, sizeof(path),
 		"%s/%s/local_cpus", SYSFS_PCI_PATH, sysfs_path);
 	path[sizeof(path) - 1] = '\0';
-	if (!(fd = fopen(path, "r")))
+	if (!(fd = source_open(birq, path)))
 		goto error;
 	if (getline(&str, &sz, fd) < 0)
 		goto error;
@@ -175,7 +278,7 @@ error:
 	return ret;
 }
 
-static int parse_sysfs(lub_list_t *irqs, lub_list_t *pxms)
+static int parse_sysfs(birq_t *birq, lub_list_t *irqs, lub_list_t *pxms)
 {
 	DIR *dir;
 	DIR *msi;
@@ -187,7 +290,7 @@ static int parse_sysfs(lub_list_t *irqs, lub_list_t *pxms)
 
 	/* Now we can parse PCI devices only */
 	/* Get info from /sys/bus/pci/devices */
-	dir = opendir(SYSFS_PCI_PATH);
+	dir = source_opendir(birq, SYSFS_PCI_PATH);
 	if (!dir)
 		return -1;
 	while((dent = readdir(dir))) {
@@ -199,7 +302,7 @@ static int parse_sysfs(lub_list_t *irqs, lub_list_t *pxms)
 		snprintf(path, sizeof(path),
 			"%s/%s/msi_irqs", SYSFS_PCI_PATH, dent->d_name);
 		path[sizeof(path) - 1] = '\0';
-		if ((msi = opendir(path))) {
+		if ((msi = source_opendir(birq, path))) {
 			while((ment = readdir(msi))) {
 				if (!strcmp(ment->d_name, ".") ||
 					!strcmp(ment->d_name, ".."))
@@ -207,7 +310,7 @@ static int parse_sysfs(lub_list_t *irqs, lub_list_t *pxms)
 				num = strtol(ment->d_name, NULL, 10);
 				if (!num)
 					continue;
-				parse_local_cpus(irqs, dent->d_name, num, pxms);
+				parse_local_cpus(birq, irqs, dent->d_name, num, pxms);
 			}
 			closedir(msi);
 			continue;
@@ -217,7 +320,7 @@ static int parse_sysfs(lub_list_t *irqs, lub_list_t *pxms)
 		snprintf(path, sizeof(path),
 			"%s/%s/irq", SYSFS_PCI_PATH, dent->d_name);
 		path[sizeof(path) - 1] = '\0';
-		if (!(fd = fopen(path, "r")))
+		if (!(fd = source_open(birq, path)))
 			continue;
 		if (fscanf(fd, "%d", &num) < 0) {
 			fclose(fd);
@@ -227,14 +330,14 @@ static int parse_sysfs(lub_list_t *irqs, lub_list_t *pxms)
 		if (!num)
 			continue;
 
-		parse_local_cpus(irqs, dent->d_name, num, pxms);
+		parse_local_cpus(birq, irqs, dent->d_name, num, pxms);
 	}
 	closedir(dir);
 
 	return 0;
 }
 
-int irq_get_affinity(irq_t *irq)
+int irq_get_affinity(birq_t *birq, irq_t *irq)
 {
 	char path[PATH_MAX];
 	FILE *fd;
@@ -247,7 +350,7 @@ int irq_get_affinity(irq_t *irq)
 	snprintf(path, sizeof(path),
 		"%s/%u/smp_affinity", PROC_IRQ, irq->irq);
 	path[sizeof(path) - 1] = '\0';
-	if (!(fd = fopen(path, "r")))
+	if (!(fd = source_open(birq, path)))
 		return -1;
 	if (getline(&str, &sz, fd) < 0) {
 		fclose(fd);
@@ -261,8 +364,10 @@ int irq_get_affinity(irq_t *irq)
 }
 
 /* Parse /proc/interrupts to get actual IRQ list */
-int scan_irqs(lub_list_t *irqs, lub_list_t *balance_irqs, lub_list_t *pxms)
+int scan_irqs(birq_t *birq)
 {
+	lub_list_t *irqs = birq->irqs;
+	lub_list_t *balance_irqs = birq->balance_irqs;
 	FILE *fd;
 	unsigned int num;
 	char *str = NULL;
@@ -270,8 +375,9 @@ int scan_irqs(lub_list_t *irqs, lub_list_t *balance_irqs, lub_list_t *pxms)
 	irq_t *irq;
 	lub_list_node_t *iter;
 	int new_irq_num = 0;
+	int removed_irq_num = 0;
 
-	if (!(fd = fopen(PROC_INTERRUPTS, "r")))
+	if (!(fd = source_open(birq, PROC_INTERRUPTS)))
 		return -1;
 	while(getline(&str, &sz, fd) >= 0) {
 		char *endptr, *tok;
@@ -281,7 +387,7 @@ int scan_irqs(lub_list_t *irqs, lub_list_t *balance_irqs, lub_list_t *pxms)
 			continue;
 
 		/* Search for IRQ within list of known IRQs */
-		if (!(irq = irq_list_search(irqs, num))) {
+		if (!(irq = irq_list_search(birq, irqs, num))) {
 			new = 1;
 			new_irq_num++;
 			irq = irq_list_add(irqs, num);
@@ -322,11 +428,12 @@ int scan_irqs(lub_list_t *irqs, lub_list_t *balance_irqs, lub_list_t *pxms)
 		 * problems with arch/driver. The affinity can be old (didn't
 		 * switched to new state).
 		 */
-		irq_get_affinity(irq);
+		irq_get_affinity(birq, irq);
 
 		/* Print info about new IRQ. */
 		if (new)
-			printf("Add IRQ %3d %s\n", irq->irq, STR(irq->desc));
+			birq_log(birq, LOG_INFO, "Add IRQ %3d %s",
+				irq->irq, STR(irq->desc));
 
 		/* If affinity uses more than one CPU then consider IRQ as new one.
 		 * It's not normal state for really non-new IRQs.
@@ -334,6 +441,14 @@ int scan_irqs(lub_list_t *irqs, lub_list_t *balance_irqs, lub_list_t *pxms)
 		if (cpus_weight(irq->affinity) <= 1)
 			continue;
 
+		/* The small group mask written by birq is intended */
+		if (irq_intended(irq))
+			continue;
+
+		/* Wait for affinity write retry */
+		if (irq->retry)
+			continue;
+
 		/* Don't balance IRQs with 0 number of interrupts */
 		if (irq->intr == 0)
 			continue;
@@ -354,20 +469,203 @@ int scan_irqs(lub_list_t *irqs, lub_list_t *balance_irqs, lub_list_t *pxms)
 		iter = lub_list_iterator_next(iter);
 		if (!irq->refresh) {
 			lub_list_del(irqs, old_iter);
-			printf("Remove IRQ %3d %s\n", irq->irq, STR(irq->desc));
+			birq_log(birq, LOG_INFO, "Remove IRQ %3d %s",
+				irq->irq, STR(irq->desc));
 			irq_free(irq);
+			removed_irq_num++;
 		} else {
 			/* Drop refresh flag for next iteration */
 			irq->refresh = 0;
 		}
 	}
 
+	/* The IRQ table is rebuilt only when IRQ list is changed */
+	if (new_irq_num || removed_irq_num || !birq->irq_index)
+		irq_list_reindex(birq);
+
 	/* No new IRQs were found. It doesn't need to scan sysfs. */
 	if (new_irq_num == 0)
 		return 0;
 	/* Add IRQ info from sysfs */
-	printf("New IRQs: %d. Scanning sysfs...\n", new_irq_num);
-	parse_sysfs(irqs, pxms);
+	birq_log(birq, LOG_INFO, "New IRQs: %d. Scanning sysfs...",
+		new_irq_num);
+	parse_sysfs(birq, irqs, birq->pxms);
+
+	return 0;
+}
+
+/* Check if IRQ description contains one of comma separated patterns */
+int irq_match(const irq_t *irq, const char *patterns)
+{
+	const char *pattern;
+
+	if (!irq || !irq->desc || !patterns)
+		return 0;
+
+	for (pattern = patterns; *pattern; ) {
+		size_t len = strcspn(pattern, ",");
+		char *str;
+		int found;
+
+		if (len) {
+			str = strndup(pattern, len);
+			found = (strstr(irq->desc, str) != NULL);
+			free(str);
+			if (found)
+				return 1;
+		}
+		pattern += len;
+		if (*pattern == ',')
+			pattern++;
+	}
+
+	return 0;
+}
+
+/* Mark latency-sensitive IRQs. The IRQ is latency-sensitive if its
+ * description matches one of patterns.
+ */
+void irq_list_mark_latency(lub_list_t *irqs, const char *patterns)
+{
+	lub_list_node_t *iter;
+
+	for (iter = lub_list_iterator_init(irqs); iter;
+		iter = lub_list_iterator_next(iter)) {
+		irq_t *irq = (irq_t *)lub_list_node__get_data(iter);
+		irq->latency = irq_match(irq, patterns);
+	}
+}
 
+/* Parse placement unit name */
+static int irq_gran_parse(const char *str, irq_gran_e *gran)
+{
+	if (!strcmp(str, "cpu"))
+		*gran = IRQ_GRAN_CPU;
+	else if (!strcmp(str, "core"))
+		*gran = IRQ_GRAN_CORE;
+	else if (!strcmp(str, "llc"))
+		*gran = IRQ_GRAN_LLC;
+	else
+		return -1;
 	return 0;
 }
+
+/* Parse placement unit rules. The rules are comma separated list of
+ * "<pattern>:<cpu/core/llc>". The rule without pattern is default one.
+ * Returns the list of rules in original order or NULL if some unit
+ * is unknown. Free it by irq_gran_rules_free().
+ */
+lub_list_t *irq_gran_rules_parse(birq_t *birq, const char *rules)
+{
+	lub_list_t *list;
+	const char *rule;
+
+	list = lub_list_new(NULL);
+	for (rule = rules; rule && *rule; ) {
+		size_t len = strcspn(rule, ",");
+		char *str;
+		char *gran_str;
+		irq_gran_rule_t *new;
+		irq_gran_e gran;
+
+		/* Skip empty rule */
+		if (!len) {
+			rule++;
+			continue;
+		}
+		str = strndup(rule, len);
+		gran_str = strrchr(str, ':');
+		if (gran_str)
+			*gran_str++ = '\0';
+		else
+			gran_str = str;
+		if (irq_gran_parse(gran_str, &gran)) {
+			birq_log(birq, LOG_ERR,
+				"Error: Unknown placement unit \"%s\".", gran_str);
+			free(str);
+			irq_gran_rules_free(list);
+			return NULL;
+		}
+		if (!(new = malloc(sizeof(*new)))) {
+			free(str);
+			break;
+		}
+		new->pattern = NULL;
+		if ((gran_str != str) && *str)
+			new->pattern = strdup(str);
+		new->granularity = gran;
+		lub_list_add(list, new);
+		free(str);
+		rule += len;
+		if (*rule == ',')
+			rule++;
+	}
+
+	return list;
+}
+
+void irq_gran_rules_free(lub_list_t *rules)
+{
+	lub_list_node_t *node;
+
+	if (!rules)
+		return;
+	while ((node = lub_list__get_head(rules))) {
+		irq_gran_rule_t *rule;
+		rule = (irq_gran_rule_t *)lub_list_node__get_data(node);
+		free(rule->pattern);
+		free(rule);
+		lub_list_del(rules, node);
+		lub_list_node_free(node);
+	}
+	lub_list_free(rules);
+}
+
+/* Set placement unit of IRQs due to parsed rules. The first matching
+ * rule is used. The last rule without pattern is default one.
+ */
+void irq_list_mark_granularity(lub_list_t *irqs, lub_list_t *rules)
+{
+	lub_list_node_t *iter;
+	irq_gran_e def = IRQ_GRAN_CPU;
+
+	for (iter = rules ? lub_list_iterator_init(rules) : NULL; iter;
+		iter = lub_list_iterator_next(iter)) {
+		irq_gran_rule_t *rule;
+		rule = (irq_gran_rule_t *)lub_list_node__get_data(iter);
+		if (!rule->pattern)
+			def = rule->granularity;
+	}
+
+	for (iter = lub_list_iterator_init(irqs); iter;
+		iter = lub_list_iterator_next(iter)) {
+		irq_t *irq = (irq_t *)lub_list_node__get_data(iter);
+		lub_list_node_t *iter2;
+
+		irq->granularity = def;
+		if (!rules || !irq->desc)
+			continue;
+		for (iter2 = lub_list_iterator_init(rules); iter2;
+			iter2 = lub_list_iterator_next(iter2)) {
+			irq_gran_rule_t *rule;
+			rule = (irq_gran_rule_t *)lub_list_node__get_data(iter2);
+			if (!rule->pattern || !strstr(irq->desc, rule->pattern))
+				continue;
+			irq->granularity = rule->granularity;
+			break;
+		}
+	}
+}
+
+/* Check if multi-CPU affinity of IRQ is the group mask written by
+ * birq. Such IRQ is not considered as new one.
+ */
+int irq_intended(const irq_t *irq)
+{
+	if (irq->granularity == IRQ_GRAN_CPU)
+		return 0;
+	if (cpus_weight(irq->affinity) <= 1)
+		return 0;
+
+	return cpus_equal(irq->affinity, irq->written);
+}
@@ -1,21 +1,70 @@
 #ifndef _irq_h
 #define _irq_h
 
+#include <time.h>
 #include "cpumask.h"
 #include "cpu.h"
+#include "forecast.h"
+
+/* Placement unit of IRQ */
+typedef enum {
+	IRQ_GRAN_CPU, /* Single CPU */
+	IRQ_GRAN_CORE, /* SMT siblings of CPU */
+	IRQ_GRAN_LLC /* CPUs sharing the last level cache */
+} irq_gran_e;
+
+/* Placement unit rule. The pattern is NULL for default rule */
+struct irq_gran_rule_s {
+	char *pattern; /* Substring of IRQ description */
+	irq_gran_e granularity;
+};
+typedef struct irq_gran_rule_s irq_gran_rule_t;
 
 struct irq_s {
-	unsigned int irq; /* IRQ's ID */
-	char *type; /* IRQ type from /proc/interrupts like PCI-MSI-edge */
-	char *desc; /* IRQ text description - device list */
-	int refresh; /* Refresh flag. It !=0 if irq was found while populate */
-	cpumask_t local_cpus; /* Local CPUs for this IRQs */
-	cpumask_t affinity; /* Real current affinity form /proc/irq/.../smp_affinity */
+	/* Hot fields. They are touched by the scans and by the choice
+	   of IRQs to move on each iteration. The block is 64 bytes on
+	   LP64 (60 bytes and padding) and the irq_new() aligns the
+	   structure to CACHE_LINE_SIZE so the block is one cache line.
+	   Check the size when a field is added here. */
 	unsigned long long intr; /* Current number of interrupts */
 	unsigned long long old_intr; /* Previous total number of interrupts. */
 	cpu_t *cpu; /* Current IRQ affinity. Reference to correspondent CPU */
+	unsigned int irq; /* IRQ's ID */
+	float load; /* Estimated part of CPU load, in percents */
 	int weight; /* Flag to don't move current IRQ anyway */
 	int blacklisted; /* IRQ can be blacklisted when can't change affinity */
+	time_t frozen; /* IRQ is frozen due to external change since. 0 - not */
+	int refresh; /* Refresh flag. It !=0 if irq was found while populate */
+	unsigned int storm; /* Iterations to hold IRQ in quarantine. 0 - no storm */
+	int pending; /* New affinity is written but not verified yet */
+	/* Cold fields */
+	char *type; /* IRQ type from /proc/interrupts like PCI-MSI-edge */
+	char *desc; /* IRQ text description - device list */
+	cpumask_t local_cpus; /* Local CPUs for this IRQs */
+	cpumask_t affinity; /* Real current affinity form /proc/irq/.../smp_affinity */
+	forecast_t forecast; /* Predicted rate of interrupts */
+	float load_error; /* Half-width of load confidence interval, percents */
+	int latency; /* Latency-sensitive IRQ. Prefer non-sleeping CPUs */
+	cpumask_t consumer_cpus; /* CPUs near the consumer threads. Prefer them */
+	cpumask_t vcpu_cpus; /* CPUs of guest vCPU threads for vfio IRQ */
+	float usual_rate; /* Usual rate of interrupts, intr/s */
+	unsigned int storm_samples; /* Number of samples within usual rate */
+	unsigned long long old_unhandled; /* Previous number of unhandled interrupts */
+	unsigned int retry; /* Iterations to wait before affinity write retry */
+	unsigned int fails; /* Number of successive affinity write failures */
+	unsigned int rollbacks; /* Number of successive rolled back moves */
+	unsigned long long pending_intr; /* Interrupts on target CPU before write */
+	unsigned long long pending_total; /* Total interrupts after write */
+	unsigned int pending_ticks; /* Iterations the move is pending for */
+	cpumask_t rollback; /* Previous affinity to restore if move fails */
+	unsigned long long pending_stamp; /* Time of affinity write, usec */
+	float effect_time; /* Time for last move to take effect, ms. -1 - unknown */
+	cpumask_t written; /* Mask birq wrote last time. Empty if none */
+	time_t external; /* Time of last external affinity change */
+	unsigned int fights; /* Number of recent external changes */
+	int predictive; /* Moved by forecast. Target uses predicted load */
+	irq_gran_e granularity; /* Placement unit */
+	cpumask_t group; /* Intended multi-CPU mask. Empty for single CPU */
 };
 typedef struct irq_s irq_t;
 
@@ -27,10 +76,17 @@ typedef struct irq_s irq_t;
 int irq_list_compare(const void *first, const void *second);
 
 /* IRQ list functions */
-int scan_irqs(lub_list_t *irqs, lub_list_t *balance_irqs, lub_list_t *pxms);
+int scan_irqs(birq_t *birq);
 int irq_list_free(lub_list_t *irqs);
-int irq_list_show(lub_list_t *irqs);
-irq_t * irq_list_search(lub_list_t *irqs, unsigned int num);
-int irq_get_affinity(irq_t *irq);
+int irq_list_show(birq_t *birq, lub_list_t *irqs);
+irq_t * irq_list_search(birq_t *birq, lub_list_t *irqs, unsigned int num);
+irq_t *irq_clone(const irq_t *irq);
+int irq_get_affinity(birq_t *birq, irq_t *irq);
+int irq_match(const irq_t *irq, const char *patterns);
+void irq_list_mark_latency(lub_list_t *irqs, const char *patterns);
+lub_list_t *irq_gran_rules_parse(birq_t *birq, const char *rules);
+void irq_gran_rules_free(lub_list_t *rules);
+void irq_list_mark_granularity(lub_list_t *irqs, lub_list_t *rules);
+int irq_intended(const irq_t *irq);
 
 #endif
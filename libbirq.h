@@ -0,0 +1,144 @@
+/* libbirq.h
+ * Public interface of the balancer engine. The application creates the
+ * engine, configures it and calls birq_tick() periodically. The engine
+ * has no global state so several engines can run within one process.
+ */
+
+#ifndef _libbirq_h
+#define _libbirq_h
+
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+#include <dirent.h>
+
+/* Threshold to consider CPU as overloaded.
+   In percents, float value. Can't be greater than 100.0 */
+#define BIRQ_DEFAULT_THRESHOLD 99.0
+
+/* Load limit. Don't move IRQs to CPUs loaded more than this limit. */
+#define BIRQ_DEFAULT_LOAD_LIMIT 95.0
+
+/* Number of random CPUs to compare for "p2c" CPU strategy. */
+#define BIRQ_DEFAULT_CPU_CHOICES 2
+
+/* How far to predict the IRQ rates, in seconds. */
+#define BIRQ_DEFAULT_FORECAST_HORIZON 300
+
+/* IRQs with estimated load greater than this value, in percents, are
+   heavy. The heavy IRQs prefer the most powerful CPUs. */
+#define BIRQ_DEFAULT_HEAVY_LOAD 20.0
+
+/* Interval between scans for real-time tasks, in seconds. */
+#define BIRQ_TASKS_INTERVAL 30
+
+/* Default time to respect external affinity change, seconds */
+#define BIRQ_DEFAULT_EXTERNAL_TIMEOUT 600
+
+/* Directory of loadable strategy modules */
+#define BIRQ_STRATEGY_DIR "/usr/lib/birq"
+
+/* Strategy to choose IRQ to move from overloaded CPU */
+typedef enum {
+	BIRQ_CHOOSE_MAX,
+	BIRQ_CHOOSE_MIN,
+	BIRQ_CHOOSE_RND,
+	BIRQ_CHOOSE_NONE /* Overloaded CPUs are handled by strategy module */
+} birq_choose_strategy_e;
+
+/* Strategy to choose target CPU for IRQ */
+typedef enum {
+	BIRQ_CPU_MIN, /* Full scan for the least loaded CPU */
+	BIRQ_CPU_P2C /* Least loaded of d random CPUs (power of d choices) */
+} birq_cpu_strategy_e;
+
+/* Policy for IRQs changed by external affinity writers */
+typedef enum {
+	BIRQ_EXTERNAL_RESPECT, /* Don't touch IRQ anymore */
+	BIRQ_EXTERNAL_RECLAIM, /* Don't touch IRQ for a timeout */
+	BIRQ_EXTERNAL_ALERT /* Report only, keep balancing */
+} birq_external_e;
+
+/* Environment of the engine. The engine reads procfs and sysfs files,
+   writes IRQ affinities and CPU settings, gets the time and logs the
+   messages through it only. The NULL callback means the real one.
+   The embedding application can feed its own data, for example the
+   fmemopen() streams with the content it already has. */
+struct birq_env_s {
+	FILE *(*open)(const char *path, void *udata); /* Open file to read */
+	DIR *(*opendir)(const char *path, void *udata); /* Open directory */
+	int (*exists)(const char *path, void *udata); /* 1 if path exists */
+	/* Read symbolic link like readlink(2). The buf is not terminated */
+	ssize_t (*readlink)(const char *path, char *buf, size_t size,
+		void *udata);
+	/* Write string to file. Returns 0 on success or errno */
+	int (*write)(const char *path, const char *buf, void *udata);
+	time_t (*time)(void *udata); /* Wall clock time, sec */
+	unsigned long long (*clock)(void *udata); /* Monotonic time, usec */
+	/* Log message. The priority is like syslog(3) one. The message
+	   has no trailing newline. The real log() prints warnings and
+	   errors to stderr and other messages to stdout. */
+	void (*log)(int priority, const char *msg, void *udata);
+	void *udata;
+};
+typedef struct birq_env_s birq_env_t;
+
+/* Engine configuration. The engine copies it so the strings belong to
+   the caller. The NULL string means the option is not set. The CPU
+   masks are hex masks like in /proc/irq/<IRQ>/smp_affinity. */
+struct birq_config_s {
+	float threshold;
+	float load_limit;
+	int verbose;
+	int non_local_cpus;
+	birq_choose_strategy_e strategy;
+	birq_cpu_strategy_e cpu_strategy;
+	unsigned int cpu_choices;
+	unsigned int forecast_season; /* Seconds. 0 - disabled */
+	unsigned int forecast_horizon; /* Seconds */
+	float pack_watermark; /* Pack IRQs while total load is lower */
+	char *latency_irqs; /* Patterns of latency-sensitive IRQs */
+	char *granularity; /* Placement unit rules "<pattern>:<unit>,..." */
+	char *awake_cpus; /* CPUs for latency-sensitive IRQs */
+	float heavy_load; /* Heavy IRQs prefer the most powerful CPUs */
+	int thermal; /* Avoid thermally throttled CPUs */
+	float freq_floor_load; /* Raise min frequency for IRQs heavier this */
+	unsigned long freq_floor; /* Min frequency, kHz. 0 - max frequency */
+	char *freq_floor_epp; /* Energy performance preference */
+	float steal_limit; /* Avoid virtual CPUs with greater steal time */
+	int rt_tasks; /* Avoid CPUs running real-time tasks */
+	char *rt_cgroups; /* Avoid CPUs running tasks from these cgroups */
+	unsigned int tasks_interval; /* Interval between task scans */
+	char *consumers; /* Draw IRQs to CPUs of consumer threads */
+	int vfio; /* Place vfio IRQs to CPUs of guest vCPU threads */
+	unsigned int storm_rate; /* Min rate of stormy IRQ. 0 - disabled */
+	int storm_cpu; /* Quarantine CPU for stormy IRQs. -1 - not set */
+	birq_external_e external; /* Policy for externally changed IRQs */
+	unsigned int external_timeout; /* Freeze time for "reclaim" policy */
+	char *shadow; /* Policies to evaluate in shadow "<strategy>:<threshold>,..." */
+	int shadow_promote; /* Promote the best shadow policy to live */
+	char *strategy_module; /* Loadable strategy module. NULL - built-in */
+	char *strategy_dir; /* Directory of modules. NULL - BIRQ_STRATEGY_DIR */
+	char *exclude_cpus; /* Don't move IRQs to these CPUs */
+	char *use_cpus; /* Move IRQs to these CPUs only. NULL - all CPUs */
+};
+typedef struct birq_config_s birq_config_t;
+
+/* Engine state. It's opaque for the application */
+typedef struct birq_s birq_t;
+
+/* The birq_config_init() sets defaults. The birq_configure() returns -1
+   and keeps previous configuration if the new one is illegal. The
+   birq_calibrate() takes a sample for one-shot placement by
+   birq_place(). Call it twice with a pause between. */
+
+void birq_config_init(birq_config_t *cfg);
+birq_t *birq_new(const birq_env_t *env, int ht, const char *pxm);
+void birq_free(birq_t *birq);
+int birq_configure(birq_t *birq, const birq_config_t *cfg);
+void birq_show(birq_t *birq);
+unsigned int birq_tick(birq_t *birq);
+void birq_calibrate(birq_t *birq);
+int birq_place(birq_t *birq, FILE *plan);
+
+#endif
@@ -0,0 +1,212 @@
+/* module.c
+ * Loadable strategy modules.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#ifdef HAVE_DLFCN_H
+#include <dlfcn.h>
+#endif
+
+#include "lub/list.h"
+#include "cpumask.h"
+#include "cpu.h"
+#include "irq.h"
+#include "balance.h"
+#include "strategy.h"
+#include "module.h"
+#include "probes.h"
+#include "source.h"
+
+/* Load strategy module <dir>/<name>.so */
+module_t *module_load(birq_t *birq, const char *dir, const char *name)
+{
+#ifdef HAVE_DLFCN_H
+	char path[PATH_MAX];
+	module_t *new;
+	void *handle;
+	const birq_strategy_t *strategy;
+
+	if (!dir || !name)
+		return NULL;
+	if (strchr(name, '/')) {
+		birq_log(birq, LOG_ERR, "Illegal strategy module name %s", name);
+		return NULL;
+	}
+	snprintf(path, sizeof(path), "%s/%s.so", dir, name);
+	path[sizeof(path) - 1] = '\0';
+	if (!(handle = dlopen(path, RTLD_NOW | RTLD_LOCAL))) {
+		birq_log(birq, LOG_ERR, "Can't load strategy module: %s",
+			dlerror());
+		return NULL;
+	}
+	strategy = (const birq_strategy_t *)dlsym(handle, BIRQ_STRATEGY_SYMBOL);
+	if (!strategy || (strategy->abi != BIRQ_STRATEGY_ABI) ||
+		!strategy->name || !strategy->plan) {
+		birq_log(birq, LOG_ERR, "Incompatible strategy module %s", path);
+		dlclose(handle);
+		return NULL;
+	}
+	if (!(new = malloc(sizeof(*new)))) {
+		dlclose(handle);
+		return NULL;
+	}
+	new->handle = handle;
+	new->strategy = strategy;
+	birq_log(birq, LOG_INFO, "Load strategy module %s", path);
+
+	return new;
+#else
+	(void)dir;
+	birq_log(birq, LOG_ERR,
+		"Can't load strategy module %s: no dlopen() support", name);
+	return NULL;
+#endif
+}
+
+void module_free(module_t *module)
+{
+	if (!module)
+		return;
+#ifdef HAVE_DLFCN_H
+	dlclose(module->handle);
+#endif
+	free(module);
+}
+
+/* Make read-only snapshot for the module, get proposed moves and
+   validate them. The accepted moves are applied to the IRQ-CPU linkage
+   and the IRQs are added to balance_irqs list. */
+int module_plan(birq_t *birq, module_t *module, lub_list_t *cpus, lub_list_t *irqs,
+	lub_list_t *balance_irqs, float threshold, float load_limit,
+	cpumask_t *exclude_cpus, int non_local_cpus)
+{
+	unsigned int cpu_num = lub_list_len(cpus);
+	unsigned int irq_num = lub_list_len(irqs);
+	birq_cpu_info_t *cpu_info = NULL;
+	birq_irq_info_t *irq_info = NULL;
+	unsigned char *local = NULL;
+	cpu_t **cpu_refs = NULL;
+	irq_t **irq_refs = NULL;
+	birq_snapshot_t snapshot;
+	birq_move_t moves[MODULE_MAX_MOVES];
+	unsigned int move_num;
+	lub_list_node_t *iter;
+	unsigned int i;
+	unsigned int j;
+
+	if (!module || !cpu_num || !irq_num)
+		return 0;
+	cpu_info = calloc(cpu_num, sizeof(*cpu_info));
+	cpu_refs = calloc(cpu_num, sizeof(*cpu_refs));
+	irq_info = calloc(irq_num, sizeof(*irq_info));
+	irq_refs = calloc(irq_num, sizeof(*irq_refs));
+	local = calloc(irq_num, cpu_num);
+	if (!cpu_info || !cpu_refs || !irq_info || !irq_refs || !local)
+		goto out;
+
+	for (i = 0, iter = lub_list_iterator_init(cpus); iter;
+		i++, iter = lub_list_iterator_next(iter)) {
+		cpu_t *cpu = (cpu_t *)lub_list_node__get_data(iter);
+		cpu_refs[i] = cpu;
+		cpu_info[i].id = cpu->id;
+		cpu_info[i].package_id = cpu->package_id;
+		cpu_info[i].core_id = cpu->core_id;
+		cpu_info[i].capacity = cpu->capacity;
+		cpu_info[i].load = cpu->load;
+		cpu_info[i].load_norm = cpu_load_norm(cpu);
+		cpu_info[i].steal = cpu->steal;
+		cpu_info[i].excluded = cpu_isset(cpu->id, *exclude_cpus);
+		cpu_info[i].avoid = !!cpu->avoid;
+		cpu_info[i].full = cpu->vectors &&
+			(lub_list_len(cpu->irqs) >= cpu->vectors);
+	}
+	for (i = 0, iter = lub_list_iterator_init(irqs); iter;
+		i++, iter = lub_list_iterator_next(iter)) {
+		irq_t *irq = (irq_t *)lub_list_node__get_data(iter);
+		irq_refs[i] = irq;
+		irq_info[i].irq = irq->irq;
+		irq_info[i].cpu = -1;
+		irq_info[i].intr = irq->intr;
+		irq_info[i].load = irq->load;
+		/* The IRQs already moved by built-in code are not movable */
+		irq_info[i].movable = !irq->blacklisted && !irq->weight &&
+			!irq->storm && !irq->frozen &&
+			!lub_list_search(balance_irqs, irq);
+		irq_info[i].desc = irq->desc;
+		irq_info[i].local = local + i * cpu_num;
+		for (j = 0; j < cpu_num; j++) {
+			if (irq->cpu == cpu_refs[j])
+				irq_info[i].cpu = j;
+			if (cpu_isset(cpu_refs[j]->id, irq->local_cpus))
+				local[i * cpu_num + j] = 1;
+		}
+	}
+	snapshot.cpu_num = cpu_num;
+	snapshot.cpus = cpu_info;
+	snapshot.irq_num = irq_num;
+	snapshot.irqs = irq_info;
+	snapshot.threshold = threshold;
+	snapshot.load_limit = load_limit;
+
+	move_num = module->strategy->plan(&snapshot, moves, MODULE_MAX_MOVES);
+	if (move_num > MODULE_MAX_MOVES)
+		move_num = MODULE_MAX_MOVES;
+
+	for (i = 0; i < move_num; i++) {
+		irq_t *irq;
+		cpu_t *cpu;
+
+		if ((moves[i].irq >= irq_num) || (moves[i].cpu >= cpu_num))
+			continue;
+		irq = irq_refs[moves[i].irq];
+		cpu = cpu_refs[moves[i].cpu];
+		if (!irq_info[moves[i].irq].movable || (irq->cpu == cpu))
+			continue;
+		if (cpu_info[moves[i].cpu].excluded ||
+			cpu_info[moves[i].cpu].full)
+			continue;
+		/* The target must not be overloaded within measurement
+		   error. The load of accepted moves is accounted. */
+		if ((cpu_info[moves[i].cpu].load_norm + cpu->load_error) >=
+			load_limit)
+			continue;
+		if (!local[moves[i].irq * cpu_num + moves[i].cpu] &&
+			!non_local_cpus)
+			continue;
+		if (lub_list_search(balance_irqs, irq))
+			continue;
+		BIRQ_PROBE3(move, irq->irq, irq->cpu ? (int)irq->cpu->id : -1,
+			cpu->id);
+		if (irq->cpu)
+			birq_log(birq, LOG_INFO,
+				"Move IRQ %u from CPU%u to CPU%u by %s",
+				irq->irq, irq->cpu->id, cpu->id,
+				module->strategy->name);
+		else
+			birq_log(birq, LOG_INFO, "Move IRQ %u to CPU%u by %s",
+				irq->irq, cpu->id, module->strategy->name);
+		move_irq_to_cpu(irq, cpu);
+		cpu_info[moves[i].cpu].load += irq->load;
+		cpu_info[moves[i].cpu].load_norm = cpu_load_norm_value(cpu,
+			cpu_info[moves[i].cpu].load);
+		/* Don't move this IRQ while next iteration. */
+		irq->weight = 1;
+		lub_list_add(balance_irqs, irq);
+	}
+
+out:
+	free(cpu_info);
+	free(cpu_refs);
+	free(irq_info);
+	free(irq_refs);
+	free(local);
+
+	return 0;
+}
@@ -0,0 +1,24 @@
+#ifndef _module_h
+#define _module_h
+
+#include "lub/list.h"
+#include "cpumask.h"
+#include "strategy.h"
+#include "libbirq.h"
+
+/* Max number of moves the module can propose per iteration */
+#define MODULE_MAX_MOVES 64
+
+struct module_s {
+	void *handle; /* dlopen() handle */
+	const birq_strategy_t *strategy;
+};
+typedef struct module_s module_t;
+
+module_t *module_load(birq_t *birq, const char *dir, const char *name);
+void module_free(module_t *module);
+int module_plan(birq_t *birq, module_t *module, lub_list_t *cpus, lub_list_t *irqs,
+	lub_list_t *balance_irqs, float threshold, float load_limit,
+	cpumask_t *exclude_cpus, int non_local_cpus);
+
+#endif
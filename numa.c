@@ -14,6 +14,7 @@
 #include "lub/list.h"
 #include "cpumask.h"
 #include "numa.h"
+#include "source.h"
 
 int numa_list_compare(const void *first, const void *second)
 {
@@ -79,29 +80,29 @@ int numa_list_free(lub_list_t *numas)
 }
 
 /* Show NUMA information */
-static void show_numa_info(numa_t *numa)
+static void show_numa_info(birq_t *birq, numa_t *numa)
 {
 	char buf[NR_CPUS + 1];
 	cpumask_scnprintf(buf, sizeof(buf), numa->cpumap);
 	buf[sizeof(buf) - 1] = '\0';
-	printf("NUMA node %d cpumap %s\n", numa->id, buf);
+	birq_log(birq, LOG_INFO, "NUMA node %d cpumap %s", numa->id, buf);
 }
 
 /* Show NUMA list */
-int show_numas(lub_list_t *numas)
+int show_numas(birq_t *birq, lub_list_t *numas)
 {
 	lub_list_node_t *iter;
 	for (iter = lub_list_iterator_init(numas); iter;
 		iter = lub_list_iterator_next(iter)) {
 		numa_t *numa;
 		numa = (numa_t *)lub_list_node__get_data(iter);
-		show_numa_info(numa);
+		show_numa_info(birq, numa);
 	}
 	return 0;
 }
 
 /* Search for NUMA nodes */
-int scan_numas(lub_list_t *numas)
+int scan_numas(birq_t *birq, lub_list_t *numas)
 {
 	FILE *fd;
 	char path[PATH_MAX];
@@ -116,7 +117,7 @@ int scan_numas(lub_list_t *numas)
 		snprintf(path, sizeof(path),
 			"%s/node%d", SYSFS_NUMA_PATH, id);
 		path[sizeof(path) - 1] = '\0';
-		if (access(path, F_OK))
+		if (!source_exists(birq, path))
 			break;
 
 		if (!(numa = numa_list_search(numas, id))) {
@@ -128,7 +129,7 @@ int scan_numas(lub_list_t *numas)
 		snprintf(path, sizeof(path),
 			"%s/node%d/cpumap", SYSFS_NUMA_PATH, id);
 		path[sizeof(path) - 1] = '\0';
-		if ((fd = fopen(path, "r"))) {
+		if ((fd = source_open(birq, path))) {
 			if (getline(&str, &sz, fd) >= 0)
 				cpumask_parse_user(str, strlen(str), cpumap);
 			fclose(fd);
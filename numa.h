@@ -3,6 +3,7 @@
 
 #include "lub/list.h"
 #include "cpumask.h"
+#include "libbirq.h"
 
 struct numa_s {
 	unsigned int id; /* NUMA ID */
@@ -16,8 +17,8 @@ typedef struct numa_s numa_t;
 
 int numa_list_compare(const void *first, const void *second);
 int numa_list_free(lub_list_t *numas);
-int scan_numas(lub_list_t *numas);
-int show_numas(lub_list_t *numas);
+int scan_numas(birq_t *birq, lub_list_t *numas);
+int show_numas(birq_t *birq, lub_list_t *numas);
 numa_t * numa_list_search(lub_list_t *numas, unsigned int id);
 
 #endif
@@ -0,0 +1,293 @@
+/* pack.c
+ * Pack IRQs to the fewest CPUs while low load to save power.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "lub/list.h"
+#include "cpumask.h"
+#include "cpu.h"
+#include "irq.h"
+#include "numa.h"
+#include "balance.h"
+#include "pack.h"
+#include "source.h"
+
+pack_t *pack_new(void)
+{
+	pack_t *new;
+
+	if (!(new = malloc(sizeof(*new))))
+		return NULL;
+	new->packed = 0;
+	new->ticks = 0;
+	new->holdoff = 0;
+	new->deep_idle = 0;
+	cpus_init(new->cpus);
+	cpus_clear(new->cpus);
+
+	return new;
+}
+
+void pack_free(pack_t *pack)
+{
+	if (!pack)
+		return;
+	cpus_free(pack->cpus);
+	free(pack);
+}
+
+/* Get first CPU from the CPU list that belongs to cpumask */
+static cpu_t *first_cpu_in(lub_list_t *cpus, cpumask_t *cpumask)
+{
+	lub_list_node_t *iter;
+
+	for (iter = lub_list_iterator_init(cpus); iter;
+		iter = lub_list_iterator_next(iter)) {
+		cpu_t *cpu = (cpu_t *)lub_list_node__get_data(iter);
+		if (cpu_isset(cpu->id, *cpumask))
+			return cpu;
+	}
+
+	return NULL;
+}
+
+/* Choose the CPUs to pack IRQs to. It's the first allowed CPU of each
+   NUMA node. */
+static void pack_choose_cpus(pack_t *pack, lub_list_t *cpus,
+	lub_list_t *numas, cpumask_t *exclude_cpus)
+{
+	lub_list_node_t *iter;
+	cpumask_t allowed;
+	cpu_t *cpu;
+
+	cpus_init(allowed);
+	cpus_clear(pack->cpus);
+	if (lub_list_len(numas) == 0) {
+		cpus_complement(allowed, *exclude_cpus);
+		if ((cpu = first_cpu_in(cpus, &allowed)))
+			cpu_set(cpu->id, pack->cpus);
+	}
+	for (iter = lub_list_iterator_init(numas); iter;
+		iter = lub_list_iterator_next(iter)) {
+		numa_t *numa = (numa_t *)lub_list_node__get_data(iter);
+		cpus_complement(allowed, *exclude_cpus);
+		cpus_and(allowed, allowed, numa->cpumap);
+		if ((cpu = first_cpu_in(cpus, &allowed)))
+			cpu_set(cpu->id, pack->cpus);
+	}
+	cpus_free(allowed);
+}
+
+/* Average deep idle residency of CPUs IRQs are packed away from */
+static float pack_deep_idle(pack_t *pack, lub_list_t *cpus)
+{
+	lub_list_node_t *iter;
+	float deep_idle = 0;
+	unsigned int num = 0;
+
+	for (iter = lub_list_iterator_init(cpus); iter;
+		iter = lub_list_iterator_next(iter)) {
+		cpu_t *cpu = (cpu_t *)lub_list_node__get_data(iter);
+		if (cpu_isset(cpu->id, pack->cpus))
+			continue;
+		deep_idle += cpu->deep_idle;
+		num++;
+	}
+	if (!num)
+		return 0;
+
+	return deep_idle / num;
+}
+
+/* Give IRQs from packing CPUs back to balancer. Keep one IRQ on each
+   CPU. The balance() will spread the rest. */
+static void pack_release(pack_t *pack, lub_list_t *cpus,
+	lub_list_t *balance_irqs)
+{
+	lub_list_node_t *iter;
+
+	for (iter = lub_list_iterator_init(cpus); iter;
+		iter = lub_list_iterator_next(iter)) {
+		cpu_t *cpu = (cpu_t *)lub_list_node__get_data(iter);
+		lub_list_node_t *iter2;
+		int keep = 1;
+
+		if (!cpu_isset(cpu->id, pack->cpus))
+			continue;
+		for (iter2 = lub_list_iterator_init(cpu->irqs); iter2;
+			iter2 = lub_list_iterator_next(iter2)) {
+			irq_t *irq = (irq_t *)lub_list_node__get_data(iter2);
+			if (irq->intr == 0)
+				continue;
+			if (irq->storm || irq->frozen)
+				continue;
+			if (keep) {
+				keep = 0;
+				continue;
+			}
+			/* Don't move this IRQ while next iteration. */
+			irq->weight = 1;
+			lub_list_add(balance_irqs, irq);
+		}
+	}
+	pack->packed = 0;
+	pack->ticks = 0;
+}
+
+/* Move IRQ to packing CPU within its local CPUs. The vfio IRQ stays
+   within CPUs of vCPU threads and the IRQ with consumer stays within
+   consumer CPUs. Returns 1 if IRQ is moved. */
+static int pack_move(birq_t *birq, lub_list_t *cpus, cpumask_t *pack_cpus,
+	irq_t *irq)
+{
+	cpumask_t possible_cpus;
+	cpu_t *cpu;
+
+	cpus_init(possible_cpus);
+	cpus_and(possible_cpus, *pack_cpus, irq->local_cpus);
+	if (!cpus_empty(irq->vcpu_cpus))
+		cpus_and(possible_cpus, possible_cpus, irq->vcpu_cpus);
+	if (!cpus_empty(irq->consumer_cpus))
+		cpus_and(possible_cpus, possible_cpus, irq->consumer_cpus);
+	cpu = first_cpu_in(cpus, &possible_cpus);
+	cpus_free(possible_cpus);
+	if (!cpu || (cpu == irq->cpu))
+		return 0;
+	if (irq->cpu)
+		birq_log(birq, LOG_INFO, "Pack IRQ %u from CPU%u to CPU%u",
+			irq->irq, irq->cpu->id, cpu->id);
+	else
+		birq_log(birq, LOG_INFO, "Pack IRQ %u to CPU%u",
+			irq->irq, cpu->id);
+	move_irq_to_cpu(irq, cpu);
+
+	return 1;
+}
+
+/* Check the total IRQ load is surely beyond the value. The distance
+   must exceed the measurement error of total. The errors of CPUs are
+   independent so they are added in quadrature. The "error2" is the
+   squared error of total. The sign is 1 for "greater than value" and
+   -1 for "lower than value". */
+static int pack_beyond(float total, float error2, float value, int sign)
+{
+	float dist = (total - value) * sign;
+
+	return (dist > 0) && (dist * dist >= error2);
+}
+
+/* While total IRQ load is lower than watermark gather active IRQs on
+   the single CPU of each NUMA node. So other CPUs can reach deep idle
+   states. The new CPU is set for IRQs within balance_irqs list.
+   Returns 1 if IRQs are packed and balance() must not be used. */
+int pack_irqs(birq_t *birq, pack_t *pack, lub_list_t *cpus,
+	lub_list_t *numas, lub_list_t *balance_irqs, float watermark,
+	cpumask_t *exclude_cpus)
+{
+	lub_list_node_t *iter;
+	lub_list_node_t *node;
+	lub_list_t *candidates;
+	float total = 0;
+	float error2 = 0;
+	float deep_idle;
+
+	if (!pack)
+		return 0;
+	if (watermark <= 0) {
+		if (pack->packed)
+			pack_release(pack, cpus, balance_irqs);
+		return 0;
+	}
+
+	for (iter = lub_list_iterator_init(cpus); iter;
+		iter = lub_list_iterator_next(iter)) {
+		cpu_t *cpu = (cpu_t *)lub_list_node__get_data(iter);
+		total += cpu->load;
+		error2 += cpu->load_error * cpu->load_error;
+	}
+	pack_choose_cpus(pack, cpus, numas, exclude_cpus);
+	deep_idle = pack_deep_idle(pack, cpus);
+
+	if (!pack->packed) {
+		if (pack->holdoff) {
+			pack->holdoff--;
+			return 0;
+		}
+		if (!pack_beyond(total, error2, watermark, -1))
+			return 0;
+		birq_log(birq, LOG_INFO,
+			"Pack IRQs: total IRQ load %.2f%%, deep idle %.2f%%",
+			total, deep_idle);
+		pack->packed = 1;
+		pack->ticks = 0;
+		pack->deep_idle = deep_idle;
+	} else {
+		if (pack_beyond(total, error2, watermark * PACK_HYSTERESIS, 1)) {
+			birq_log(birq, LOG_INFO,
+				"Unpack IRQs: total IRQ load %.2f%%", total);
+			pack_release(pack, cpus, balance_irqs);
+			return 0;
+		}
+		pack->ticks++;
+		/* Check the packing really saves power. The check is
+		   repeated because the workload changes. */
+		if (!(pack->ticks % PACK_CONFIRM_TICKS)) {
+			if (deep_idle <= pack->deep_idle) {
+				birq_log(birq, LOG_INFO,
+					"Unpack IRQs: deep idle %.2f%% (was %.2f%%), no power savings",
+					deep_idle, pack->deep_idle);
+				pack_release(pack, cpus, balance_irqs);
+				pack->holdoff = PACK_HOLDOFF_TICKS;
+				return 0;
+			}
+			if (pack->ticks == PACK_CONFIRM_TICKS)
+				birq_log(birq, LOG_INFO,
+					"Packed IRQs: deep idle %.2f%% (was %.2f%%)",
+					deep_idle, pack->deep_idle);
+		}
+	}
+
+	/* Move IRQs queued by other stages to packing CPU */
+	for (iter = lub_list_iterator_init(balance_irqs); iter;
+		iter = lub_list_iterator_next(iter)) {
+		irq_t *irq = (irq_t *)lub_list_node__get_data(iter);
+		pack_move(birq, cpus, &pack->cpus, irq);
+	}
+
+	/* Find active IRQs out of packing CPUs. The IRQ list of CPU
+	   changes while moving so gather candidates first. */
+	candidates = lub_list_new(irq_list_compare);
+	for (iter = lub_list_iterator_init(cpus); iter;
+		iter = lub_list_iterator_next(iter)) {
+		cpu_t *cpu = (cpu_t *)lub_list_node__get_data(iter);
+		lub_list_node_t *iter2;
+		if (cpu_isset(cpu->id, pack->cpus))
+			continue;
+		for (iter2 = lub_list_iterator_init(cpu->irqs); iter2;
+			iter2 = lub_list_iterator_next(iter2)) {
+			irq_t *irq = (irq_t *)lub_list_node__get_data(iter2);
+			if (irq->intr == 0)
+				continue;
+			if (irq->storm || irq->frozen)
+				continue;
+			lub_list_add(candidates, irq);
+		}
+	}
+	/* Only IRQs really moved to packing CPU need new affinity. The
+	   IRQ without packing CPU within its local CPUs stays. */
+	while ((node = lub_list__get_head(candidates))) {
+		irq_t *irq = (irq_t *)lub_list_node__get_data(node);
+		lub_list_del(candidates, node);
+		lub_list_node_free(node);
+		if (lub_list_search(balance_irqs, irq))
+			continue;
+		if (pack_move(birq, cpus, &pack->cpus, irq))
+			lub_list_add(balance_irqs, irq);
+	}
+	lub_list_free(candidates);
+
+	return 1;
+}
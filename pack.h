@@ -0,0 +1,30 @@
+#ifndef _pack_h
+#define _pack_h
+
+#include "lub/list.h"
+#include "cpumask.h"
+#include "libbirq.h"
+
+/* Interval of the power savings checks, iterations */
+#define PACK_CONFIRM_TICKS 10
+/* Iterations to wait for next packing after unsuccessful one */
+#define PACK_HOLDOFF_TICKS 360
+/* Unpack IRQs when total load is greater than watermark * hysteresis */
+#define PACK_HYSTERESIS 1.25
+
+struct pack_s {
+	int packed; /* IRQs are packed now */
+	unsigned int ticks; /* Iterations since IRQs were packed */
+	unsigned int holdoff; /* Iterations to wait before packing again */
+	float deep_idle; /* Deep idle residency before packing */
+	cpumask_t cpus; /* CPUs to pack IRQs to. One CPU per NUMA node */
+};
+typedef struct pack_s pack_t;
+
+pack_t *pack_new(void);
+void pack_free(pack_t *pack);
+int pack_irqs(birq_t *birq, pack_t *pack, lub_list_t *cpus,
+	lub_list_t *numas, lub_list_t *balance_irqs, float watermark,
+	cpumask_t *exclude_cpus);
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef _probes_h
+#define _probes_h
+
+/* USDT static probes. The probe is a single nop when it's not traced.
+   The probes are compiled out if sys/sdt.h is not found.
+   List probes: bpftrace -l 'usdt:/usr/sbin/birq:*'
+
+   stage_start(name), stage_end(name) - main loop stages: "scan",
+	"statistics", "tasks", "sensors", "forecast", "shadow", "plan",
+	"apply".
+   candidate(irq, cpu, intr, stage) - IRQ considered for moving.
+	The stage is 1 for excluded CPU, 2 for CPU to evacuate, 3 for
+	overloaded CPU.
+   move(irq, from_cpu, to_cpu) - decided move. The from_cpu is -1 for
+	IRQ without CPU.
+   affinity(irq, cpu, err) - result of affinity write. The err is errno
+	or 0 on success. The cpu is -1 if unknown.
+   verified(irq, cpu, effect_time) - confirmed move. The effect_time is
+	time from affinity write to confirmation, usec.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define BIRQ_PROBE1(name, a1) \
+	DTRACE_PROBE1(birq, name, a1)
+#define BIRQ_PROBE3(name, a1, a2, a3) \
+	DTRACE_PROBE3(birq, name, a1, a2, a3)
+#define BIRQ_PROBE4(name, a1, a2, a3, a4) \
+	DTRACE_PROBE4(birq, name, a1, a2, a3, a4)
+#else
+#define BIRQ_PROBE1(name, a1) do {} while (0)
+#define BIRQ_PROBE3(name, a1, a2, a3) do {} while (0)
+#define BIRQ_PROBE4(name, a1, a2, a3, a4) do {} while (0)
+#endif
+
+#define BIRQ_STAGE_START(stage) BIRQ_PROBE1(stage_start, stage)
+#define BIRQ_STAGE_END(stage) BIRQ_PROBE1(stage_end, stage)
+
+/* Candidate stages for choose_irqs_to_move() */
+#define PROBE_CANDIDATE_EXCLUDED 1
+#define PROBE_CANDIDATE_EVACUATE 2
+#define PROBE_CANDIDATE_OVERLOADED 3
+
+#endif
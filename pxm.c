@@ -14,6 +14,7 @@
 #include "lub/list.h"
 #include "numa.h"
 #include "pxm.h"
+#include "source.h"
 
 static pxm_t * pxm_new(const char *addr)
 {
@@ -59,7 +60,7 @@ int pxm_list_free(lub_list_t *pxms)
 }
 
 /* Show proximity information */
-static void show_pxm_info(pxm_t *pxm)
+static void show_pxm_info(birq_t *birq, pxm_t *pxm)
 {
 	char buf[NR_CPUS + 1];
 	if (cpus_full(pxm->cpumask))
@@ -67,18 +68,18 @@ static void show_pxm_info(pxm_t *pxm)
 	else
 		cpumask_scnprintf(buf, sizeof(buf), pxm->cpumask);
 	buf[sizeof(buf) - 1] = '\0';
-	printf("PXM: %s cpumask %s\n", pxm->addr, buf);
+	birq_log(birq, LOG_INFO, "PXM: %s cpumask %s", pxm->addr, buf);
 }
 
 /* Show PXM list */
-int show_pxms(lub_list_t *pxms)
+int show_pxms(birq_t *birq, lub_list_t *pxms)
 {
 	lub_list_node_t *iter;
 	for (iter = lub_list_iterator_init(pxms); iter;
 		iter = lub_list_iterator_next(iter)) {
 		pxm_t *pxm;
 		pxm = (pxm_t *)lub_list_node__get_data(iter);
-		show_pxm_info(pxm);
+		show_pxm_info(birq, pxm);
 	}
 	return 0;
 }
@@ -110,7 +111,8 @@ int pxm_search(lub_list_t *pxms, const char *addr, cpumask_t *cpumask)
 	return 0;
 }
 
-int parse_pxm_config(const char *fname, lub_list_t *pxms, lub_list_t *numas)
+int parse_pxm_config(birq_t *birq, const char *fname, lub_list_t *pxms,
+	lub_list_t *numas)
 {
 	FILE *file;
 	char *line = NULL;
@@ -121,7 +123,7 @@ int parse_pxm_config(const char *fname, lub_list_t *pxms, lub_list_t *numas)
 
 	if (!fname)
 		return -1;
-	file = fopen(fname, "r");
+	file = source_open(birq, fname);
 	if (!file)
 		return -1;
 
@@ -150,15 +152,15 @@ int parse_pxm_config(const char *fname, lub_list_t *pxms, lub_list_t *numas)
 		/* Get PXM command */
 		pxm_cmd = strtok_r(NULL, " ", &saveptr);
 		if (!pxm_cmd) {
-			fprintf(stderr, "Warning: Illegal line %u in %s\n",
-				ln, fname);
+			birq_log(birq, LOG_WARNING,
+				"Warning: Illegal line %u in %s", ln, fname);
 			continue;
 		}
 		/* Get PXM string (mask or node) */
 		pxm_pxm = strtok_r(NULL, " ", &saveptr);
 		if (!pxm_pxm) {
-			fprintf(stderr, "Warning: Illegal line %u in %s\n",
-				ln, fname);
+			birq_log(birq, LOG_WARNING,
+				"Warning: Illegal line %u in %s", ln, fname);
 			continue;
 		}
 
@@ -173,8 +175,8 @@ int parse_pxm_config(const char *fname, lub_list_t *pxms, lub_list_t *numas)
 			int noden = -1;
 			noden = strtol(pxm_pxm, &endptr, 10);
 			if (endptr == pxm_pxm) {
-				fprintf(stderr, "Warning: Wrong NUMA node in "
-					"line %u in %s\n", ln, fname);
+				birq_log(birq, LOG_WARNING, "Warning: Wrong NUMA node in "
+					"line %u in %s", ln, fname);
 				cpus_free(cpumask);
 				continue;
 			}
@@ -184,7 +186,8 @@ int parse_pxm_config(const char *fname, lub_list_t *pxms, lub_list_t *numas)
 				numa_t *numa;
 				numa = numa_list_search(numas, noden);
 				if (!numa) {
-					fprintf(stderr, "Warning: Wrong NUMA node. Line %u in %s\n",
+					birq_log(birq, LOG_WARNING,
+						"Warning: Wrong NUMA node. Line %u in %s",
 						ln, fname);
 					cpus_free(cpumask);
 					continue;
@@ -193,8 +196,8 @@ int parse_pxm_config(const char *fname, lub_list_t *pxms, lub_list_t *numas)
 				cpus_or(cpumask, cpumask, numa->cpumap);
 			}
 		} else {
-			fprintf(stderr, "Warning: Illegal command %u in %s\n",
-				ln, fname);
+			birq_log(birq, LOG_WARNING,
+				"Warning: Illegal command %u in %s", ln, fname);
 			cpus_free(cpumask);
 			continue;
 		}
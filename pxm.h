@@ -2,6 +2,7 @@
 #define _pxm_h
 
 #include "cpumask.h"
+#include "libbirq.h"
 
 struct pxm_s {
 	char *addr;
@@ -10,8 +11,9 @@ struct pxm_s {
 typedef struct pxm_s pxm_t;
 
 int pxm_list_free(lub_list_t *pxms);
-int show_pxms(lub_list_t *pxms);
+int show_pxms(birq_t *birq, lub_list_t *pxms);
 int pxm_search(lub_list_t *pxms, const char *addr, cpumask_t *cpumask);
-int parse_pxm_config(const char *fname, lub_list_t *pxms, lub_list_t *numas);
+int parse_pxm_config(birq_t *birq, const char *fname, lub_list_t *pxms,
+	lub_list_t *numas);
 
 #endif
@@ -0,0 +1,295 @@
+/* shadow.c
+ * Evaluate alternative planner policies in shadow.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "lub/list.h"
+#include "cpumask.h"
+#include "cpu.h"
+#include "irq.h"
+#include "balance.h"
+#include "shadow.h"
+#include "source.h"
+#include "engine.h"
+
+static const char *strategy_name(birq_choose_strategy_e strategy)
+{
+	switch (strategy) {
+	case BIRQ_CHOOSE_MAX:
+		return "max";
+	case BIRQ_CHOOSE_MIN:
+		return "min";
+	default:
+		break;
+	}
+	return "rnd";
+}
+
+/* Parse "<strategy>:<threshold>" */
+static int policy_parse(const char *str, policy_t *policy)
+{
+	char *endptr;
+
+	if (!strncmp(str, "max:", 4))
+		policy->strategy = BIRQ_CHOOSE_MAX;
+	else if (!strncmp(str, "min:", 4))
+		policy->strategy = BIRQ_CHOOSE_MIN;
+	else if (!strncmp(str, "rnd:", 4))
+		policy->strategy = BIRQ_CHOOSE_RND;
+	else
+		return -1;
+	policy->threshold = strtof(str + 4, &endptr);
+	if ((endptr == str + 4) || *endptr ||
+		(policy->threshold <= 0) || (policy->threshold > 100.0))
+		return -1;
+	policy->score = 0;
+	policy->moves = 0;
+	policy->wins = 0;
+
+	return 0;
+}
+
+/* Create shadow evaluation for comma separated list of
+   "<strategy>:<threshold>" policies. Returns NULL if there are no
+   valid policies. */
+shadow_t *shadow_new(birq_t *birq, const char *policies)
+{
+	shadow_t *new;
+	char *str;
+	char *tok;
+	char *saveptr = NULL;
+
+	if (!policies)
+		return NULL;
+	if (!(new = malloc(sizeof(*new))))
+		return NULL;
+	new->policies = lub_list_new(NULL);
+	new->ticks = 0;
+	memset(&new->live, 0, sizeof(new->live));
+
+	str = strdup(policies);
+	for (tok = strtok_r(str, ",", &saveptr); tok;
+		tok = strtok_r(NULL, ",", &saveptr)) {
+		policy_t *policy = malloc(sizeof(*policy));
+		if (!policy)
+			break;
+		if (policy_parse(tok, policy)) {
+			birq_log(birq, LOG_ERR, "Error: Illegal shadow policy %s.",
+				tok);
+			free(policy);
+			continue;
+		}
+		lub_list_add(new->policies, policy);
+	}
+	free(str);
+
+	if (lub_list_len(new->policies) == 0) {
+		shadow_free(new);
+		return NULL;
+	}
+
+	return new;
+}
+
+void shadow_free(shadow_t *shadow)
+{
+	lub_list_node_t *node;
+
+	if (!shadow)
+		return;
+	while ((node = lub_list__get_tail(shadow->policies))) {
+		lub_list_del(shadow->policies, node);
+		free(lub_list_node__get_data(node));
+		lub_list_node_free(node);
+	}
+	lub_list_free(shadow->policies);
+	free(shadow);
+}
+
+/* Make virtual copy of CPUs and their IRQs. The virtual IRQs are
+   listed within virqs to free them later. */
+static lub_list_t *shadow_copy(lub_list_t *cpus, lub_list_t *virqs)
+{
+	lub_list_node_t *iter;
+	lub_list_node_t *viter;
+	lub_list_t *vcpus;
+
+	vcpus = cpu_list_clone(cpus);
+	for (iter = lub_list_iterator_init(cpus),
+		viter = lub_list_iterator_init(vcpus); iter && viter;
+		iter = lub_list_iterator_next(iter),
+		viter = lub_list_iterator_next(viter)) {
+		cpu_t *cpu = (cpu_t *)lub_list_node__get_data(iter);
+		cpu_t *vcpu = (cpu_t *)lub_list_node__get_data(viter);
+		lub_list_node_t *iter2;
+
+		for (iter2 = lub_list_iterator_init(cpu->irqs); iter2;
+			iter2 = lub_list_iterator_next(iter2)) {
+			irq_t *irq = (irq_t *)lub_list_node__get_data(iter2);
+			irq_t *virq;
+			if (!(virq = irq_clone(irq)))
+				continue;
+			virq->cpu = vcpu;
+			lub_list_add(virqs, virq);
+			lub_list_add(vcpu->irqs, virq);
+		}
+	}
+
+	return vcpus;
+}
+
+/* Plan moves for the policy on the virtual copy of CPUs and IRQs and
+   return the score. The planner is the live one: choose_irqs_to_move()
+   and balance(). The score is projected imbalance (max CPU load minus
+   average one) plus the cost of moves. The load of moved IRQ leaves
+   its old CPU and is added to the new one. */
+static float policy_score(birq_t *birq, policy_t *policy, lub_list_t *cpus,
+	float load_limit, cpumask_t *exclude_cpus, int non_local_cpus,
+	birq_cpu_strategy_e cpu_strategy, unsigned int cpu_choices,
+	cpumask_t *awake_cpus, float heavy_load, unsigned int *moves)
+{
+	lub_list_node_t *iter;
+	lub_list_node_t *viter;
+	lub_list_node_t *node;
+	lub_list_t *vcpus;
+	lub_list_t *virqs;
+	lub_list_t *vbalance;
+	float max = 0;
+	float sum = 0;
+	unsigned int used = 0;
+
+	*moves = 0;
+	virqs = lub_list_new(irq_list_compare);
+	vcpus = shadow_copy(cpus, virqs);
+	vbalance = lub_list_new(irq_list_compare);
+
+	birq->quiet = 1;
+	choose_irqs_to_move(birq, vcpus, vbalance, policy->threshold,
+		policy->strategy, exclude_cpus, heavy_load);
+	if (lub_list_len(vbalance) != 0)
+		balance(birq, vcpus, vbalance, load_limit, exclude_cpus,
+			non_local_cpus, cpu_strategy, cpu_choices,
+			awake_cpus, heavy_load);
+	birq->quiet = 0;
+
+	/* Projected imbalance */
+	for (iter = lub_list_iterator_init(cpus),
+		viter = lub_list_iterator_init(vcpus); iter && viter;
+		iter = lub_list_iterator_next(iter),
+		viter = lub_list_iterator_next(viter)) {
+		cpu_t *cpu = (cpu_t *)lub_list_node__get_data(iter);
+		cpu_t *vcpu = (cpu_t *)lub_list_node__get_data(viter);
+		lub_list_node_t *iter2;
+		float load = cpu->load;
+
+		for (iter2 = lub_list_iterator_init(vcpu->irqs); iter2;
+			iter2 = lub_list_iterator_next(iter2)) {
+			irq_t *virq = (irq_t *)lub_list_node__get_data(iter2);
+			if (lub_list_search(cpu->irqs, virq))
+				continue;
+			load += virq->load;
+			*moves += 1;
+		}
+		for (iter2 = lub_list_iterator_init(cpu->irqs); iter2;
+			iter2 = lub_list_iterator_next(iter2)) {
+			irq_t *irq = (irq_t *)lub_list_node__get_data(iter2);
+			if (!lub_list_search(vcpu->irqs, irq))
+				load -= irq->load;
+		}
+		if (cpu_isset(cpu->id, *exclude_cpus))
+			continue;
+		if (load > max)
+			max = load;
+		sum += load;
+		used++;
+	}
+
+	while ((node = lub_list__get_tail(vbalance))) {
+		lub_list_del(vbalance, node);
+		lub_list_node_free(node);
+	}
+	lub_list_free(vbalance);
+	cpu_list_free(vcpus);
+	irq_list_free(virqs);
+	if (!used)
+		return 0;
+
+	return max - sum / used + *moves * SHADOW_MOVE_COST;
+}
+
+/* Score live and shadow policies against the same snapshot. Report
+   the comparison each window. The shadow policy that beats the live
+   one for several successive windows can be promoted to live. The
+   previous live policy becomes shadow one. */
+void shadow_update(birq_t *birq, shadow_t *shadow, lub_list_t *cpus,
+	float load_limit, cpumask_t *exclude_cpus, int non_local_cpus,
+	birq_cpu_strategy_e cpu_strategy, unsigned int cpu_choices,
+	cpumask_t *awake_cpus, float heavy_load,
+	birq_choose_strategy_e *strategy, float *threshold, int promote)
+{
+	lub_list_node_t *iter;
+	unsigned int moves;
+	policy_t *best = NULL;
+
+	if (!shadow)
+		return;
+
+	shadow->live.strategy = *strategy;
+	shadow->live.threshold = *threshold;
+	shadow->live.score += policy_score(birq, &shadow->live, cpus, load_limit,
+		exclude_cpus, non_local_cpus, cpu_strategy, cpu_choices,
+		awake_cpus, heavy_load, &moves);
+	shadow->live.moves += moves;
+	for (iter = lub_list_iterator_init(shadow->policies); iter;
+		iter = lub_list_iterator_next(iter)) {
+		policy_t *policy = (policy_t *)lub_list_node__get_data(iter);
+		policy->score += policy_score(birq, policy, cpus, load_limit,
+			exclude_cpus, non_local_cpus, cpu_strategy, cpu_choices,
+			awake_cpus, heavy_load, &moves);
+		policy->moves += moves;
+	}
+
+	shadow->ticks++;
+	if (shadow->ticks < SHADOW_WINDOW)
+		return;
+
+	/* Compare policies */
+	birq_log(birq, LOG_INFO, "Live policy %s:%.2f: score %.2f, moves %u",
+		strategy_name(shadow->live.strategy), shadow->live.threshold,
+		shadow->live.score / shadow->ticks, shadow->live.moves);
+	for (iter = lub_list_iterator_init(shadow->policies); iter;
+		iter = lub_list_iterator_next(iter)) {
+		policy_t *policy = (policy_t *)lub_list_node__get_data(iter);
+		birq_log(birq, LOG_INFO,
+			"Shadow policy %s:%.2f: score %.2f, moves %u",
+			strategy_name(policy->strategy), policy->threshold,
+			policy->score / shadow->ticks, policy->moves);
+		if (policy->score <
+			shadow->live.score * (1 - SHADOW_PROMOTE_MARGIN))
+			policy->wins++;
+		else
+			policy->wins = 0;
+		if ((policy->wins >= SHADOW_PROMOTE_WINS) &&
+			(!best || (policy->score < best->score)))
+			best = policy;
+		policy->score = 0;
+		policy->moves = 0;
+	}
+	shadow->live.score = 0;
+	shadow->live.moves = 0;
+	shadow->ticks = 0;
+
+	if (!promote || !best)
+		return;
+	birq_log(birq, LOG_NOTICE,
+		"Promote shadow policy %s:%.2f instead of %s:%.2f",
+		strategy_name(best->strategy), best->threshold,
+		strategy_name(*strategy), *threshold);
+	*strategy = best->strategy;
+	*threshold = best->threshold;
+	best->strategy = shadow->live.strategy;
+	best->threshold = shadow->live.threshold;
+	best->wins = 0;
+}
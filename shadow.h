@@ -0,0 +1,43 @@
+#ifndef _shadow_h
+#define _shadow_h
+
+#include "lub/list.h"
+#include "cpumask.h"
+#include "balance.h"
+#include "libbirq.h"
+
+/* Iterations to accumulate scores before comparison */
+#define SHADOW_WINDOW 60
+/* Cost of single IRQ move within score, in load percents */
+#define SHADOW_MOVE_COST 1.0
+/* Shadow must be better than live policy by this part of score */
+#define SHADOW_PROMOTE_MARGIN 0.1
+/* Successive windows shadow must win to be promoted */
+#define SHADOW_PROMOTE_WINS 3
+
+/* Planner configuration and its score */
+struct policy_s {
+	birq_choose_strategy_e strategy;
+	float threshold;
+	float score; /* Sum of scores within window. Less is better */
+	unsigned int moves; /* Number of moves within window */
+	unsigned int wins; /* Successive windows the shadow beats live policy */
+};
+typedef struct policy_s policy_t;
+
+struct shadow_s {
+	lub_list_t *policies; /* Shadow policies */
+	policy_t live; /* Score of live policy */
+	unsigned int ticks; /* Iterations within current window */
+};
+typedef struct shadow_s shadow_t;
+
+shadow_t *shadow_new(birq_t *birq, const char *policies);
+void shadow_free(shadow_t *shadow);
+void shadow_update(birq_t *birq, shadow_t *shadow, lub_list_t *cpus,
+	float load_limit, cpumask_t *exclude_cpus, int non_local_cpus,
+	birq_cpu_strategy_e cpu_strategy, unsigned int cpu_choices,
+	cpumask_t *awake_cpus, float heavy_load,
+	birq_choose_strategy_e *strategy, float *threshold, int promote);
+
+#endif
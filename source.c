@@ -0,0 +1,160 @@
+/* source.c
+ * Environment of the engine: data source and sink, clocks and log.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include "lub/list.h"
+#include "cpumask.h"
+#include "engine.h"
+#include "source.h"
+
+static FILE *real_open(const char *path, void *udata)
+{
+	(void)udata;
+	return fopen(path, "r");
+}
+
+static DIR *real_opendir(const char *path, void *udata)
+{
+	(void)udata;
+	return opendir(path);
+}
+
+static int real_exists(const char *path, void *udata)
+{
+	(void)udata;
+	return !access(path, F_OK);
+}
+
+static ssize_t real_readlink(const char *path, char *buf, size_t size,
+	void *udata)
+{
+	(void)udata;
+	return readlink(path, buf, size);
+}
+
+/* Note fprintf() without fflush() will not return I/O error due to
+   buffers. So use write() to get the error. */
+static int real_write(const char *path, const char *buf, void *udata)
+{
+	int f;
+	int err = 0;
+
+	(void)udata;
+	if ((f = open(path, O_WRONLY | O_SYNC)) < 0)
+		return errno;
+	if (write(f, buf, strlen(buf)) < 0)
+		err = errno;
+	close(f);
+
+	return err;
+}
+
+static time_t real_time(void *udata)
+{
+	(void)udata;
+	return time(NULL);
+}
+
+static unsigned long long real_clock(void *udata)
+{
+	struct timespec ts;
+
+	(void)udata;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void real_log(int priority, const char *msg, void *udata)
+{
+	(void)udata;
+	fprintf((priority <= LOG_WARNING) ? stderr : stdout, "%s\n", msg);
+}
+
+/* Fill the environment of engine. The NULL user's callbacks are the
+   real ones. */
+void source_init(birq_env_t *env, const birq_env_t *user)
+{
+	if (user)
+		*env = *user;
+	else
+		memset(env, 0, sizeof(*env));
+	if (!env->open)
+		env->open = real_open;
+	if (!env->opendir)
+		env->opendir = real_opendir;
+	if (!env->exists)
+		env->exists = real_exists;
+	if (!env->readlink)
+		env->readlink = real_readlink;
+	if (!env->write)
+		env->write = real_write;
+	if (!env->time)
+		env->time = real_time;
+	if (!env->clock)
+		env->clock = real_clock;
+	if (!env->log)
+		env->log = real_log;
+}
+
+FILE *source_open(birq_t *birq, const char *path)
+{
+	return birq->env.open(path, birq->env.udata);
+}
+
+DIR *source_opendir(birq_t *birq, const char *path)
+{
+	return birq->env.opendir(path, birq->env.udata);
+}
+
+int source_exists(birq_t *birq, const char *path)
+{
+	return birq->env.exists(path, birq->env.udata);
+}
+
+ssize_t source_readlink(birq_t *birq, const char *path, char *buf,
+	size_t size)
+{
+	return birq->env.readlink(path, buf, size, birq->env.udata);
+}
+
+int sink_write(birq_t *birq, const char *path, const char *buf)
+{
+	return birq->env.write(path, buf, birq->env.udata);
+}
+
+time_t birq_time(birq_t *birq)
+{
+	return birq->env.time(birq->env.udata);
+}
+
+unsigned long long birq_clock(birq_t *birq)
+{
+	return birq->env.clock(birq->env.udata);
+}
+
+/* The messages are dropped while the engine plans virtually, for
+   example on behalf of shadow policies. */
+void birq_log(birq_t *birq, int priority, const char *fmt, ...)
+{
+	char msg[1024];
+	va_list ap;
+
+	if (birq->quiet)
+		return;
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+	birq->env.log(priority, msg, birq->env.udata);
+}
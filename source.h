@@ -0,0 +1,26 @@
+#ifndef _source_h
+#define _source_h
+
+#include <stdio.h>
+#include <time.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <dirent.h>
+
+#include "libbirq.h"
+
+/* The engine accesses its environment through these functions only.
+   See birq_env_t. */
+void source_init(birq_env_t *env, const birq_env_t *user);
+FILE *source_open(birq_t *birq, const char *path);
+DIR *source_opendir(birq_t *birq, const char *path);
+int source_exists(birq_t *birq, const char *path);
+ssize_t source_readlink(birq_t *birq, const char *path, char *buf,
+	size_t size);
+int sink_write(birq_t *birq, const char *path, const char *buf);
+time_t birq_time(birq_t *birq);
+unsigned long long birq_clock(birq_t *birq);
+void birq_log(birq_t *birq, int priority, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+#endif
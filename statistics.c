@@ -9,17 +9,20 @@
 #include <dirent.h>
 #include <limits.h>
 #include <ctype.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "statistics.h"
 #include "cpu.h"
 #include "irq.h"
 #include "balance.h"
+#include "source.h"
 
 /* The setting of smp affinity is not reliable due to problems with some
  * APIC hw/driver. So we need to relink IRQs to CPUs on each iteration.
  * The linkage is based on current smp affinity value.
  */
-void link_irqs_to_cpus(lub_list_t *cpus, lub_list_t *irqs)
+void link_irqs_to_cpus(birq_t *birq, lub_list_t *cpus, lub_list_t *irqs)
 {
 	lub_list_node_t *iter;
 
@@ -38,29 +41,81 @@ void link_irqs_to_cpus(lub_list_t *cpus, lub_list_t *irqs)
 	for (iter = lub_list_iterator_init(irqs); iter;
 		iter = lub_list_iterator_next(iter)) {
 		irq_t *irq = (irq_t *)lub_list_node__get_data(iter);
-		int cpu_num;
 		cpu_t *cpu;
 
 		/* Ignore blacklisted IRQs */
 		if (irq->blacklisted)
 			continue;
-		/* Ignore IRQs with multi-affinity. */
-		if (cpus_weight(irq->affinity) > 1)
+		/* Ignore IRQs with multi-affinity. The small group mask
+		   written by birq is intended. Link such IRQ to the home
+		   CPU of group like planner does. */
+		if ((cpus_weight(irq->affinity) > 1) && !irq_intended(irq))
 			continue;
 
-		cpu_num = first_cpu(irq->affinity);
-		if (NR_CPUS == cpu_num) /* Something went wrong. No bits set. */
-			continue;
-		if (!(cpu = cpu_list_search(cpus, cpu_num)))
+		/* Something went wrong if no known CPU is set */
+		if (!(cpu = cpu_list_group_home(birq, cpus, &irq->affinity)))
 			continue;
 		move_irq_to_cpu(irq, cpu);
+		if (cpus_weight(irq->affinity) > 1)
+			cpus_copy(irq->group, irq->affinity);
+	}
+}
+
+/* Share interrupts of IRQ between CPUs it's delivered to. The IRQ
+   with group mask (see "granularity") is kept by the home CPU but the
+   kernel spreads its interrupts within the group. So the interrupts
+   are split evenly between the known group CPUs. Without "estimate"
+   the shares are added to CPU interrupt counters. Else the IRQ load
+   and its error are accumulated from the shares of CPU loads. */
+static void group_share(cpu_t *cpu, irq_t *irq, lub_list_t *cpus,
+	int estimate)
+{
+	lub_list_node_t *iter;
+	unsigned int num = 0;
+	float share;
+
+	if (cpus_weight(irq->group) > 1) {
+		for (iter = lub_list_iterator_init(cpus); iter;
+			iter = lub_list_iterator_next(iter)) {
+			cpu_t *member = (cpu_t *)lub_list_node__get_data(iter);
+			if (cpu_isset(member->id, irq->group))
+				num++;
+		}
+	}
+	/* Single CPU or the group doesn't contain known CPUs */
+	if (num < 2) {
+		if (!estimate) {
+			cpu->intr += irq->intr;
+		} else if (cpu->intr > 0) {
+			irq->load += cpu->load * irq->intr / cpu->intr;
+			irq->load_error += cpu->load_error * irq->intr / cpu->intr;
+		}
+		return;
+	}
+
+	share = (float)irq->intr / num;
+	for (iter = lub_list_iterator_init(cpus); iter;
+		iter = lub_list_iterator_next(iter)) {
+		cpu_t *member = (cpu_t *)lub_list_node__get_data(iter);
+		if (!cpu_isset(member->id, irq->group))
+			continue;
+		if (!estimate) {
+			member->intr += share;
+		} else if (member->intr > 0) {
+			irq->load += member->load * share / member->intr;
+			irq->load_error += member->load_error * share /
+				member->intr;
+		}
 	}
 }
 
 /* Gather load statistics for CPUs and number of interrupts
- * for current iteration.
+ * for current iteration. The virtual CPUs with steal time greater
+ * than steal_limit are avoided and evacuated. The steal_limit=0
+ * disables it.
  */
-void gather_statistics(lub_list_t *cpus, lub_list_t *irqs)
+void gather_statistics(birq_t *birq, lub_list_t *cpus, lub_list_t *irqs,
+	float steal_limit)
 {
 	FILE *file;
 	char *line = NULL;
@@ -80,10 +135,14 @@ void gather_statistics(lub_list_t *cpus, lub_list_t *irqs)
 	char *intr_str;
 	char *saveptr = NULL;
 	unsigned int inum = 0;
+	lub_list_node_t *iter;
+	unsigned long long stamp;
+	long hz;
 
-	file = fopen("/proc/stat", "r");
+	file = source_open(birq, "/proc/stat");
 	if (!file) {
-		fprintf(stderr, "Warning: Can't open /proc/stat. Balacing is broken.\n");
+		birq_log(birq, LOG_WARNING,
+			"Warning: Can't open /proc/stat. Balacing is broken.");
 		return;
 	}
 
@@ -91,11 +150,18 @@ void gather_statistics(lub_list_t *cpus, lub_list_t *irqs)
 	/* First line is the header. */
 	if (getline(&line, &size, file) == 0) {
 		free(line);
-		fprintf(stderr, "Warning: Can't read /proc/stat. Balancing is broken.\n");
+		birq_log(birq, LOG_WARNING,
+			"Warning: Can't read /proc/stat. Balancing is broken.");
 		fclose(file);
 		return;
 	}
 
+	/* The whole /proc/stat is read at once so one time stamp
+	   is enough for all CPUs. */
+	stamp = birq_clock(birq);
+	if ((hz = sysconf(_SC_CLK_TCK)) <= 0)
+		hz = 100;
+
 	cpucount = 0;
 	while (!feof(file)) {
 		cpu_t *cpu;
@@ -105,10 +171,11 @@ void gather_statistics(lub_list_t *cpus, lub_list_t *irqs)
 			break;
 		cpunr = strtoul(&line[3], NULL, 10);
 
-		cpu = cpu_list_search(cpus, cpunr);
-		if (!cpu)
+		/* The search uses table of CPUs built by scan_cpus() */
+		if (!(cpu = cpu_list_search(birq, cpus, cpunr)))
 			continue;
 
+		l_steal = l_guest = l_guest_nice = 0;
 		rc = sscanf(line, "%*s %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu",
 			&l_user, &l_nice, &l_system, &l_idle, &l_iowait,
 			&l_irq, &l_softirq, &l_steal, &l_guest, &l_guest_nice);
@@ -124,17 +191,55 @@ void gather_statistics(lub_list_t *cpus, lub_list_t *irqs)
 		if (cpu->old_load_all == 0) {
 			/* When old_load_all = 0 - it's first iteration */
 			cpu->load = 0;
+			cpu->load_error = 0;
 		} else {
 			float d_all = (float)(load_all - cpu->old_load_all);
 			float d_irq = (float)(load_irq - cpu->old_load_irq);
-			cpu->load = d_irq * 100 / d_all;
+			float d_steal = (float)(l_steal - cpu->old_load_steal);
+			float ticks = d_all;
+			/* The sum of counters is rounded to ticks and the
+			   sleep() jitters. The elapsed wall time is more
+			   precise denominator. Don't use it if it doesn't
+			   agree with counters (CPU was offline, the data
+			   source is not real). */
+			if (cpu->old_load_stamp && (stamp > cpu->old_load_stamp)) {
+				float wall = (float)(stamp - cpu->old_load_stamp) *
+					hz / 1000000;
+				float diff = (wall > d_all) ?
+					(wall - d_all) : (d_all - wall);
+				if (diff * 100 <= wall * STAT_WALL_TOLERANCE)
+					ticks = wall;
+			}
+			if (ticks > 0) {
+				cpu->load = d_irq * 100 / ticks;
+				cpu->steal = d_steal * 100 / ticks;
+				cpu->load_error = (float)STAT_TICK_ERROR * 100 / ticks;
+			} else {
+				cpu->load = 0;
+				cpu->steal = 0;
+				cpu->load_error = 0;
+			}
+			if (cpu->load > 100)
+				cpu->load = 100;
 		}
 
+		cpu->old_load_stamp = stamp;
 		cpu->old_load_all = load_all;
 		cpu->old_load_irq = load_irq;
+		cpu->old_load_steal = l_steal;
+
+		/* The hypervisor deschedules virtual CPU with high steal
+		   time. It's the worst target for IRQs. */
+		cpu->avoid &= ~CPU_AVOID_STEAL;
+		cpu->evacuate &= ~CPU_AVOID_STEAL;
+		if ((steal_limit > 0) && (cpu->steal >= steal_limit)) {
+			cpu->avoid |= CPU_AVOID_STEAL;
+			cpu->evacuate |= CPU_AVOID_STEAL;
+		}
 	}
 
-	/* Parse "intr" line. Get number of interrupts. */
+	/* Parse "intr" line. Get number of interrupts. The search uses
+	   table of IRQs kept by scan_irqs(). */
 	strtok_r(line, " ", &saveptr); /* String "intr" */
 	strtok_r(NULL, " ", &saveptr); /* Total number of interrupts */
 	for (intr_str = strtok_r(NULL, " ", &saveptr);
@@ -143,7 +248,7 @@ void gather_statistics(lub_list_t *cpus, lub_list_t *irqs)
 		char *endptr;
 		irq_t *irq;
 		
-		irq = irq_list_search(irqs, inum);
+		irq = irq_list_search(birq, irqs, inum);
 		inum++;
 		if (!irq)
 			continue;
@@ -159,11 +264,45 @@ void gather_statistics(lub_list_t *cpus, lub_list_t *irqs)
 
 	fclose(file);
 	free(line);
+
+	/* Estimate IRQ loads. The CPU load is shared between its IRQs
+	   due to number of interrupts. It's not precise (see NAPI). */
+	for (iter = lub_list_iterator_init(cpus); iter;
+		iter = lub_list_iterator_next(iter)) {
+		cpu_t *cpu = (cpu_t *)lub_list_node__get_data(iter);
+		cpu->intr = 0;
+	}
+	for (iter = lub_list_iterator_init(cpus); iter;
+		iter = lub_list_iterator_next(iter)) {
+		cpu_t *cpu = (cpu_t *)lub_list_node__get_data(iter);
+		lub_list_node_t *irq_iter;
+
+		for (irq_iter = lub_list_iterator_init(cpu->irqs); irq_iter;
+			irq_iter = lub_list_iterator_next(irq_iter)) {
+			irq_t *irq = (irq_t *)lub_list_node__get_data(irq_iter);
+			group_share(cpu, irq, cpus, 0);
+		}
+	}
+	for (iter = lub_list_iterator_init(cpus); iter;
+		iter = lub_list_iterator_next(iter)) {
+		cpu_t *cpu = (cpu_t *)lub_list_node__get_data(iter);
+		lub_list_node_t *irq_iter;
+
+		for (irq_iter = lub_list_iterator_init(cpu->irqs); irq_iter;
+			irq_iter = lub_list_iterator_next(irq_iter)) {
+			irq_t *irq = (irq_t *)lub_list_node__get_data(irq_iter);
+			irq->load = 0;
+			irq->load_error = 0;
+			group_share(cpu, irq, cpus, 1);
+		}
+	}
 }
 
-void show_statistics(lub_list_t *cpus, int verbose)
+void show_statistics(birq_t *birq, lub_list_t *cpus, int verbose)
 {
 	lub_list_node_t *iter;
+	char msg[256];
+	int len;
 
 	for (iter = lub_list_iterator_init(cpus); iter;
 		iter = lub_list_iterator_next(iter)) {
@@ -171,22 +310,37 @@ void show_statistics(lub_list_t *cpus, int verbose)
 		lub_list_node_t *irq_iter;
 
 		cpu = (cpu_t *)lub_list_node__get_data(iter);
-		printf("CPU%u package %u, core %u, irqs %d, old %.2f%%, load %.2f%%\n",
+		len = snprintf(msg, sizeof(msg),
+			"CPU%u package %u, core %u, irqs %d, old %.2f%%, load %.2f%%",
 			cpu->id, cpu->package_id, cpu->core_id,
 			lub_list_len(cpu->irqs), cpu->old_load, cpu->load);
+		if ((cpu->load_error > 0) && (len < (int)sizeof(msg)))
+			len += snprintf(msg + len, sizeof(msg) - len,
+				" +-%.2f%%", cpu->load_error);
+		if ((cpu->steal > 0) && (len < (int)sizeof(msg)))
+			len += snprintf(msg + len, sizeof(msg) - len,
+				", steal %.2f%%", cpu->steal);
+		birq_log(birq, LOG_INFO, "%s", msg);
 
 		if (!verbose)
 			continue;
 		for (irq_iter = lub_list_iterator_init(cpu->irqs); irq_iter;
 		irq_iter = lub_list_iterator_next(irq_iter)) {
 			char buf[NR_CPUS + 1];
+			char moved[32] = "";
 			irq_t *irq = (irq_t *)lub_list_node__get_data(irq_iter);
 			if (cpus_full(irq->affinity))
 				snprintf(buf, sizeof(buf), "*");
 			else
 				cpumask_scnprintf(buf, sizeof(buf), irq->affinity);
 			buf[sizeof(buf) - 1] = '\0';
-			printf("    IRQ %3u, [%s], weight %d, intr %llu, %s\n", irq->irq, buf, irq->weight, irq->intr, irq->desc);
+			if (irq->effect_time >= 0)
+				snprintf(moved, sizeof(moved), ", moved in %.2f ms",
+					irq->effect_time);
+			birq_log(birq, LOG_INFO,
+				"    IRQ %3u, [%s], weight %d, intr %llu%s, %s",
+				irq->irq, buf, irq->weight, irq->intr, moved,
+				irq->desc);
 		}
 	}
 }
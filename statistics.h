@@ -2,9 +2,19 @@
 #define _statistics_h
 
 #include "lub/list.h"
+#include "libbirq.h"
 
-void link_irqs_to_cpus(lub_list_t *cpus, lub_list_t *irqs);
-void gather_statistics(lub_list_t *cpus, lub_list_t *irqs);
-void show_statistics(lub_list_t *cpus, int verbose);
+/* The /proc/stat counters are in USER_HZ ticks. The IRQ load is the sum
+   of "irq" and "softirq" counters. Each of them is rounded by up to
+   one tick. */
+#define STAT_TICK_ERROR 2
+/* The elapsed wall time is used as load denominator if it differs from
+   the sum of CPU counters less than this value, in percents. */
+#define STAT_WALL_TOLERANCE 10
+
+void link_irqs_to_cpus(birq_t *birq, lub_list_t *cpus, lub_list_t *irqs);
+void gather_statistics(birq_t *birq, lub_list_t *cpus, lub_list_t *irqs,
+	float steal_limit);
+void show_statistics(birq_t *birq, lub_list_t *cpus, int verbose);
 
 #endif
@@ -0,0 +1,192 @@
+/* storm.c
+ * Detect interrupt storms and quarantine the stormy IRQs.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+
+#include "lub/list.h"
+#include "cpumask.h"
+#include "cpu.h"
+#include "irq.h"
+#include "balance.h"
+#include "storm.h"
+#include "source.h"
+
+storm_t *storm_new(void)
+{
+	storm_t *new;
+
+	if (!(new = malloc(sizeof(*new))))
+		return NULL;
+	new->last = 0;
+	new->storms = 0;
+	cpus_init(new->cpus);
+	cpus_clear(new->cpus);
+
+	return new;
+}
+
+void storm_free(storm_t *storm)
+{
+	if (!storm)
+		return;
+	cpus_free(storm->cpus);
+	free(storm);
+}
+
+/* Get number of unhandled interrupts from /proc/irq/<IRQ>/spurious */
+static int irq_get_unhandled(birq_t *birq, unsigned int num, unsigned long long *unhandled)
+{
+	char path[PATH_MAX];
+	char *line = NULL;
+	size_t size = 0;
+	FILE *fd;
+	int ret = -1;
+
+	snprintf(path, sizeof(path), "%s/%u/spurious", PROC_IRQ, num);
+	path[sizeof(path) - 1] = '\0';
+	if (!(fd = source_open(birq, path)))
+		return -1;
+	while (getline(&line, &size, fd) >= 0) {
+		if (sscanf(line, "unhandled %llu", unhandled) == 1) {
+			ret = 0;
+			break;
+		}
+	}
+	free(line);
+	fclose(fd);
+
+	return ret;
+}
+
+/* Find IRQs in storm. The storm is a rate spike relative to the usual
+   rate of IRQ or a lot of unhandled interrupts. Pin the stormy IRQ to
+   the quarantine CPU and hold it there while the storm lasts and for a
+   cooldown period. The quarantine CPU is excluded for other IRQs. */
+void storm_detect(birq_t *birq, storm_t *storm, lub_list_t *cpus, lub_list_t *irqs,
+	lub_list_t *balance_irqs, unsigned int rate_limit, int storm_cpu,
+	time_t now)
+{
+	lub_list_node_t *iter;
+	lub_list_node_t *node;
+	lub_list_t *storm_irqs;
+	cpu_t *quarantine = NULL;
+	time_t dt;
+
+	if (!storm)
+		return;
+	/* Detection is disabled. Release quarantined IRQs if any. */
+	if (!rate_limit) {
+		for (iter = lub_list_iterator_init(irqs);
+			storm->storms && iter;
+			iter = lub_list_iterator_next(iter)) {
+			irq_t *irq = (irq_t *)lub_list_node__get_data(iter);
+			if (!irq->storm)
+				continue;
+			irq->storm = 0;
+			irq->weight = 1;
+			lub_list_add(balance_irqs, irq);
+		}
+		storm->storms = 0;
+		storm->last = 0;
+		cpus_clear(storm->cpus);
+		return;
+	}
+	dt = now - storm->last;
+	if (!storm->last || (dt <= 0)) {
+		storm->last = now;
+		return;
+	}
+	storm->last = now;
+	if (storm_cpu >= 0)
+		quarantine = cpu_list_search(birq, cpus, storm_cpu);
+
+	storm_irqs = lub_list_new(irq_list_compare);
+	storm->storms = 0;
+	for (iter = lub_list_iterator_init(irqs); iter;
+		iter = lub_list_iterator_next(iter)) {
+		irq_t *irq = (irq_t *)lub_list_node__get_data(iter);
+		unsigned long long unhandled = 0;
+		unsigned long long new_unhandled = 0;
+		float rate;
+		int storming = 0;
+
+		if (irq->blacklisted)
+			continue;
+		rate = (float)irq->intr / dt;
+		if (!irq_get_unhandled(birq, irq->irq, &unhandled)) {
+			if (irq->old_unhandled <= unhandled)
+				new_unhandled = unhandled - irq->old_unhandled;
+			irq->old_unhandled = unhandled;
+		}
+
+		if (rate >= rate_limit) {
+			if ((irq->storm_samples >= STORM_WARMUP_TICKS) &&
+				(rate >= irq->usual_rate * STORM_SPIKE))
+				storming = 1;
+			/* The first sample of unhandled counter is not a delta */
+			if (irq->storm_samples &&
+				(new_unhandled >= irq->intr * STORM_UNHANDLED_RATIO))
+				storming = 1;
+		}
+
+		/* IRQ is in quarantine already */
+		if (irq->storm) {
+			if (storming)
+				irq->storm = STORM_COOLDOWN_TICKS;
+			else
+				irq->storm--;
+			if (!irq->storm) {
+				birq_log(birq, LOG_INFO, "IRQ %u storm is over", irq->irq);
+				/* Don't move this IRQ while next iteration. */
+				irq->weight = 1;
+				lub_list_add(balance_irqs, irq);
+				continue;
+			}
+			/* Don't move IRQ from quarantine */
+			irq->weight = 1;
+			storm->storms++;
+			continue;
+		}
+
+		if (!storming) {
+			if (!irq->storm_samples)
+				irq->usual_rate = rate;
+			else
+				irq->usual_rate += STORM_HISTORY_ALPHA *
+					(rate - irq->usual_rate);
+			if (irq->storm_samples < STORM_WARMUP_TICKS)
+				irq->storm_samples++;
+			continue;
+		}
+
+		birq_log(birq, LOG_INFO,
+			"IRQ %u interrupt storm: %.0f intr/s (usual %.0f), %llu unhandled, %s",
+			irq->irq, rate, irq->usual_rate, new_unhandled,
+			irq->desc ? irq->desc : "");
+		irq->storm = STORM_COOLDOWN_TICKS;
+		irq->weight = 1;
+		storm->storms++;
+		if (!quarantine || (irq->cpu == quarantine))
+			continue;
+		birq_log(birq, LOG_INFO, "Quarantine IRQ %u to CPU%u",
+			irq->irq, quarantine->id);
+		move_irq_to_cpu(irq, quarantine);
+		lub_list_add(storm_irqs, irq);
+	}
+
+	/* Write quarantine affinity */
+	apply_affinity(birq, storm_irqs);
+	while ((node = lub_list__get_tail(storm_irqs))) {
+		lub_list_del(storm_irqs, node);
+		lub_list_node_free(node);
+	}
+	lub_list_free(storm_irqs);
+
+	cpus_clear(storm->cpus);
+	if (quarantine && storm->storms)
+		cpu_set(quarantine->id, storm->cpus);
+}
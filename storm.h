@@ -0,0 +1,33 @@
+#ifndef _storm_h
+#define _storm_h
+
+#include <time.h>
+#include "lub/list.h"
+#include "cpumask.h"
+#include "libbirq.h"
+
+/* The IRQ is in storm when its rate is this times higher than usual */
+#define STORM_SPIKE 10
+/* Iterations to learn the usual rate of IRQ before storm detection */
+#define STORM_WARMUP_TICKS 5
+/* Weight of the last rate within the usual rate of IRQ */
+#define STORM_HISTORY_ALPHA 0.1
+/* The IRQ is in storm when this part of interrupts is unhandled */
+#define STORM_UNHANDLED_RATIO 0.1
+/* Iterations to hold IRQ on the quarantine CPU after the storm */
+#define STORM_COOLDOWN_TICKS 30
+
+struct storm_s {
+	time_t last; /* Time of previous detection */
+	unsigned int storms; /* Number of IRQs in storm now */
+	cpumask_t cpus; /* Quarantine CPU while there are storms */
+};
+typedef struct storm_s storm_t;
+
+storm_t *storm_new(void);
+void storm_free(storm_t *storm);
+void storm_detect(birq_t *birq, storm_t *storm, lub_list_t *cpus, lub_list_t *irqs,
+	lub_list_t *balance_irqs, unsigned int rate_limit, int storm_cpu,
+	time_t now);
+
+#endif
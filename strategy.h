@@ -0,0 +1,66 @@
+#ifndef _strategy_h
+#define _strategy_h
+
+/* The ABI of loadable strategy modules. The strategy is a pure function
+   from a read-only snapshot of CPUs and IRQs to a list of proposed
+   moves. The module must export "birq_strategy" symbol of type
+   birq_strategy_t. This header doesn't depend on other birq headers. */
+
+#define BIRQ_STRATEGY_ABI 2
+/* Symbol to export from module */
+#define BIRQ_STRATEGY_SYMBOL "birq_strategy"
+
+struct birq_cpu_info_s {
+	unsigned int id; /* Logical processor ID */
+	unsigned int package_id;
+	unsigned int core_id;
+	unsigned int capacity; /* Relative capacity. Max is 1024 */
+	float load; /* Current IRQ load in percents */
+	float load_norm; /* Load normalized by capacity and steal time */
+	float steal; /* Time stolen by hypervisor in percents */
+	int excluded; /* Don't move IRQs to this CPU */
+	int avoid; /* Use other CPUs if possible: throttled, RT tasks etc. */
+	int full; /* CPU has run out of IRQ vectors. Moves are ignored */
+};
+typedef struct birq_cpu_info_s birq_cpu_info_t;
+
+struct birq_irq_info_s {
+	unsigned int irq; /* IRQ number */
+	int cpu; /* Index of current CPU within snapshot. -1 - unknown */
+	unsigned long long intr; /* Number of interrupts for last iteration */
+	float load; /* Estimated part of CPU load, in percents */
+	int movable; /* The IRQ can be moved now */
+	const char *desc; /* IRQ description */
+	const unsigned char *local; /* Array of cpu_num flags. 1 - local CPU */
+};
+typedef struct birq_irq_info_s birq_irq_info_t;
+
+struct birq_snapshot_s {
+	unsigned int cpu_num;
+	const birq_cpu_info_t *cpus;
+	unsigned int irq_num;
+	const birq_irq_info_t *irqs;
+	float threshold; /* CPU is overloaded if its load is greater */
+	float load_limit; /* Don't move IRQs to CPUs loaded more */
+};
+typedef struct birq_snapshot_s birq_snapshot_t;
+
+/* Proposed move. Indexes within snapshot arrays */
+struct birq_move_s {
+	unsigned int irq;
+	unsigned int cpu;
+};
+typedef struct birq_move_s birq_move_t;
+
+/* Fill moves array (max_moves entries) and return number of moves */
+typedef unsigned int (*birq_plan_fn)(const birq_snapshot_t *snapshot,
+	birq_move_t *moves, unsigned int max_moves);
+
+struct birq_strategy_s {
+	unsigned int abi; /* BIRQ_STRATEGY_ABI */
+	const char *name;
+	birq_plan_fn plan;
+};
+typedef struct birq_strategy_s birq_strategy_t;
+
+#endif
@@ -0,0 +1,205 @@
+/* tasks.c
+ * Find CPUs running real-time or latency-critical tasks.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <limits.h>
+#include <ctype.h>
+#include <sched.h>
+
+#include "lub/list.h"
+#include "cpu.h"
+#include "tasks.h"
+#include "source.h"
+
+#ifndef SCHED_DEADLINE
+#define SCHED_DEADLINE 6
+#endif
+
+/* Fields of /proc/<pid>/task/<tid>/stat counted after the command name.
+   The command name is a field number 2. */
+#define STAT_FLAGS (9 - 3)
+#define STAT_PROCESSOR (39 - 3)
+#define STAT_POLICY (41 - 3)
+
+/* The task is kernel thread. See include/linux/sched.h */
+#define PF_KTHREAD 0x00200000
+
+/* Check if process belongs to one of comma separated cgroups */
+int task_in_cgroups(birq_t *birq, const char *pid, const char *cgroups)
+{
+	char path[PATH_MAX];
+	FILE *fd;
+	char *str = NULL;
+	size_t sz;
+	int found = 0;
+
+	snprintf(path, sizeof(path), "%s/%s/cgroup", PROC_PATH, pid);
+	path[sizeof(path) - 1] = '\0';
+	if (!(fd = source_open(birq, path)))
+		return 0;
+	while (!found && (getline(&str, &sz, fd) >= 0)) {
+		const char *pattern;
+		for (pattern = cgroups; *pattern && !found; ) {
+			size_t len = strcspn(pattern, ",");
+			char *cgroup;
+			if (len) {
+				cgroup = strndup(pattern, len);
+				found = (strstr(str, cgroup) != NULL);
+				free(cgroup);
+			}
+			pattern += len;
+			if (*pattern == ',')
+				pattern++;
+		}
+	}
+	free(str);
+	fclose(fd);
+
+	return found;
+}
+
+/* Get scheduling policy and last used CPU of thread */
+int task_stat(birq_t *birq, const char *pid, const char *tid,
+	unsigned int *processor, unsigned int *policy)
+{
+	char path[PATH_MAX];
+	FILE *fd;
+	char *str = NULL;
+	size_t sz;
+	char *tok;
+	char *saveptr = NULL;
+	unsigned int field;
+	int ret = -1;
+
+	snprintf(path, sizeof(path), "%s/%s/task/%s/stat",
+		PROC_PATH, pid, tid);
+	path[sizeof(path) - 1] = '\0';
+	if (!(fd = source_open(birq, path)))
+		return -1;
+	if (getline(&str, &sz, fd) < 0)
+		goto err;
+	/* The command name can contain spaces and braces */
+	if (!(tok = strrchr(str, ')')))
+		goto err;
+	tok++;
+	for (field = 0, tok = strtok_r(tok, " ", &saveptr); tok;
+		field++, tok = strtok_r(NULL, " ", &saveptr)) {
+		if (field == STAT_PROCESSOR)
+			*processor = strtoul(tok, NULL, 10);
+		if (field == STAT_POLICY) {
+			*policy = strtoul(tok, NULL, 10);
+			ret = 0;
+			break;
+		}
+	}
+err:
+	free(str);
+	fclose(fd);
+
+	return ret;
+}
+
+/* Check if process is kernel thread. Every system has per-CPU kernel
+   threads with real-time policy (migration/N, irq/N-*, rcu). They
+   are not the tasks to protect. */
+static int task_kthread(birq_t *birq, const char *pid)
+{
+	char path[PATH_MAX];
+	FILE *fd;
+	char *str = NULL;
+	size_t sz;
+	char *tok;
+	char *saveptr = NULL;
+	unsigned int field;
+	int kthread = 0;
+
+	snprintf(path, sizeof(path), "%s/%s/stat", PROC_PATH, pid);
+	path[sizeof(path) - 1] = '\0';
+	if (!(fd = source_open(birq, path)))
+		return 0;
+	if ((getline(&str, &sz, fd) >= 0) && (tok = strrchr(str, ')'))) {
+		tok++;
+		for (field = 0, tok = strtok_r(tok, " ", &saveptr); tok;
+			field++, tok = strtok_r(NULL, " ", &saveptr)) {
+			if (field == STAT_FLAGS) {
+				kthread = !!(strtoul(tok, NULL, 10) & PF_KTHREAD);
+				break;
+			}
+		}
+	}
+	free(str);
+	fclose(fd);
+
+	return kthread;
+}
+
+/* Scan tasks to find CPUs running real-time tasks (SCHED_FIFO, SCHED_RR,
+   SCHED_DEADLINE) or tasks from specified cgroups. Don't move IRQs
+   to such CPUs if possible. The CPU is the last CPU the thread ran on.
+   The kernel threads are ignored. */
+void scan_tasks(birq_t *birq, lub_list_t *cpus, int rt, const char *cgroups)
+{
+	lub_list_node_t *iter;
+	DIR *dir;
+	struct dirent *dent;
+
+	for (iter = lub_list_iterator_init(cpus); iter;
+		iter = lub_list_iterator_next(iter)) {
+		cpu_t *cpu = (cpu_t *)lub_list_node__get_data(iter);
+		cpu->avoid &= ~CPU_AVOID_RT;
+	}
+	if (!rt && !cgroups)
+		return;
+
+	if (!(dir = source_opendir(birq, PROC_PATH)))
+		return;
+	while ((dent = readdir(dir))) {
+		char path[PATH_MAX];
+		DIR *task_dir;
+		struct dirent *tent;
+		int critical;
+
+		if (!isdigit(dent->d_name[0]))
+			continue;
+		if (task_kthread(birq, dent->d_name))
+			continue;
+		critical = cgroups && task_in_cgroups(birq, dent->d_name, cgroups);
+		if (!critical && !rt)
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s/task",
+			PROC_PATH, dent->d_name);
+		path[sizeof(path) - 1] = '\0';
+		if (!(task_dir = source_opendir(birq, path)))
+			continue;
+		while ((tent = readdir(task_dir))) {
+			unsigned int processor = 0;
+			unsigned int policy = SCHED_OTHER;
+			cpu_t *cpu;
+
+			if (!isdigit(tent->d_name[0]))
+				continue;
+			if (task_stat(birq, dent->d_name, tent->d_name,
+				&processor, &policy))
+				continue;
+			if (!critical && (policy != SCHED_FIFO) &&
+				(policy != SCHED_RR) &&
+				(policy != SCHED_DEADLINE))
+				continue;
+			if (!(cpu = cpu_list_search(birq, cpus, processor)))
+				continue;
+			if (!(cpu->avoid & CPU_AVOID_RT))
+				birq_log(birq, LOG_INFO,
+					"CPU%u runs latency-critical task %s",
+					cpu->id, tent->d_name);
+			cpu->avoid |= CPU_AVOID_RT;
+		}
+		closedir(task_dir);
+	}
+	closedir(dir);
+}
@@ -0,0 +1,14 @@
+#ifndef _tasks_h
+#define _tasks_h
+
+#include "lub/list.h"
+#include "libbirq.h"
+
+#define PROC_PATH "/proc"
+
+int task_in_cgroups(birq_t *birq, const char *pid, const char *cgroups);
+int task_stat(birq_t *birq, const char *pid, const char *tid,
+	unsigned int *processor, unsigned int *policy);
+void scan_tasks(birq_t *birq, lub_list_t *cpus, int rt, const char *cgroups);
+
+#endif
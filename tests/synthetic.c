@@ -0,0 +1,542 @@
+/* synthetic.c
+ * Drive the engine with synthetic procfs and sysfs. The data source
+ * maps real paths to the temporary tree. The sink writes to the same
+ * tree so the test can check the placement.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <ftw.h>
+
+#include "libbirq.h"
+
+static char root[PATH_MAX];
+
+/* Max number of CPUs within scenario */
+#define TEST_MAX_CPUS 32
+
+/* Burst of new IRQs on many CPUs */
+#define BURST_CPUS 16
+#define BURST_IRQS 64
+#define BURST_FIRST_IRQ 100
+/* Max excess of p2c imbalance over full scan one, IRQs. The random
+   placement of this burst gives about 9. */
+#define BURST_TOLERANCE 5
+
+/* Global placement of IRQs without load */
+#define SPREAD_CPUS 4
+#define SPREAD_IRQS 8
+#define SPREAD_FIRST_IRQ 200
+
+static void tree_path(const char *path, char *buf, size_t size)
+{
+	snprintf(buf, size, "%s%s", root, path);
+	buf[size - 1] = '\0';
+}
+
+static FILE *test_open(const char *path, void *udata)
+{
+	char buf[PATH_MAX];
+
+	(void)udata;
+	tree_path(path, buf, sizeof(buf));
+	return fopen(buf, "r");
+}
+
+static DIR *test_opendir(const char *path, void *udata)
+{
+	char buf[PATH_MAX];
+
+	(void)udata;
+	tree_path(path, buf, sizeof(buf));
+	return opendir(buf);
+}
+
+static int test_exists(const char *path, void *udata)
+{
+	char buf[PATH_MAX];
+
+	(void)udata;
+	tree_path(path, buf, sizeof(buf));
+	return !access(buf, F_OK);
+}
+
+static ssize_t test_readlink(const char *path, char *buf, size_t size,
+	void *udata)
+{
+	char link[PATH_MAX];
+
+	(void)udata;
+	tree_path(path, link, sizeof(link));
+	return readlink(link, buf, size);
+}
+
+static int test_write(const char *path, const char *buf, void *udata)
+{
+	char file[PATH_MAX];
+	FILE *fd;
+
+	(void)udata;
+	tree_path(path, file, sizeof(file));
+	if (!(fd = fopen(file, "w")))
+		return 1;
+	fputs(buf, fd);
+	fclose(fd);
+
+	return 0;
+}
+
+/* Log is quiet. The test reports the results only. */
+static void test_log(int priority, const char *msg, void *udata)
+{
+	(void)priority;
+	(void)msg;
+	(void)udata;
+}
+
+static const birq_env_t test_env = {
+	test_open,
+	test_opendir,
+	test_exists,
+	test_readlink,
+	test_write,
+	NULL,
+	NULL,
+	test_log,
+	NULL
+};
+
+static int remove_entry(const char *path, const struct stat *st,
+	int flag, struct FTW *ftw)
+{
+	(void)st;
+	(void)flag;
+	(void)ftw;
+	return remove(path);
+}
+
+/* Create all directories of path and write file content */
+static void put(const char *path, const char *content)
+{
+	char buf[PATH_MAX];
+	char *p;
+	FILE *fd;
+
+	tree_path(path, buf, sizeof(buf));
+	for (p = buf + strlen(root) + 1; (p = strchr(p, '/')); p++) {
+		*p = '\0';
+		mkdir(buf, 0755);
+		*p = '/';
+	}
+	if (!content) {
+		mkdir(buf, 0755);
+		return;
+	}
+	if (!(fd = fopen(buf, "w"))) {
+		perror(buf);
+		exit(1);
+	}
+	fputs(content, fd);
+	fclose(fd);
+}
+
+static void get(const char *path, char *content, size_t size)
+{
+	char buf[PATH_MAX];
+	FILE *fd;
+
+	content[0] = '\0';
+	tree_path(path, buf, sizeof(buf));
+	if (!(fd = fopen(buf, "r")))
+		return;
+	if (!fgets(content, size, fd))
+		content[0] = '\0';
+	content[strcspn(content, "\n")] = '\0';
+	fclose(fd);
+}
+
+/* Write /proc/stat with idle and IRQ ticks of CPUs. The columns of
+   "intr" line are IRQ numbers. */
+static void put_stat(unsigned long long idle0, unsigned long long irq0,
+	unsigned long long idle1, unsigned long long irq1,
+	unsigned long long intr30, unsigned long long intr31)
+{
+	char buf[1024];
+	int len;
+	int i;
+
+	len = snprintf(buf, sizeof(buf),
+		"cpu  0 0 0 0 0 0 0 0 0 0\n"
+		"cpu0 0 0 0 %llu 0 %llu 0 0 0 0\n"
+		"cpu1 0 0 0 %llu 0 %llu 0 0 0 0\n"
+		"intr %llu",
+		idle0, irq0, idle1, irq1, intr30 + intr31);
+	for (i = 0; i < 30; i++)
+		len += snprintf(buf + len, sizeof(buf) - len, " 0");
+	snprintf(buf + len, sizeof(buf) - len, " %llu %llu\nctxt 0\n",
+		intr30, intr31);
+	put("/proc/stat", buf);
+}
+
+/* Create the tree of CPUs. Each CPU is a separate core. */
+static void put_cpus(unsigned int num)
+{
+	unsigned int i;
+
+	for (i = 0; i < num; i++) {
+		char path[PATH_MAX];
+		char val[16];
+		snprintf(path, sizeof(path),
+			"/sys/devices/system/cpu/cpu%u/topology/physical_package_id", i);
+		put(path, "0\n");
+		snprintf(path, sizeof(path),
+			"/sys/devices/system/cpu/cpu%u/topology/core_id", i);
+		snprintf(val, sizeof(val), "%u\n", i);
+		put(path, val);
+		snprintf(path, sizeof(path),
+			"/sys/devices/system/cpu/cpu%u/topology/thread_siblings", i);
+		snprintf(val, sizeof(val), "%lx\n", 1UL << i);
+		put(path, val);
+	}
+	put("/sys/bus/pci/devices", NULL);
+}
+
+/* Write /proc/interrupts with IRQs first..first+num-1. All the
+   interrupts are counted on CPU0. */
+static void put_interrupts(unsigned int cpus, unsigned int first,
+	unsigned int num, unsigned long long intr)
+{
+	char buf[16384];
+	int len = 0;
+	unsigned int i;
+	unsigned int j;
+
+	for (j = 0; j < cpus; j++)
+		len += snprintf(buf + len, sizeof(buf) - len, "%sCPU%u",
+			j ? "       " : "           ", j);
+	len += snprintf(buf + len, sizeof(buf) - len, "\n");
+	for (i = first; i < first + num; i++) {
+		len += snprintf(buf + len, sizeof(buf) - len,
+			"%4u: %10llu", i, intr);
+		for (j = 1; j < cpus; j++)
+			len += snprintf(buf + len, sizeof(buf) - len, " %10u", 0);
+		len += snprintf(buf + len, sizeof(buf) - len,
+			"   PCI-MSI %u-edge      dev-%u\n", i, i);
+	}
+	put("/proc/interrupts", buf);
+}
+
+/* Write /proc/stat of idle CPUs. The IRQs first..first+num-1 have
+   intr interrupts each. */
+static void put_stat_idle(unsigned int cpus, unsigned long long idle,
+	unsigned int first, unsigned int num, unsigned long long intr)
+{
+	char buf[16384];
+	int len;
+	unsigned int i;
+
+	len = snprintf(buf, sizeof(buf), "cpu  0 0 0 0 0 0 0 0 0 0\n");
+	for (i = 0; i < cpus; i++)
+		len += snprintf(buf + len, sizeof(buf) - len,
+			"cpu%u 0 0 0 %llu 0 0 0 0 0 0\n", i, idle);
+	len += snprintf(buf + len, sizeof(buf) - len, "intr %llu", intr * num);
+	for (i = 0; i < first + num; i++)
+		len += snprintf(buf + len, sizeof(buf) - len, " %llu",
+			(i < first) ? 0 : intr);
+	snprintf(buf + len, sizeof(buf) - len, "\nctxt 0\n");
+	put("/proc/stat", buf);
+}
+
+/* Get CPU of IRQ from the written affinity. Returns -1 if affinity
+   is not a single CPU. */
+static int get_irq_cpu(unsigned int num)
+{
+	char path[PATH_MAX];
+	char affinity[64];
+	unsigned long mask;
+	int cpu;
+
+	snprintf(path, sizeof(path), "/proc/irq/%u/smp_affinity", num);
+	get(path, affinity, sizeof(affinity));
+	mask = strtoul(affinity, NULL, 16);
+	if (!mask || (mask & (mask - 1)))
+		return -1;
+	for (cpu = 0; !(mask & 1); cpu++)
+		mask >>= 1;
+
+	return cpu;
+}
+
+static int tree_new(void)
+{
+	snprintf(root, sizeof(root), "/tmp/birq-test.XXXXXX");
+	if (!mkdtemp(root)) {
+		perror("mkdtemp");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void tree_free(void)
+{
+	nftw(root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static birq_t *engine_new(const birq_config_t *cfg)
+{
+	birq_t *birq;
+
+	if (!(birq = birq_new(&test_env, 1, NULL))) {
+		fprintf(stderr, "Error: Can't create engine\n");
+		return NULL;
+	}
+	if (birq_configure(birq, cfg) < 0) {
+		fprintf(stderr, "Error: Can't configure engine\n");
+		birq_free(birq);
+		return NULL;
+	}
+
+	return birq;
+}
+
+/* CPU0 is overloaded by IRQs. The heaviest IRQ must go to idle CPU1. */
+static int test_overload(void)
+{
+	birq_config_t cfg;
+	birq_t *birq;
+	char affinity[64];
+	unsigned long mask;
+	int ret = 0;
+
+	if (tree_new())
+		return 1;
+
+	/* Two CPUs on different cores and IRQs 30, 31 on CPU0 */
+	put_cpus(2);
+	put("/proc/interrupts",
+		"           CPU0       CPU1\n"
+		" 30:        100          0   PCI-MSI 1-edge      eth0-rx-0\n"
+		" 31:         10          0   PCI-MSI 2-edge      eth0-tx-0\n");
+	put("/proc/irq/30/smp_affinity", "1\n");
+	put("/proc/irq/31/smp_affinity", "1\n");
+
+	birq_config_init(&cfg);
+	cfg.threshold = 50;
+	cfg.strategy = BIRQ_CHOOSE_MAX;
+	cfg.tasks_interval = 1000;
+	if (!(birq = engine_new(&cfg))) {
+		tree_free();
+		return 1;
+	}
+
+	/* The first tick takes the baseline */
+	put_stat(1000, 0, 1000, 0, 100, 10);
+	birq_tick(birq);
+
+	/* CPU0 is 90% loaded by IRQs. The heaviest IRQ 30 must go
+	   to idle CPU1. */
+	put_stat(1100, 900, 2000, 0, 1100, 20);
+	birq_tick(birq);
+
+	get("/proc/irq/30/smp_affinity", affinity, sizeof(affinity));
+	mask = strtoul(affinity, NULL, 16);
+	if (mask != 0x2) {
+		fprintf(stderr, "Error: IRQ 30 affinity is \"%s\", "
+			"expected CPU1\n", affinity);
+		ret = 1;
+	} else {
+		printf("IRQ 30 is moved to CPU1\n");
+	}
+
+	birq_free(birq);
+	tree_free();
+
+	return ret;
+}
+
+/* Get max-min imbalance of IRQ number per CPU for IRQs
+   first..first+num-1. Returns -1 if some IRQ is not placed to
+   single CPU. */
+static int irq_imbalance(unsigned int cpus, unsigned int first,
+	unsigned int num)
+{
+	unsigned int count[TEST_MAX_CPUS];
+	unsigned int min;
+	unsigned int max;
+	unsigned int i;
+
+	memset(count, 0, sizeof(count));
+	for (i = first; i < first + num; i++) {
+		int cpu = get_irq_cpu(i);
+		if (cpu < 0) {
+			fprintf(stderr, "Error: IRQ %u is not placed\n", i);
+			return -1;
+		}
+		count[cpu]++;
+	}
+	min = max = count[0];
+	for (i = 1; i < cpus; i++) {
+		if (count[i] < min)
+			min = count[i];
+		if (count[i] > max)
+			max = count[i];
+	}
+
+	return max - min;
+}
+
+/* Place the burst of new IRQs on many idle CPUs with the given CPU
+   strategy. Returns max-min imbalance of IRQ number per CPU or -1 on
+   error. */
+static int burst_imbalance(birq_cpu_strategy_e strategy,
+	unsigned int cpus, unsigned int irqs)
+{
+	birq_config_t cfg;
+	birq_t *birq;
+	unsigned int i;
+	int tick;
+	int ret;
+
+	if (tree_new())
+		return -1;
+	put_cpus(cpus);
+	for (i = 0; i < irqs; i++) {
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path),
+			"/proc/irq/%u/smp_affinity", BURST_FIRST_IRQ + i);
+		put(path, "ffffffff\n");
+	}
+
+	birq_config_init(&cfg);
+	cfg.cpu_strategy = strategy;
+	cfg.tasks_interval = 1000;
+	if (!(birq = engine_new(&cfg))) {
+		tree_free();
+		return -1;
+	}
+	/* The IRQs with wide affinity are placed when they have
+	   interrupts. The interrupt counter grows each tick. */
+	for (tick = 1; tick <= 3; tick++) {
+		put_interrupts(cpus, BURST_FIRST_IRQ, irqs, tick * 100);
+		put_stat_idle(cpus, tick * 1000, BURST_FIRST_IRQ, irqs,
+			tick * 100);
+		birq_tick(birq);
+	}
+
+	ret = irq_imbalance(cpus, BURST_FIRST_IRQ, irqs);
+
+	birq_free(birq);
+	tree_free();
+
+	return ret;
+}
+
+/* The "p2c" CPU strategy samples random CPUs so it can't be as even as
+   full scan. But the burst of new IRQs must not gather on a few CPUs.
+   The power of two choices keeps the imbalance much lower than random
+   placement does. */
+static int test_p2c_burst(void)
+{
+	int min;
+	int p2c;
+
+	srand(1);
+	if ((min = burst_imbalance(BIRQ_CPU_MIN, BURST_CPUS, BURST_IRQS)) < 0)
+		return 1;
+	if ((p2c = burst_imbalance(BIRQ_CPU_P2C, BURST_CPUS, BURST_IRQS)) < 0)
+		return 1;
+	if (p2c > min + BURST_TOLERANCE) {
+		fprintf(stderr, "Error: p2c imbalance is %d IRQs, "
+			"min imbalance is %d IRQs\n", p2c, min);
+		return 1;
+	}
+	printf("Burst of %u IRQs on %u CPUs: p2c imbalance %d, min imbalance %d\n",
+		BURST_IRQS, BURST_CPUS, p2c, min);
+
+	return 0;
+}
+
+/* Global placement of IRQs with wide affinity on idle CPUs. The IRQs
+   have no measured load but each placed IRQ costs something. So the
+   IRQs must be spread evenly instead of landing on the same CPU. Both
+   single CPU and core group granularity are checked. */
+static int place_spread(const char *granularity)
+{
+	birq_config_t cfg;
+	birq_t *birq;
+	unsigned int i;
+	int ret;
+
+	if (tree_new())
+		return -1;
+	put_cpus(SPREAD_CPUS);
+	for (i = 0; i < SPREAD_IRQS; i++) {
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path),
+			"/proc/irq/%u/smp_affinity", SPREAD_FIRST_IRQ + i);
+		put(path, "ffffffff\n");
+	}
+
+	birq_config_init(&cfg);
+	cfg.granularity = granularity;
+	if (!(birq = engine_new(&cfg))) {
+		tree_free();
+		return -1;
+	}
+	/* Counters must grow between two calibrations */
+	put_interrupts(SPREAD_CPUS, SPREAD_FIRST_IRQ, SPREAD_IRQS, 100);
+	put_stat_idle(SPREAD_CPUS, 1000, SPREAD_FIRST_IRQ, SPREAD_IRQS, 100);
+	birq_calibrate(birq);
+	put_interrupts(SPREAD_CPUS, SPREAD_FIRST_IRQ, SPREAD_IRQS, 200);
+	put_stat_idle(SPREAD_CPUS, 2000, SPREAD_FIRST_IRQ, SPREAD_IRQS, 200);
+	birq_calibrate(birq);
+	birq_place(birq, NULL);
+
+	ret = irq_imbalance(SPREAD_CPUS, SPREAD_FIRST_IRQ, SPREAD_IRQS);
+
+	birq_free(birq);
+	tree_free();
+
+	return ret;
+}
+
+static int test_place_spread(void)
+{
+	const char *gran[] = { "cpu", "core" };
+	unsigned int i;
+	int ret = 0;
+
+	for (i = 0; i < sizeof(gran) / sizeof(gran[0]); i++) {
+		int imbalance = place_spread(gran[i]);
+		if (imbalance < 0)
+			return 1;
+		if (imbalance > 1) {
+			fprintf(stderr, "Error: Placement imbalance is %d IRQs "
+				"with \"%s\" granularity\n", imbalance, gran[i]);
+			ret = 1;
+			continue;
+		}
+		printf("Placement of %u IRQs on %u CPUs with \"%s\" "
+			"granularity: imbalance %d\n",
+			SPREAD_IRQS, SPREAD_CPUS, gran[i], imbalance);
+	}
+
+	return ret;
+}
+
+int main(void)
+{
+	int ret = 0;
+
+	ret |= test_overload();
+	ret |= test_p2c_burst();
+	ret |= test_place_spread();
+
+	return ret;
+}
@@ -0,0 +1,64 @@
+/* thermal.c
+ * Find thermally throttled CPUs.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "lub/list.h"
+#include "cpu.h"
+#include "thermal.h"
+#include "source.h"
+
+/* Sample the thermal throttle counters and the current frequency of
+   CPUs. The CPU is throttled while its throttle count rises. Don't
+   move IRQs to throttled CPUs if possible and move heavy IRQs away from
+   CPUs that are throttled for a long time. */
+void gather_thermal(birq_t *birq, lub_list_t *cpus, int enabled)
+{
+	lub_list_node_t *iter;
+
+	for (iter = lub_list_iterator_init(cpus); iter;
+		iter = lub_list_iterator_next(iter)) {
+		cpu_t *cpu = (cpu_t *)lub_list_node__get_data(iter);
+		unsigned long core = 0;
+		unsigned long package = 0;
+		unsigned long freq;
+		unsigned long long count;
+		int found = 0;
+
+		cpu->avoid &= ~CPU_AVOID_THERMAL;
+		cpu->evacuate &= ~CPU_AVOID_THERMAL;
+		if (!enabled)
+			continue;
+		if (!cpu_read_ulong(birq, cpu->id,
+			"thermal_throttle/core_throttle_count", &core))
+			found = 1;
+		if (!cpu_read_ulong(birq, cpu->id,
+			"thermal_throttle/package_throttle_count", &package))
+			found = 1;
+		if (!cpu_read_ulong(birq, cpu->id, "cpufreq/scaling_cur_freq", &freq))
+			cpu->cur_freq = freq;
+		if (!found)
+			continue;
+
+		count = (unsigned long long)core + package;
+		if ((cpu->old_throttle != (unsigned long long)(-1)) &&
+			(count > cpu->old_throttle))
+			cpu->throttle_ticks++;
+		else
+			cpu->throttle_ticks = 0;
+		cpu->old_throttle = count;
+
+		if (!cpu->throttle_ticks)
+			continue;
+		if (cpu->throttle_ticks == 1)
+			birq_log(birq, LOG_INFO,
+				"CPU%u is thermally throttled, frequency %lu MHz",
+				cpu->id, cpu->cur_freq / 1000);
+		cpu->avoid |= CPU_AVOID_THERMAL;
+		if (cpu->throttle_ticks >= THERMAL_EVACUATE_TICKS)
+			cpu->evacuate |= CPU_AVOID_THERMAL;
+	}
+}
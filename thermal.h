@@ -0,0 +1,13 @@
+#ifndef _thermal_h
+#define _thermal_h
+
+#include "lub/list.h"
+#include "libbirq.h"
+
+/* Move heavy IRQs away from CPU when the throttle count rises for
+   this number of iterations. */
+#define THERMAL_EVACUATE_TICKS 2
+
+void gather_thermal(birq_t *birq, lub_list_t *cpus, int enabled);
+
+#endif
@@ -0,0 +1,290 @@
+/* verify.c
+ * Check the new IRQ affinity really takes effect.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <limits.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "lub/list.h"
+#include "cpumask.h"
+#include "cpu.h"
+#include "irq.h"
+#include "verify.h"
+#include "source.h"
+#include "probes.h"
+
+/* Read /proc/irq/<IRQ>/effective_affinity. Old kernels and some
+   architectures don't have it. */
+static int irq_get_effective(birq_t *birq, irq_t *irq, cpumask_t *cpumask)
+{
+	char path[PATH_MAX];
+	FILE *fd;
+	char *str = NULL;
+	size_t sz;
+
+	snprintf(path, sizeof(path),
+		"%s/%u/effective_affinity", PROC_IRQ, irq->irq);
+	path[sizeof(path) - 1] = '\0';
+	if (!(fd = source_open(birq, path)))
+		return -1;
+	if (getline(&str, &sz, fd) < 0) {
+		fclose(fd);
+		free(str);
+		return -1;
+	}
+	fclose(fd);
+	cpumask_parse_user(str, strlen(str), *cpumask);
+	free(str);
+
+	return 0;
+}
+
+/* The modes of /proc/interrupts read */
+#define READ_PREPARE 0 /* Before write. Remember target CPU counter */
+#define READ_WRITTEN 1 /* After write. Remember total counter too */
+#define READ_CHECK 2 /* Check for the new interrupts */
+#define READ_POLL 3 /* Check for interrupts on target CPU only */
+
+/* Get number of interrupts on target CPU for each IRQ in list.
+   The /proc/interrupts has column for each online CPU. The header
+   line contains CPU names. The pending field is 2 if there are new
+   interrupts on target CPU. The pending_total field is set to the
+   total number of interrupts on READ_WRITTEN. The pending field is
+   VERIFY_FAILED on READ_CHECK if there are new interrupts on the other
+   CPUs only. */
+static void read_target_intr(birq_t *birq, lub_list_t *irqs, int mode)
+{
+	FILE *fd;
+	char *line = NULL;
+	size_t size = 0;
+	int *ids;
+	unsigned int cols = 0;
+	char *tok;
+	char *saveptr = NULL;
+
+	if (!(fd = source_open(birq, PROC_INTERRUPTS)))
+		return;
+	if (getline(&line, &size, fd) < 0)
+		goto out;
+	if (!(ids = malloc(sizeof(*ids) * NR_CPUS)))
+		goto out;
+	for (tok = strtok_r(line, " \t\n", &saveptr); tok && (cols < NR_CPUS);
+		tok = strtok_r(NULL, " \t\n", &saveptr)) {
+		if (strncmp(tok, "CPU", 3))
+			continue;
+		ids[cols++] = atoi(tok + 3);
+	}
+
+	while (getline(&line, &size, fd) >= 0) {
+		unsigned int num;
+		unsigned int col;
+		char *endptr;
+		irq_t *irq = NULL;
+		unsigned long long total = 0;
+		int target = 0;
+
+		num = strtoul(line, &endptr, 10);
+		if ((endptr == line) || (*endptr != ':'))
+			continue;
+		irq = irq_list_search(birq, irqs, num);
+		if (!irq || !irq->cpu)
+			continue;
+		tok = endptr + 1;
+		for (col = 0; col < cols; col++) {
+			unsigned long long intr;
+			intr = strtoull(tok, &endptr, 10);
+			if (endptr == tok)
+				break;
+			tok = endptr;
+			total += intr;
+			if (ids[col] != (int)irq->cpu->id)
+				continue;
+			if (mode == READ_PREPARE)
+				irq->pending_intr = intr;
+			else if (intr > irq->pending_intr)
+				target = 1;
+		}
+		if (target && (irq->pending > 0))
+			irq->pending = 2; /* Interrupts on target CPU */
+		if (mode == READ_WRITTEN)
+			irq->pending_total = total;
+		else if ((mode == READ_CHECK) && !target &&
+			(total > irq->pending_total))
+			irq->pending = VERIFY_FAILED;
+	}
+	free(ids);
+out:
+	free(line);
+	fclose(fd);
+}
+
+/* Remember number of interrupts on target CPUs before affinity change */
+void verify_prepare(birq_t *birq, lub_list_t *irqs)
+{
+	read_target_intr(birq, irqs, READ_PREPARE);
+}
+
+/* Check the pending IRQ. Returns 1 if the move is confirmed by
+   effective_affinity or by the interrupts on target CPU. Returns 0
+   if it's unknown yet. The known is set to 0 if IRQ has no
+   effective_affinity. */
+static int verify_irq(birq_t *birq, irq_t *irq, int *known)
+{
+	cpumask_t effective;
+	int confirmed = 0;
+
+	cpus_init(effective);
+	*known = !irq_get_effective(birq, irq, &effective);
+	/* The effective CPUs must be within target ones */
+	if (*known && !cpus_empty(effective)) {
+		cpumask_t outside;
+		cpus_init(outside);
+		cpus_copy(outside, irq->written);
+		cpus_complement(outside, outside);
+		cpus_and(outside, outside, effective);
+		if (cpus_empty(outside))
+			confirmed = 1;
+		cpus_free(outside);
+	}
+	cpus_free(effective);
+	if (irq->pending > 1)
+		confirmed = 1;
+
+	return confirmed;
+}
+
+/* Confirm the move and remember the time it took */
+static void verify_confirm(birq_t *birq, irq_t *irq,
+	unsigned long long now)
+{
+	irq->pending = 0;
+	irq->rollbacks = 0;
+	irq->effect_time = (float)(now - irq->pending_stamp) / 1000;
+	BIRQ_PROBE3(verified, irq->irq, irq->cpu->id,
+		now - irq->pending_stamp);
+	birq_log(birq, LOG_INFO, "IRQ %u affinity took effect on CPU%u in %.2f ms",
+		irq->irq, irq->cpu->id, irq->effect_time);
+}
+
+/* Check the pending IRQs again and again for VERIFY_POLL_TIME
+   after write. So the time of fast move is known with VERIFY_POLL_STEP
+   resolution but not with iteration one. The interrupts on the old
+   CPUs are not a failure here. They can be in flight. */
+static void verify_poll(birq_t *birq, lub_list_t *irqs, unsigned int num)
+{
+	struct timespec step;
+	unsigned int waited;
+
+	step.tv_sec = 0;
+	step.tv_nsec = VERIFY_POLL_STEP * 1000000L;
+	for (waited = 0; num && (waited < VERIFY_POLL_TIME);
+		waited += VERIFY_POLL_STEP) {
+		lub_list_node_t *iter;
+		unsigned long long now;
+
+		nanosleep(&step, NULL);
+		read_target_intr(birq, irqs, READ_POLL);
+		now = birq_clock(birq);
+		for (iter = lub_list_iterator_init(irqs); iter;
+			iter = lub_list_iterator_next(iter)) {
+			irq_t *irq = (irq_t *)lub_list_node__get_data(iter);
+			int known;
+
+			if ((irq->pending <= 0) || !irq->cpu)
+				continue;
+			if (verify_irq(birq, irq, &known)) {
+				verify_confirm(birq, irq, now);
+				num--;
+			}
+		}
+	}
+}
+
+/* Check the affinity changes just after write. The change is
+   confirmed by effective_affinity or by the interrupts on target CPU.
+   The inactive IRQ without effective_affinity can't be verified so
+   it's considered as moved. The others are polled for short time.
+   The still unconfirmed ones are left pending and are checked by
+   verify_pending() on the next iterations. */
+void verify_affinity(birq_t *birq, lub_list_t *irqs)
+{
+	lub_list_node_t *iter;
+	unsigned long long now;
+	unsigned int num = 0;
+
+	read_target_intr(birq, irqs, READ_WRITTEN);
+	now = birq_clock(birq);
+	for (iter = lub_list_iterator_init(irqs); iter;
+		iter = lub_list_iterator_next(iter)) {
+		irq_t *irq = (irq_t *)lub_list_node__get_data(iter);
+		int known;
+
+		if ((irq->pending <= 0) || !irq->cpu)
+			continue;
+		irq->pending_ticks = 0;
+		if (verify_irq(birq, irq, &known)) {
+			verify_confirm(birq, irq, now);
+			continue;
+		}
+		if (!known && (irq->intr == 0)) {
+			irq->pending = 0;
+			irq->effect_time = -1;
+			continue;
+		}
+		num++;
+	}
+	verify_poll(birq, irqs, num);
+}
+
+/* Check the affinity changes pending since previous iterations.
+   The slow IRQ can have no interrupts between the checks. It's not
+   a failure. Such IRQ stays pending. The move is failed when the
+   effective_affinity is still old and the IRQ gets new interrupts
+   on the other CPUs only. The failed move gets VERIFY_FAILED
+   pending state. The IRQ that is silent for VERIFY_TICKS iterations
+   is considered as moved. */
+void verify_pending(birq_t *birq, lub_list_t *irqs)
+{
+	lub_list_t *pending;
+	lub_list_node_t *iter;
+	unsigned long long now;
+
+	pending = lub_list_new(irq_list_compare);
+	for (iter = lub_list_iterator_init(irqs); iter;
+		iter = lub_list_iterator_next(iter)) {
+		irq_t *irq = (irq_t *)lub_list_node__get_data(iter);
+		if ((irq->pending > 0) && irq->cpu)
+			lub_list_add(pending, irq);
+	}
+	if (!lub_list_len(pending)) {
+		lub_list_free(pending);
+		return;
+	}
+
+	read_target_intr(birq, pending, READ_CHECK);
+	now = birq_clock(birq);
+	while ((iter = lub_list__get_head(pending))) {
+		irq_t *irq = (irq_t *)lub_list_node__get_data(iter);
+		int known;
+
+		lub_list_del(pending, iter);
+		lub_list_node_free(iter);
+		if (verify_irq(birq, irq, &known)) {
+			verify_confirm(birq, irq, now);
+			continue;
+		}
+		if (irq->pending == VERIFY_FAILED)
+			continue;
+		irq->pending_ticks++;
+		if (irq->pending_ticks >= VERIFY_TICKS) {
+			irq->pending = 0;
+			irq->effect_time = -1;
+		}
+	}
+	lub_list_free(pending);
+}
@@ -0,0 +1,23 @@
+#ifndef _verify_h
+#define _verify_h
+
+#include "lub/list.h"
+#include "libbirq.h"
+
+/* Max iterations to wait for the first interrupt of pending IRQ.
+   The silent IRQ can't be verified so it's considered as moved then. */
+#define VERIFY_TICKS 10
+/* The pending state of failed move. It must be rolled back */
+#define VERIFY_FAILED (-1)
+/* Time to poll the moves just after write, ms. The move that takes
+   effect within this time is measured with VERIFY_POLL_STEP
+   resolution. The slower moves are measured with iteration
+   resolution. */
+#define VERIFY_POLL_TIME 100
+#define VERIFY_POLL_STEP 10
+
+void verify_prepare(birq_t *birq, lub_list_t *irqs);
+void verify_affinity(birq_t *birq, lub_list_t *irqs);
+void verify_pending(birq_t *birq, lub_list_t *irqs);
+
+#endif
@@ -0,0 +1,458 @@
+/* vfio.c
+ * Place passthrough device IRQs next to the guest vCPU threads.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <limits.h>
+#include <ctype.h>
+#include <unistd.h>
+
+#include "lub/list.h"
+#include "cpumask.h"
+#include "cpu.h"
+#include "irq.h"
+#include "tasks.h"
+#include "vfio.h"
+#include "source.h"
+
+/* The QEMU vCPU threads are named like "CPU 0/KVM" */
+#define VCPU_THREAD_SUFFIX "/KVM"
+
+/* Get PCI address of vfio IRQ. The description looks like
+   "vfio-msix[0](0000:03:00.0)". The result must be freed. */
+static char *vfio_pci_addr(const irq_t *irq)
+{
+	const char *start;
+	const char *end;
+
+	if (!irq->desc)
+		return NULL;
+	if (!(start = strstr(irq->desc, "vfio-")))
+		return NULL;
+	if (!(start = strchr(start, '(')))
+		return NULL;
+	start++;
+	if (!(end = strchr(start, ')')))
+		return NULL;
+
+	return strndup(start, end - start);
+}
+
+/* Owner of vfio device */
+struct vfio_owner_s {
+	char *addr; /* PCI address */
+	char *group; /* IOMMU group. NULL if unknown */
+	pid_t pid; /* Process holding vfio file open. 0 - not found */
+	int fd; /* Descriptor of vfio file within process. -1 - unknown */
+};
+typedef struct vfio_owner_s vfio_owner_t;
+
+static int vfio_owner_compare(const void *first, const void *second)
+{
+	const vfio_owner_t *f = (const vfio_owner_t *)first;
+	const vfio_owner_t *s = (const vfio_owner_t *)second;
+
+	return strcmp(f->addr, s->addr);
+}
+
+static vfio_owner_t *vfio_owner_new(birq_t *birq, char *addr)
+{
+	vfio_owner_t *new;
+	char path[PATH_MAX];
+	char group[PATH_MAX];
+	ssize_t len;
+
+	if (!(new = malloc(sizeof(*new))))
+		return NULL;
+	new->addr = addr;
+	new->group = NULL;
+	new->pid = 0;
+	new->fd = -1;
+	snprintf(path, sizeof(path), "%s/%s/iommu_group",
+		SYSFS_PCI_PATH, addr);
+	path[sizeof(path) - 1] = '\0';
+	if ((len = source_readlink(birq, path, group, sizeof(group) - 1)) >= 0) {
+		group[len] = '\0';
+		if (strrchr(group, '/'))
+			new->group = strdup(strrchr(group, '/') + 1);
+	}
+
+	return new;
+}
+
+static void vfio_owner_free(vfio_owner_t *owner)
+{
+	free(owner->addr);
+	free(owner->group);
+	free(owner);
+}
+
+/* Free list of owners */
+static void vfio_owner_list_free(lub_list_t *owners)
+{
+	lub_list_node_t *node;
+
+	while ((node = lub_list__get_head(owners))) {
+		vfio_owner_free((vfio_owner_t *)lub_list_node__get_data(node));
+		lub_list_del(owners, node);
+		lub_list_node_free(node);
+	}
+}
+
+vfio_t *vfio_new(void)
+{
+	vfio_t *new;
+
+	if (!(new = malloc(sizeof(*new))))
+		return NULL;
+	new->owners = lub_list_new(vfio_owner_compare);
+
+	return new;
+}
+
+void vfio_free(vfio_t *vfio)
+{
+	if (!vfio)
+		return;
+	vfio_owner_list_free(vfio->owners);
+	lub_list_free(vfio->owners);
+	free(vfio);
+}
+
+/* Check if path (target of fd link) is a vfio file of PCI device.
+   It's the IOMMU group file /dev/vfio/<group> or the device file
+   /dev/vfio/devices/vfioN. */
+static int vfio_path_match(birq_t *birq, const char *link,
+	const vfio_owner_t *owner)
+{
+	char path[PATH_MAX];
+	const char *name = strrchr(link, '/') + 1;
+
+	/* Device file */
+	if (!strncmp(link, DEV_VFIO_PATH "devices/",
+		strlen(DEV_VFIO_PATH "devices/"))) {
+		snprintf(path, sizeof(path), "%s/%s/vfio-dev/%s",
+			SYSFS_PCI_PATH, owner->addr, name);
+		path[sizeof(path) - 1] = '\0';
+		return source_exists(birq, path);
+	}
+
+	/* IOMMU group file */
+	return owner->group && !strcmp(owner->group, name);
+}
+
+/* Check if fd link points to vfio file of PCI device */
+static int vfio_link_match(birq_t *birq, const char *path,
+	const vfio_owner_t *owner)
+{
+	char target[PATH_MAX];
+	ssize_t len;
+
+	if ((len = source_readlink(birq, path, target, sizeof(target) - 1)) < 0)
+		return 0;
+	target[len] = '\0';
+	if (strncmp(target, DEV_VFIO_PATH, strlen(DEV_VFIO_PATH)))
+		return 0;
+
+	return vfio_path_match(birq, target, owner);
+}
+
+/* Check the cached owner still holds vfio file of PCI device. The
+   alive process can close the file and other process (new VM) can open
+   it. The remembered descriptor is checked first. Then all descriptors
+   of the process are walked. */
+static int vfio_owner_valid(birq_t *birq, vfio_owner_t *owner)
+{
+	char path[PATH_MAX];
+	DIR *dir;
+	struct dirent *fent;
+	int found = 0;
+
+	if (owner->fd >= 0) {
+		snprintf(path, sizeof(path), "%s/%d/fd/%d",
+			PROC_PATH, owner->pid, owner->fd);
+		path[sizeof(path) - 1] = '\0';
+		if (vfio_link_match(birq, path, owner))
+			return 1;
+	}
+	snprintf(path, sizeof(path), "%s/%d/fd", PROC_PATH, owner->pid);
+	path[sizeof(path) - 1] = '\0';
+	if (!(dir = source_opendir(birq, path)))
+		return 0;
+	while ((fent = readdir(dir))) {
+		if (!isdigit(fent->d_name[0]))
+			continue;
+		snprintf(path, sizeof(path), "%s/%d/fd/%s",
+			PROC_PATH, owner->pid, fent->d_name);
+		path[sizeof(path) - 1] = '\0';
+		if (!vfio_link_match(birq, path, owner))
+			continue;
+		owner->fd = strtol(fent->d_name, NULL, 10);
+		found = 1;
+		break;
+	}
+	closedir(dir);
+
+	return found;
+}
+
+/* Find processes owning vfio files of PCI devices. The single walk
+   through /proc/<pid>/fd resolves all devices from the list. Returns
+   number of resolved devices. */
+static unsigned int vfio_owners_resolve(birq_t *birq, lub_list_t *owners)
+{
+	DIR *dir;
+	struct dirent *dent;
+	unsigned int left = lub_list_len(owners);
+
+	if (!left || !(dir = source_opendir(birq, PROC_PATH)))
+		return 0;
+	while (left && (dent = readdir(dir))) {
+		char path[PATH_MAX];
+		DIR *fd_dir;
+		struct dirent *fent;
+
+		if (!isdigit(dent->d_name[0]))
+			continue;
+		snprintf(path, sizeof(path), "%s/%s/fd", PROC_PATH, dent->d_name);
+		path[sizeof(path) - 1] = '\0';
+		if (!(fd_dir = source_opendir(birq, path)))
+			continue;
+		while (left && (fent = readdir(fd_dir))) {
+			char target[PATH_MAX];
+			lub_list_node_t *iter;
+			ssize_t len;
+
+			if (!isdigit(fent->d_name[0]))
+				continue;
+			snprintf(path, sizeof(path), "%s/%s/fd/%s",
+				PROC_PATH, dent->d_name, fent->d_name);
+			path[sizeof(path) - 1] = '\0';
+			if ((len = source_readlink(birq, path,
+				target, sizeof(target) - 1)) < 0)
+				continue;
+			target[len] = '\0';
+			if (strncmp(target, DEV_VFIO_PATH, strlen(DEV_VFIO_PATH)))
+				continue;
+			for (iter = lub_list_iterator_init(owners); iter;
+				iter = lub_list_iterator_next(iter)) {
+				vfio_owner_t *owner = (vfio_owner_t *)
+					lub_list_node__get_data(iter);
+				if (owner->pid)
+					continue;
+				if (!vfio_path_match(birq, target, owner))
+					continue;
+				owner->pid = strtol(dent->d_name, NULL, 10);
+				owner->fd = strtol(fent->d_name, NULL, 10);
+				left--;
+			}
+		}
+		closedir(fd_dir);
+	}
+	closedir(dir);
+
+	return lub_list_len(owners) - left;
+}
+
+/* Update cache of vfio device owners. The cached owner is valid while
+   its process holds the vfio file of device. It's checked on each
+   scan. The devices without cached owner are resolved by single walk
+   through processes. */
+static void vfio_owners_update(birq_t *birq, vfio_t *vfio,
+	lub_list_t *irqs)
+{
+	lub_list_node_t *iter;
+	lub_list_node_t *node;
+	lub_list_t *unresolved;
+
+	/* Drop owners that have gone or have closed vfio file */
+	iter = lub_list_iterator_init(vfio->owners);
+	while (iter) {
+		vfio_owner_t *owner = (vfio_owner_t *)lub_list_node__get_data(iter);
+		node = iter;
+		iter = lub_list_iterator_next(iter);
+		if (vfio_owner_valid(birq, owner))
+			continue;
+		lub_list_del(vfio->owners, node);
+		lub_list_node_free(node);
+		vfio_owner_free(owner);
+	}
+
+	/* Find devices without known owner */
+	unresolved = lub_list_new(vfio_owner_compare);
+	for (iter = lub_list_iterator_init(irqs); iter;
+		iter = lub_list_iterator_next(iter)) {
+		irq_t *irq = (irq_t *)lub_list_node__get_data(iter);
+		vfio_owner_t search;
+		vfio_owner_t *owner;
+
+		if (irq->blacklisted)
+			continue;
+		if (!(search.addr = vfio_pci_addr(irq)))
+			continue;
+		if (lub_list_search(vfio->owners, &search) ||
+			lub_list_search(unresolved, &search)) {
+			free(search.addr);
+			continue;
+		}
+		if (!(owner = vfio_owner_new(birq, search.addr))) {
+			free(search.addr);
+			continue;
+		}
+		lub_list_add(unresolved, owner);
+	}
+
+	/* Cache the resolved owners */
+	vfio_owners_resolve(birq, unresolved);
+	while ((node = lub_list__get_head(unresolved))) {
+		vfio_owner_t *owner = (vfio_owner_t *)lub_list_node__get_data(node);
+		lub_list_del(unresolved, node);
+		lub_list_node_free(node);
+		if (owner->pid)
+			lub_list_add(vfio->owners, owner);
+		else
+			vfio_owner_free(owner);
+	}
+	lub_list_free(unresolved);
+}
+
+/* Get cached owner of vfio IRQ. Returns PID or 0. */
+static pid_t vfio_owner(vfio_t *vfio, const irq_t *irq)
+{
+	lub_list_node_t *node;
+	vfio_owner_t search;
+
+	if (!(search.addr = vfio_pci_addr(irq)))
+		return 0;
+	node = lub_list_search(vfio->owners, &search);
+	free(search.addr);
+	if (!node)
+		return 0;
+
+	return ((vfio_owner_t *)lub_list_node__get_data(node))->pid;
+}
+
+/* Get CPU affinity of thread from "Cpus_allowed:" line of
+   /proc/<pid>/task/<tid>/status. Returns 0 on success. */
+static int vfio_thread_cpus(birq_t *birq, pid_t pid, const char *tid,
+	cpumask_t *cpumask)
+{
+	char path[PATH_MAX];
+	char *line = NULL;
+	size_t size = 0;
+	FILE *fd;
+	int ret = -1;
+
+	snprintf(path, sizeof(path), "%s/%d/task/%s/status",
+		PROC_PATH, pid, tid);
+	path[sizeof(path) - 1] = '\0';
+	if (!(fd = source_open(birq, path)))
+		return -1;
+	while (getline(&line, &size, fd) >= 0) {
+		char *mask;
+		if (strncmp(line, "Cpus_allowed:", strlen("Cpus_allowed:")))
+			continue;
+		mask = line + strlen("Cpus_allowed:");
+		mask += strspn(mask, " \t");
+		mask[strcspn(mask, "\n")] = '\0';
+		if (!cpumask_parse_user(mask, strlen(mask), *cpumask))
+			ret = 0;
+		break;
+	}
+	free(line);
+	fclose(fd);
+
+	return ret;
+}
+
+/* Get union of CPU affinities of the process vCPU threads */
+static void vfio_vcpu_cpus(birq_t *birq, pid_t pid, cpumask_t *cpumask)
+{
+	char path[PATH_MAX];
+	DIR *dir;
+	struct dirent *dent;
+	cpumask_t thread_cpus;
+
+	cpus_clear(*cpumask);
+	snprintf(path, sizeof(path), "%s/%d/task", PROC_PATH, pid);
+	path[sizeof(path) - 1] = '\0';
+	if (!(dir = source_opendir(birq, path)))
+		return;
+	cpus_init(thread_cpus);
+	while ((dent = readdir(dir))) {
+		char comm[32];
+		char *end;
+		FILE *fd;
+
+		if (!isdigit(dent->d_name[0]))
+			continue;
+		snprintf(path, sizeof(path), "%s/%d/task/%s/comm",
+			PROC_PATH, pid, dent->d_name);
+		path[sizeof(path) - 1] = '\0';
+		if (!(fd = source_open(birq, path)))
+			continue;
+		if (!fgets(comm, sizeof(comm), fd)) {
+			fclose(fd);
+			continue;
+		}
+		fclose(fd);
+		if ((end = strchr(comm, '\n')))
+			*end = '\0';
+		if (strlen(comm) < strlen(VCPU_THREAD_SUFFIX))
+			continue;
+		if (strcmp(comm + strlen(comm) - strlen(VCPU_THREAD_SUFFIX),
+			VCPU_THREAD_SUFFIX))
+			continue;
+		if (vfio_thread_cpus(birq, pid, dent->d_name, &thread_cpus))
+			continue;
+		cpus_or(*cpumask, *cpumask, thread_cpus);
+	}
+	cpus_free(thread_cpus);
+	closedir(dir);
+}
+
+/* Find the QEMU process owning the vfio device for each vfio IRQ and
+   restrict IRQ placement to the CPUs of its vCPU threads. Move IRQ when
+   vCPU threads are re-pinned. */
+void scan_vfio(birq_t *birq, vfio_t *vfio, lub_list_t *irqs,
+	lub_list_t *balance_irqs, int enabled)
+{
+	lub_list_node_t *iter;
+
+	if (!vfio)
+		return;
+	if (enabled)
+		vfio_owners_update(birq, vfio, irqs);
+
+	for (iter = lub_list_iterator_init(irqs); iter;
+		iter = lub_list_iterator_next(iter)) {
+		irq_t *irq = (irq_t *)lub_list_node__get_data(iter);
+		pid_t pid;
+
+		cpus_clear(irq->vcpu_cpus);
+		if (!enabled || irq->blacklisted)
+			continue;
+		if (!(pid = vfio_owner(vfio, irq)))
+			continue;
+		vfio_vcpu_cpus(birq, pid, &irq->vcpu_cpus);
+		if (cpus_empty(irq->vcpu_cpus))
+			continue;
+
+		/* Follow the vCPU threads. The vfio IRQs can have no
+		   interrupts on host (posted interrupts), so move it anyway. */
+		if (irq->cpu && cpu_isset(irq->cpu->id, irq->vcpu_cpus))
+			continue;
+		if (irq->weight)
+			continue;
+		birq_log(birq, LOG_INFO,
+			"Move vfio IRQ %u to vCPU threads of process %d",
+			irq->irq, pid);
+		/* Don't move this IRQ while next iteration. */
+		irq->weight = 1;
+		lub_list_add(balance_irqs, irq);
+	}
+}
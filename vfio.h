@@ -0,0 +1,19 @@
+#ifndef _vfio_h
+#define _vfio_h
+
+#include "lub/list.h"
+#include "libbirq.h"
+
+#define DEV_VFIO_PATH "/dev/vfio/"
+
+struct vfio_s {
+	lub_list_t *owners; /* Cache of vfio device owners */
+};
+typedef struct vfio_s vfio_t;
+
+vfio_t *vfio_new(void);
+void vfio_free(vfio_t *vfio);
+void scan_vfio(birq_t *birq, vfio_t *vfio, lub_list_t *irqs,
+	lub_list_t *balance_irqs, int enabled);
+
+#endif